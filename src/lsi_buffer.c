@@ -0,0 +1,74 @@
+#include <string.h>
+#include "lsi_buffer.h"
+#include "lsi_pool.h"
+
+static void release_data(lsi_buffer *buffer)
+{
+	if (buffer->pool != NULL) {
+		lsi_pool_release(buffer->pool, buffer->data, buffer->cap);
+	} else {
+		free(buffer->data);
+	}
+}
+
+int lsi_buffer_reserve(lsi_buffer *buffer, size_t extra)
+{
+	if (buffer->cap - buffer->len >= extra) {
+		return 0;
+	}
+	size_t size = lsi_buffer_size(buffer);
+	// reclaim consumed space first
+	if (buffer->start > 0 && buffer->cap - size >= extra) {
+		memmove(buffer->data, lsi_buffer_begin(buffer), size);
+		buffer->start = 0;
+		buffer->len = size;
+		return 0;
+	}
+	size_t cap = buffer->cap == 0 ? 64 : buffer->cap;
+	while (cap - size < extra) {
+		cap *= 2;
+	}
+	char *data = buffer->pool != NULL ?
+			     (char *)lsi_pool_alloc(buffer->pool, &cap) :
+			     (char *)malloc(cap);
+	if (data == NULL) {
+		return -1;
+	}
+	if (size > 0) {
+		memcpy(data, lsi_buffer_begin(buffer), size);
+	}
+	release_data(buffer);
+	buffer->data = data;
+	buffer->start = 0;
+	buffer->len = size;
+	buffer->cap = cap;
+	return 0;
+}
+
+int lsi_buffer_append(lsi_buffer *buffer, const void *data, size_t size)
+{
+	if (lsi_buffer_reserve(buffer, size) == -1) {
+		return -1;
+	}
+	memcpy(lsi_buffer_end(buffer), data, size);
+	buffer->len += size;
+	return 0;
+}
+
+void lsi_buffer_consume(lsi_buffer *buffer, size_t size)
+{
+	buffer->start += size;
+	if (buffer->start >= buffer->len) {
+		buffer->start = 0;
+		buffer->len = 0;
+	}
+}
+
+void lsi_buffer_free(lsi_buffer *buffer)
+{
+	release_data(buffer);
+	buffer->data = NULL;
+	buffer->start = 0;
+	buffer->len = 0;
+	buffer->cap = 0;
+}
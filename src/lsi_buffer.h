@@ -0,0 +1,29 @@
+#ifndef LSI_BUFFER_H__
+#define LSI_BUFFER_H__
+
+#include <stdlib.h>
+
+struct lsi_pool;
+
+// growable byte buffer, valid data is in [start, len)
+typedef struct lsi_buffer {
+    char* data;
+    size_t start;
+    size_t len;
+    size_t cap;
+    struct lsi_pool* pool; // storage borrowed from pool when set
+} lsi_buffer;
+
+#define lsi_buffer_size(b)  ((b)->len - (b)->start)
+#define lsi_buffer_begin(b) ((b)->data + (b)->start)
+#define lsi_buffer_end(b)   ((b)->data + (b)->len)
+
+// makes room for at least extra bytes after len
+int lsi_buffer_reserve(lsi_buffer* buffer, size_t extra);
+int lsi_buffer_append(lsi_buffer* buffer, const void* data, size_t size);
+// drops size bytes from the front
+void lsi_buffer_consume(lsi_buffer* buffer, size_t size);
+// releases storage, the buffer stays usable
+void lsi_buffer_free(lsi_buffer* buffer);
+
+#endif /* LSI_BUFFER_H__ */
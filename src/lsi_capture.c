@@ -0,0 +1,111 @@
+#include <string.h>
+#include "lsi_capture.h"
+#include "lsi_common.h"
+
+int lsi_capture_create(lsi_capture *capture, const char *path, int payloads)
+{
+	memset(capture, 0, sizeof(lsi_capture));
+	capture->file = fopen(path, "wb");
+	if (capture->file == NULL) {
+		return -1;
+	}
+	capture->flags = payloads ? CAPTURE_PAYLOADS : 0;
+	capture->started = lsi_now_us();
+	char header[CAPTURE_HEADER_SIZE];
+	memcpy(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE);
+	lsi_put_u32(header + CAPTURE_MAGIC_SIZE, capture->flags);
+	if (fwrite(header, 1, sizeof(header), capture->file) !=
+	    sizeof(header)) {
+		lsi_capture_close(capture);
+		return -1;
+	}
+	return 0;
+}
+
+int lsi_capture_write(lsi_capture *capture, int type, uint32_t connection,
+		      const char *data, size_t size)
+{
+	char record[CAPTURE_RECORD_SIZE];
+	record[0] = (char)type;
+	lsi_put_u32(record + 1, connection);
+	lsi_put_u64(record + 5, lsi_now_us() - capture->started);
+	lsi_put_u32(record + 13, (uint32_t)size);
+	if (fwrite(record, 1, sizeof(record), capture->file) !=
+	    sizeof(record)) {
+		return -1;
+	}
+	if (type == CAPTURE_DATA && (capture->flags & CAPTURE_PAYLOADS) &&
+	    fwrite(data, 1, size, capture->file) != size) {
+		return -1;
+	}
+	capture->records++;
+	return 0;
+}
+
+int lsi_capture_open(lsi_capture *capture, const char *path)
+{
+	memset(capture, 0, sizeof(lsi_capture));
+	capture->file = fopen(path, "rb");
+	if (capture->file == NULL) {
+		return -1;
+	}
+	char header[CAPTURE_HEADER_SIZE];
+	if (fread(header, 1, sizeof(header), capture->file) !=
+		    sizeof(header) ||
+	    memcmp(header, CAPTURE_MAGIC, CAPTURE_MAGIC_SIZE) != 0) {
+		lsi_capture_close(capture);
+		return -1;
+	}
+	capture->flags = lsi_get_u32(header + CAPTURE_MAGIC_SIZE);
+	return 0;
+}
+
+int lsi_capture_next(lsi_capture *capture, lsi_capture_record *record)
+{
+	char header[CAPTURE_RECORD_SIZE];
+	size_t got = fread(header, 1, sizeof(header), capture->file);
+	if (got == 0 && feof(capture->file)) {
+		return 0;
+	}
+	if (got != sizeof(header)) {
+		return -1;
+	}
+	record->type = (unsigned char)header[0];
+	record->connection = lsi_get_u32(header + 1);
+	record->time_us = lsi_get_u64(header + 5);
+	record->size = lsi_get_u32(header + 13);
+	record->data = NULL;
+	if (record->type < CAPTURE_OPEN || record->type > CAPTURE_CLOSE) {
+		return -1;
+	}
+	capture->records++;
+	if (record->type != CAPTURE_DATA ||
+	    !(capture->flags & CAPTURE_PAYLOADS)) {
+		return 1;
+	}
+	if (record->size > capture->scratch_size) {
+		char *scratch = (char *)realloc(capture->scratch, record->size);
+		if (scratch == NULL) {
+			return -1;
+		}
+		capture->scratch = scratch;
+		capture->scratch_size = record->size;
+	}
+	if (fread(capture->scratch, 1, record->size, capture->file) !=
+	    record->size) {
+		return -1;
+	}
+	record->data = capture->scratch;
+	return 1;
+}
+
+void lsi_capture_close(lsi_capture *capture)
+{
+	if (capture->file != NULL) {
+		fclose(capture->file);
+		capture->file = NULL;
+	}
+	free(capture->scratch);
+	capture->scratch = NULL;
+	capture->scratch_size = 0;
+}
@@ -0,0 +1,49 @@
+#ifndef LSI_CAPTURE_H__
+#define LSI_CAPTURE_H__
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+// file starts with the magic and u32 flags, followed by records of u8 type,
+// u32 connection, u64 microseconds since the capture started and u32 size,
+// data records carry size payload bytes when CAPTURE_PAYLOADS is set
+// all integers are big endian
+#define CAPTURE_MAGIC       "LSICAP01"
+#define CAPTURE_MAGIC_SIZE  8
+#define CAPTURE_HEADER_SIZE 12
+#define CAPTURE_RECORD_SIZE 17
+#define CAPTURE_PAYLOADS    1
+
+// record types
+#define CAPTURE_OPEN        1
+#define CAPTURE_DATA        2 // bytes received in one read
+#define CAPTURE_CLOSE       3
+
+typedef struct lsi_capture_record {
+    int type;
+    uint32_t connection;
+    uint64_t time_us;
+    uint32_t size;
+    const char* data; // NULL for captures without payloads
+} lsi_capture_record;
+
+typedef struct lsi_capture {
+    FILE* file; // NULL when not open
+    uint32_t flags;
+    uint64_t started; // lsi_now_us() when created
+    uint64_t records;
+    char* scratch; // payload of the last record read
+    size_t scratch_size;
+} lsi_capture;
+
+// creates capture file, payloads 0 records sizes only
+int lsi_capture_create(lsi_capture* capture, const char* path, int payloads);
+int lsi_capture_write(lsi_capture* capture, int type, uint32_t connection, const char* data, size_t size);
+int lsi_capture_open(lsi_capture* capture, const char* path);
+// returns 1 with record filled, 0 at the end of the file and -1 when the
+// file is truncated or invalid, record data is valid until the next call
+int lsi_capture_next(lsi_capture* capture, lsi_capture_record* record);
+void lsi_capture_close(lsi_capture* capture);
+
+#endif /* LSI_CAPTURE_H__ */
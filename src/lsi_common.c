@@ -1,6 +1,13 @@
+#define _GNU_SOURCE // memmem
 #include "lsi_common.h"
+#include "lsi_tcp.h"
 #include <stdlib.h>
 #include <string.h>
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
 
 char*
 get_endpoint_path(const char* endpoint, size_t* endpoint_len) {
@@ -8,7 +15,8 @@ get_endpoint_path(const char* endpoint, size_t* endpoint_len) {
         return NULL;
     }
 #ifdef _WIN32
-    int needsPrefix = endpoint_len <= PIPE_PREFIX_LEN || strncmp(endpoint, PIPE_PREFIX, PIPE_PREFIX_LEN) != 0;
+    int needsPrefix = (endpoint_len <= PIPE_PREFIX_LEN || strncmp(endpoint, PIPE_PREFIX, PIPE_PREFIX_LEN) != 0) &&
+                      !lsi_is_tcp_endpoint(endpoint); // tcp://host:port is kept as is
 
     size_t pipe_prefix_len = needsPrefix ? PIPE_PREFIX_LEN : 0;
     size_t result_len = pipe_prefix_len + *endpoint_len;
@@ -36,4 +44,84 @@ get_endpoint_path(const char* endpoint, size_t* endpoint_len) {
     result[result_len] = '\0'; // null-terminate the string`
     *endpoint_len = result_len;
     return result;
+}
+
+uint64_t
+lsi_now_ms(void) {
+#ifdef _WIN32
+    return (uint64_t)GetTickCount64();
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000 + (uint64_t)ts.tv_nsec / 1000000;
+#endif
+}
+
+uint64_t
+lsi_now_us(void) {
+#ifdef _WIN32
+    LARGE_INTEGER frequency, counter;
+    QueryPerformanceFrequency(&frequency);
+    QueryPerformanceCounter(&counter);
+    return (uint64_t)(counter.QuadPart / (frequency.QuadPart / 1000000));
+#else
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+#endif
+}
+
+const char*
+lsi_memmem(const char* haystack, size_t haystack_len, const char* needle, size_t needle_len) {
+    if (needle_len == 0) {
+        return haystack;
+    }
+    if (needle_len == 1) {
+        return (const char*)memchr(haystack, needle[0], haystack_len);
+    }
+#if defined(__GLIBC__) || defined(__APPLE__) || defined(__FreeBSD__)
+    return (const char*)memmem(haystack, haystack_len, needle, needle_len);
+#else
+    const char* end = haystack + haystack_len;
+    while (haystack_len >= needle_len) {
+        const char* p = (const char*)memchr(haystack, needle[0], haystack_len - needle_len + 1);
+        if (p == NULL) {
+            return NULL;
+        }
+        if (memcmp(p, needle, needle_len) == 0) {
+            return p;
+        }
+        haystack = p + 1;
+        haystack_len = end - haystack;
+    }
+    return NULL;
+#endif
+}
+
+void lsi_put_u32(char* out, uint32_t value) {
+    out[0] = (char)(value >> 24);
+    out[1] = (char)(value >> 16);
+    out[2] = (char)(value >> 8);
+    out[3] = (char)value;
+}
+
+uint32_t lsi_get_u32(const char* in) {
+    const unsigned char* p = (const unsigned char*)in;
+    return (uint32_t)p[0] << 24 | (uint32_t)p[1] << 16 |
+           (uint32_t)p[2] << 8 | (uint32_t)p[3];
+}
+
+void lsi_put_u64(char* out, uint64_t value) {
+    for (int i = 7; i >= 0; i--) {
+        out[i] = (char)(value & 0xff);
+        value >>= 8;
+    }
+}
+
+uint64_t lsi_get_u64(const char* in) {
+    uint64_t value = 0;
+    for (int i = 0; i < 8; i++) {
+        value = (value << 8) | (unsigned char)in[i];
+    }
+    return value;
 }
\ No newline at end of file
@@ -1,6 +1,7 @@
 #ifndef LSI_COMMON_H__
 #define LSI_COMMON_H__
 
+#include <stdint.h>
 #include <stdlib.h>
 
 #define PIPE_PREFIX     "\\\\.\\pipe\\"
@@ -13,5 +14,14 @@
 #endif
 
 char* get_endpoint_path(const char* endpoint, size_t* endpoint_len);
+uint64_t lsi_now_ms(void);
+uint64_t lsi_now_us(void);
+// memmem backed by the libc (vectorized) implementation where available
+const char* lsi_memmem(const char* haystack, size_t haystack_len, const char* needle, size_t needle_len);
+// big endian, used for message length prefixes and frame headers
+void lsi_put_u32(char* out, uint32_t value);
+uint32_t lsi_get_u32(const char* in);
+void lsi_put_u64(char* out, uint64_t value);
+uint64_t lsi_get_u64(const char* in);
 
 #endif /* LSI_COMMON_H__ */
\ No newline at end of file
@@ -6,6 +6,14 @@
 static const struct luaL_Reg lsiCore[] = {
 	{ "listen", lsi_listen },
 	{ "connect", lsi_socket_connect },
+	{ "selector", lsi_selector_new },
+	{ "buffer", lsi_buffer_new },
+	{ "open_inbox", lsi_inbox_open },
+	{ "open_state", lsi_state_open },
+	{ "publish_state", lsi_state_publish_named },
+	{ "read_state", lsi_state_read_named },
+	{ "pool", lsi_conn_pool_new },
+	{ "replay", lsi_replay_run },
 	{ NULL, NULL },
 };
 
@@ -13,6 +21,12 @@ int luaopen_lua_simple_ipc_core(lua_State *L)
 {
 	lsi_create_server_meta(L);
 	lsi_create_socket_meta(L);
+	lsi_create_selector_meta(L);
+	lsi_create_buffer_meta(L);
+	lsi_create_inbox_meta(L);
+	lsi_create_stream_meta(L);
+	lsi_create_state_meta(L);
+	lsi_create_conn_pool_meta(L);
 
 	lua_newtable(L);
 	luaL_setfuncs(L, lsiCore, 0);
@@ -1,11 +1,20 @@
 #ifndef LSI_CORE_H__
 #define LSI_CORE_H__
 
+#include "lsi_core_buffer.h"
+#include "lsi_core_conn_pool.h"
+#include "lsi_core_inbox.h"
+#include "lsi_core_replay.h"
+#include "lsi_core_selector.h"
 #include "lsi_core_server.h"
 #include "lsi_core_socket.h"
+#include "lsi_core_state.h"
+#include "lsi_core_stream.h"
 #include "lua.h"
 
 #define DEFAULT_BUFFER_SIZE 1024 // 1 KB
+#define DEFAULT_COALESCE_SIZE 65536 // corked writes are flushed beyond this
+#define STREAM_QUEUE_LIMIT (4 * DEFAULT_COALESCE_SIZE) // write_stream waits beyond this
 
 int luaopen_lua_simple_ipc_core(lua_State* L);
 
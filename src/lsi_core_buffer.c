@@ -0,0 +1,315 @@
+#include <stdint.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_common.h"
+#include "lsi_core_buffer.h"
+#include "lsi_errors.h"
+#include "lua.h"
+#include "lerror.h"
+
+lsi_byte_buffer *lsi_byte_buffer_push(lua_State *L)
+{
+	lsi_byte_buffer *buf = (lsi_byte_buffer *)lua_newuserdatauv(
+		L, sizeof(lsi_byte_buffer), 1);
+	memset(buf, 0, sizeof(lsi_byte_buffer));
+	luaL_getmetatable(L, LSI_BUFFER_METATABLE);
+	lua_setmetatable(L, -2);
+	return buf;
+}
+
+const char *lsi_byte_buffer_data(lsi_byte_buffer *buf, size_t *len)
+{
+	if (buf->parent == NULL) {
+		*len = lsi_buffer_size(&buf->buffer);
+		return lsi_buffer_begin(&buf->buffer);
+	}
+	size_t parent_len;
+	const char *data = lsi_byte_buffer_data(buf->parent, &parent_len);
+	if (buf->offset >= parent_len) {
+		*len = 0;
+		return data + parent_len;
+	}
+	*len = parent_len - buf->offset < buf->length ?
+		       parent_len - buf->offset :
+		       buf->length;
+	return data + buf->offset;
+}
+
+static lsi_byte_buffer *check_buffer(lua_State *L)
+{
+	return (lsi_byte_buffer *)luaL_checkudata(L, 1, LSI_BUFFER_METATABLE);
+}
+
+// translates lua style (1 based, negative from the end) position
+static size_t translate_position(lua_Integer pos, size_t len)
+{
+	if (pos > 0) {
+		return (size_t)pos;
+	}
+	if (pos == 0) {
+		return 1;
+	}
+	if (pos < -(lua_Integer)len) {
+		return 1;
+	}
+	return len + (size_t)pos + 1;
+}
+
+// core.buffer([capacity])
+int lsi_buffer_new(lua_State *L)
+{
+	lua_Integer capacity = luaL_optinteger(L, 1, 0);
+	lsi_byte_buffer *buf = lsi_byte_buffer_push(L);
+	if (capacity > 0 && lsi_buffer_reserve(&buf->buffer, capacity) == -1) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	return 1;
+}
+
+int lsi_buffer_len(lua_State *L)
+{
+	size_t len;
+	lsi_byte_buffer_data(check_buffer(L), &len);
+	lua_pushinteger(L, len);
+	return 1;
+}
+
+// buf:tostring([i], [j]) - copies (part of) the content to a lua string
+int lsi_buffer_tostring(lua_State *L)
+{
+	size_t len;
+	const char *data = lsi_byte_buffer_data(check_buffer(L), &len);
+	size_t i = translate_position(luaL_optinteger(L, 2, 1), len);
+	size_t j = translate_position(luaL_optinteger(L, 3, -1), len);
+	if (j > len) {
+		j = len;
+	}
+	if (i > j) {
+		lua_pushliteral(L, "");
+	} else {
+		lua_pushlstring(L, data + i - 1, j - i + 1);
+	}
+	return 1;
+}
+
+// buf:sub(i, [j]) - returns view of the given range without copying
+int lsi_buffer_sub(lua_State *L)
+{
+	lsi_byte_buffer *buf = check_buffer(L);
+	size_t len;
+	lsi_byte_buffer_data(buf, &len);
+	size_t i = translate_position(luaL_checkinteger(L, 2), len);
+	size_t j = translate_position(luaL_optinteger(L, 3, -1), len);
+	if (j > len) {
+		j = len;
+	}
+	lsi_byte_buffer *view = lsi_byte_buffer_push(L);
+	view->parent = buf;
+	view->offset = i - 1;
+	view->length = i > j ? 0 : j - i + 1;
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, -2, 1); // keep parent alive
+	return 1;
+}
+
+// buf:byte([i]) - returns byte at i
+int lsi_buffer_byte(lua_State *L)
+{
+	size_t len;
+	const char *data = lsi_byte_buffer_data(check_buffer(L), &len);
+	size_t i = translate_position(luaL_optinteger(L, 2, 1), len);
+	if (i > len) {
+		return 0;
+	}
+	lua_pushinteger(L, (unsigned char)data[i - 1]);
+	return 1;
+}
+
+// reads size bytes integer at position given by argument 2
+// optional argument 3 selects byte order ("<" little, ">" big endian)
+static int read_integer(lua_State *L, int size, int is_signed)
+{
+	size_t len;
+	const char *data = lsi_byte_buffer_data(check_buffer(L), &len);
+	size_t i = translate_position(luaL_optinteger(L, 2, 1), len);
+	const char *order = luaL_optstring(L, 3, "<");
+	if (i + size - 1 > len) {
+		return 0;
+	}
+	const unsigned char *p = (const unsigned char *)data + i - 1;
+	uint64_t value = 0;
+	for (int k = 0; k < size; k++) {
+		int shift = order[0] == '>' ? 8 * (size - 1 - k) : 8 * k;
+		value |= (uint64_t)p[k] << shift;
+	}
+	if (is_signed && size < 8 && (value >> (8 * size - 1)) & 1) {
+		value |= ~(uint64_t)0 << (8 * size); // sign extend
+	}
+	lua_pushinteger(L, (lua_Integer)value);
+	return 1;
+}
+
+int lsi_buffer_u8(lua_State *L)
+{
+	return read_integer(L, 1, 0);
+}
+
+int lsi_buffer_u16(lua_State *L)
+{
+	return read_integer(L, 2, 0);
+}
+
+int lsi_buffer_u32(lua_State *L)
+{
+	return read_integer(L, 4, 0);
+}
+
+int lsi_buffer_i8(lua_State *L)
+{
+	return read_integer(L, 1, 1);
+}
+
+int lsi_buffer_i16(lua_State *L)
+{
+	return read_integer(L, 2, 1);
+}
+
+int lsi_buffer_i32(lua_State *L)
+{
+	return read_integer(L, 4, 1);
+}
+
+int lsi_buffer_i64(lua_State *L)
+{
+	return read_integer(L, 8, 1);
+}
+
+// buf:find(needle, [init]) - plain search, returns start and end position
+int lsi_buffer_find(lua_State *L)
+{
+	size_t len, needle_len;
+	const char *data = lsi_byte_buffer_data(check_buffer(L), &len);
+	const char *needle = luaL_checklstring(L, 2, &needle_len);
+	size_t init = translate_position(luaL_optinteger(L, 3, 1), len);
+	if (init > len + 1) {
+		lua_pushnil(L);
+		return 1;
+	}
+	const char *found = lsi_memmem(data + init - 1, len - init + 1, needle,
+				       needle_len);
+	if (found == NULL) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, found - data + 1);
+	lua_pushinteger(L, found - data + needle_len);
+	return 2;
+}
+
+// NULL for read only views
+static lsi_byte_buffer *check_writable(lua_State *L)
+{
+	lsi_byte_buffer *buf = check_buffer(L);
+	return buf->parent != NULL ? NULL : buf;
+}
+
+// buf:append(data)
+int lsi_buffer_append_lua(lua_State *L)
+{
+	lsi_byte_buffer *buf = check_writable(L);
+	if (buf == NULL) {
+		return push_error(L, ERROR_BUFFER_VIEW_READ_ONLY);
+	}
+	size_t len;
+	const char *data = luaL_checklstring(L, 2, &len);
+	if (lsi_buffer_append(&buf->buffer, data, len) == -1) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// buf:consume(n) - drops n bytes from the front
+int lsi_buffer_consume_lua(lua_State *L)
+{
+	lsi_byte_buffer *buf = check_writable(L);
+	if (buf == NULL) {
+		return push_error(L, ERROR_BUFFER_VIEW_READ_ONLY);
+	}
+	lua_Integer n = luaL_checkinteger(L, 2);
+	size_t len = lsi_buffer_size(&buf->buffer);
+	lsi_buffer_consume(&buf->buffer, n < 0 ? 0 :
+					 (size_t)n > len ? len :
+							    (size_t)n);
+	return 0;
+}
+
+int lsi_buffer_clear(lua_State *L)
+{
+	lsi_byte_buffer *buf = check_writable(L);
+	if (buf == NULL) {
+		return push_error(L, ERROR_BUFFER_VIEW_READ_ONLY);
+	}
+	lsi_buffer_consume(&buf->buffer, lsi_buffer_size(&buf->buffer));
+	return 0;
+}
+
+int lsi_buffer_gc(lua_State *L)
+{
+	lsi_byte_buffer *buf = (lsi_byte_buffer *)lua_touserdata(L, 1);
+	if (buf != NULL) {
+		lsi_buffer_free(&buf->buffer);
+	}
+	return 0;
+}
+
+int lsi_create_buffer_meta(lua_State *L)
+{
+	luaL_newmetatable(L, LSI_BUFFER_METATABLE);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, lsi_buffer_len);
+	lua_setfield(L, -2, "len");
+	lua_pushcfunction(L, lsi_buffer_tostring);
+	lua_setfield(L, -2, "tostring");
+	lua_pushcfunction(L, lsi_buffer_sub);
+	lua_setfield(L, -2, "sub");
+	lua_pushcfunction(L, lsi_buffer_byte);
+	lua_setfield(L, -2, "byte");
+	lua_pushcfunction(L, lsi_buffer_find);
+	lua_setfield(L, -2, "find");
+	lua_pushcfunction(L, lsi_buffer_u8);
+	lua_setfield(L, -2, "u8");
+	lua_pushcfunction(L, lsi_buffer_u16);
+	lua_setfield(L, -2, "u16");
+	lua_pushcfunction(L, lsi_buffer_u32);
+	lua_setfield(L, -2, "u32");
+	lua_pushcfunction(L, lsi_buffer_i8);
+	lua_setfield(L, -2, "i8");
+	lua_pushcfunction(L, lsi_buffer_i16);
+	lua_setfield(L, -2, "i16");
+	lua_pushcfunction(L, lsi_buffer_i32);
+	lua_setfield(L, -2, "i32");
+	lua_pushcfunction(L, lsi_buffer_i64);
+	lua_setfield(L, -2, "i64");
+	lua_pushcfunction(L, lsi_buffer_append_lua);
+	lua_setfield(L, -2, "append");
+	lua_pushcfunction(L, lsi_buffer_consume_lua);
+	lua_setfield(L, -2, "consume");
+	lua_pushcfunction(L, lsi_buffer_clear);
+	lua_setfield(L, -2, "clear");
+	lua_pushstring(L, LSI_BUFFER_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lsi_buffer_len);
+	lua_setfield(L, -2, "__len");
+	lua_pushcfunction(L, lsi_buffer_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushcfunction(L, lsi_buffer_gc);
+	lua_setfield(L, -2, "__gc");
+
+	lua_pop(L, 1);
+	return 0;
+}
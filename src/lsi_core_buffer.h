@@ -0,0 +1,26 @@
+#ifndef LSI_CORE_BUFFER_H__
+#define LSI_CORE_BUFFER_H__
+
+#include "lsi_buffer.h"
+#include "lua.h"
+
+#define LSI_BUFFER_METATABLE "LSI_BUFFER"
+
+// mutable byte buffer exposed to lua
+// views share memory of their parent (kept alive as uservalue) and are
+// read only, they see parent modifications
+typedef struct lsi_byte_buffer {
+    lsi_buffer buffer;
+    struct lsi_byte_buffer* parent; // NULL unless view
+    size_t offset;
+    size_t length;
+} lsi_byte_buffer;
+
+int lsi_create_buffer_meta(lua_State* L);
+int lsi_buffer_new(lua_State* L);
+// pushes new empty buffer userdata
+lsi_byte_buffer* lsi_byte_buffer_push(lua_State* L);
+// returns current content of buffer or view
+const char* lsi_byte_buffer_data(lsi_byte_buffer* buf, size_t* len);
+
+#endif /* LSI_CORE_BUFFER_H__ */
@@ -0,0 +1,350 @@
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_common.h"
+#include "lsi_core_conn_pool.h"
+#include "lsi_core_socket.h"
+#include "lsi_errors.h"
+#include "lua.h"
+#include "lerror.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+// only a quiet connection can be handed out, pending input is either a
+// closed peer or a reply nobody read
+static int connection_healthy(lsi_socket *sock)
+{
+	if (sock->closed || lsi_buffer_size(&sock->rbuf) > 0 ||
+	    sock->wq.head != NULL) {
+		return 0;
+	}
+#ifndef _WIN32
+	struct pollfd pfd;
+	pfd.fd = sock->fd;
+	pfd.events = POLLIN;
+	pfd.revents = 0;
+	if (poll(&pfd, 1, 0) == -1) {
+		return 0;
+	}
+	return pfd.revents == 0;
+#else
+	return 1;
+#endif
+}
+
+// pushes new connection, on failure the results of core.connect are left
+// on the stack and 0 is returned
+static int open_connection(lua_State *L, lsi_conn_pool *pool, int idx)
+{
+	int top = lua_gettop(L);
+	lua_pushcfunction(L, lsi_socket_connect);
+	lua_getiuservalue(L, idx, 1); // endpoint
+	lua_getiuservalue(L, idx, 2); // options
+	lua_call(L, 2, LUA_MULTRET);
+	if (luaL_testudata(L, top + 1, LSI_SOCKET_METATABLE) == NULL) {
+		return 0;
+	}
+	lua_settop(L, top + 1);
+	pool->connects++;
+	return 1;
+}
+
+// closes and pops the socket on top
+static void close_connection(lua_State *L)
+{
+	lua_pushcfunction(L, lsi_socket_close);
+	lua_insert(L, -2);
+	lua_call(L, 1, 0);
+}
+
+// moves the socket on top onto the idle stack
+static void push_idle(lua_State *L, lsi_conn_pool *pool, int idx)
+{
+	lua_getiuservalue(L, idx, 3);
+	lua_insert(L, -2);
+	lua_rawseti(L, -2, (lua_Integer)pool->idle + 1);
+	lua_pop(L, 1);
+	pool->idle_since[pool->idle++] = lsi_now_ms();
+}
+
+// pushes the most recently released socket
+static void pop_idle(lua_State *L, lsi_conn_pool *pool, int idx)
+{
+	lua_getiuservalue(L, idx, 3);
+	lua_rawgeti(L, -1, (lua_Integer)pool->idle);
+	lua_pushnil(L);
+	lua_rawseti(L, -3, (lua_Integer)pool->idle);
+	lua_remove(L, -2);
+	pool->idle--;
+}
+
+// adds the socket on top to the borrowed set or removes it
+static void set_borrowed(lua_State *L, lsi_conn_pool *pool, int idx,
+			 int borrowed)
+{
+	lua_getiuservalue(L, idx, 4);
+	lua_pushvalue(L, -2);
+	if (borrowed) {
+		lua_pushboolean(L, 1);
+		pool->borrowed++;
+	} else {
+		lua_pushnil(L);
+		pool->borrowed--;
+	}
+	lua_rawset(L, -3);
+	lua_pop(L, 1);
+}
+
+static lsi_conn_pool *check_open_pool(lua_State *L)
+{
+	lsi_conn_pool *pool = (lsi_conn_pool *)luaL_checkudata(
+		L, 1, LSI_CONN_POOL_METATABLE);
+	return pool->closed ? NULL : pool;
+}
+
+// core.pool(endpoint, [options]) - keeps connections to endpoint open for
+// reuse, options: min connections opened up front and kept by pool:check(),
+// max connections in total, idle_timeout in ms, the rest is passed to
+// core.connect
+int lsi_conn_pool_new(lua_State *L)
+{
+	luaL_checkstring(L, 1);
+	size_t min = 0;
+	size_t max = DEFAULT_POOL_MAX;
+	uint32_t idle_timeout = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "min");
+		min = luaL_optinteger(L, -1, 0);
+		lua_getfield(L, 2, "max");
+		max = luaL_optinteger(L, -1, DEFAULT_POOL_MAX);
+		lua_getfield(L, 2, "idle_timeout");
+		idle_timeout = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 3);
+	}
+	if (max < 1) {
+		max = 1;
+	}
+	if (min > max) {
+		min = max;
+	}
+	lua_settop(L, 2);
+
+	lsi_conn_pool *pool = (lsi_conn_pool *)lua_newuserdatauv(
+		L, sizeof(lsi_conn_pool), 4);
+	memset(pool, 0, sizeof(lsi_conn_pool));
+	pool->closed = 1;
+	luaL_getmetatable(L, LSI_CONN_POOL_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, 1);
+	lua_setiuservalue(L, 3, 1);
+	lua_pushvalue(L, 2);
+	lua_setiuservalue(L, 3, 2);
+	lua_newtable(L);
+	lua_setiuservalue(L, 3, 3);
+	lua_newtable(L);
+	lua_setiuservalue(L, 3, 4);
+
+	pool->idle_since = (uint64_t *)malloc(max * sizeof(uint64_t));
+	if (pool->idle_since == NULL) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	pool->min = min;
+	pool->max = max;
+	pool->idle_timeout = idle_timeout;
+	pool->closed = 0;
+	while (pool->idle < min) {
+		if (!open_connection(L, pool, 3)) {
+			return lua_gettop(L) - 3;
+		}
+		push_idle(L, pool, 3);
+	}
+	lua_settop(L, 3);
+	return 1;
+}
+
+// pool:acquire() - returns an idle connection which passed the health check
+// or a new one while fewer than max are open
+int lsi_conn_pool_acquire(lua_State *L)
+{
+	lsi_conn_pool *pool = check_open_pool(L);
+	if (pool == NULL) {
+		return push_error(L, ERROR_POOL_CLOSED);
+	}
+	lua_settop(L, 1);
+	while (pool->idle > 0) {
+		pop_idle(L, pool, 1);
+		if (connection_healthy((lsi_socket *)lua_touserdata(L, -1))) {
+			set_borrowed(L, pool, 1, 1);
+			pool->reuses++;
+			return 1;
+		}
+		pool->health_closed++;
+		close_connection(L);
+	}
+	if (pool->borrowed >= pool->max) {
+		return push_error(L, ERROR_POOL_EXHAUSTED);
+	}
+	if (!open_connection(L, pool, 1)) {
+		return lua_gettop(L) - 1;
+	}
+	set_borrowed(L, pool, 1, 1);
+	return 1;
+}
+
+// pool:release(socket) - returns an acquired connection, it is closed
+// instead when it is not quiet or the pool was closed, sockets not borrowed
+// from this pool (or released already) are refused
+int lsi_conn_pool_release(lua_State *L)
+{
+	lsi_conn_pool *pool = (lsi_conn_pool *)luaL_checkudata(
+		L, 1, LSI_CONN_POOL_METATABLE);
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 2, LSI_SOCKET_METATABLE);
+	lua_settop(L, 2);
+	lua_getiuservalue(L, 1, 4);
+	lua_pushvalue(L, 2);
+	int borrowed = lua_rawget(L, -2) != LUA_TNIL;
+	lua_settop(L, 2);
+	if (!borrowed) {
+		return push_error(L, ERROR_POOL_NOT_BORROWED);
+	}
+	set_borrowed(L, pool, 1, 0);
+	int reused = !pool->closed && connection_healthy(sock);
+	if (reused) {
+		push_idle(L, pool, 1);
+	} else {
+		close_connection(L);
+	}
+	lua_pushboolean(L, reused);
+	return 1;
+}
+
+// pool:check() - closes idle connections which fail the health check or,
+// above min, exceeded idle_timeout, then reopens up to min connections
+// returns number of closed connections
+int lsi_conn_pool_check(lua_State *L)
+{
+	lsi_conn_pool *pool = check_open_pool(L);
+	if (pool == NULL) {
+		return push_error(L, ERROR_POOL_CLOSED);
+	}
+	lua_settop(L, 1);
+	uint64_t now = lsi_now_ms();
+	lua_getiuservalue(L, 1, 3); // idle stack, oldest first
+	size_t kept = 0;
+	size_t closed = 0;
+	for (size_t i = 0; i < pool->idle; i++) {
+		lua_rawgeti(L, 2, (lua_Integer)i + 1);
+		int expired = pool->idle_timeout > 0 &&
+			      now - pool->idle_since[i] >= pool->idle_timeout &&
+			      pool->idle - closed + pool->borrowed > pool->min;
+		if (expired ||
+		    !connection_healthy((lsi_socket *)lua_touserdata(L, -1))) {
+			if (expired) {
+				pool->timeout_closed++;
+			} else {
+				pool->health_closed++;
+			}
+			close_connection(L);
+			closed++;
+			continue;
+		}
+		pool->idle_since[kept] = pool->idle_since[i];
+		lua_rawseti(L, 2, (lua_Integer)++kept);
+	}
+	for (size_t i = kept; i < pool->idle; i++) {
+		lua_pushnil(L);
+		lua_rawseti(L, 2, (lua_Integer)i + 1);
+	}
+	pool->idle = kept;
+	lua_settop(L, 1);
+	while (pool->idle + pool->borrowed < pool->min) {
+		if (!open_connection(L, pool, 1)) {
+			return lua_gettop(L) - 1;
+		}
+		push_idle(L, pool, 1);
+	}
+	lua_pushinteger(L, (lua_Integer)closed);
+	return 1;
+}
+
+// pool:get_stats() - returns table with connection counters
+int lsi_conn_pool_get_stats(lua_State *L)
+{
+	lsi_conn_pool *pool = (lsi_conn_pool *)luaL_checkudata(
+		L, 1, LSI_CONN_POOL_METATABLE);
+	lua_newtable(L);
+	lua_pushinteger(L, pool->idle);
+	lua_setfield(L, -2, "idle");
+	lua_pushinteger(L, pool->borrowed);
+	lua_setfield(L, -2, "borrowed");
+	lua_pushinteger(L, pool->connects);
+	lua_setfield(L, -2, "connects");
+	lua_pushinteger(L, pool->reuses);
+	lua_setfield(L, -2, "reuses");
+	lua_pushinteger(L, pool->health_closed);
+	lua_setfield(L, -2, "health_closed");
+	lua_pushinteger(L, pool->timeout_closed);
+	lua_setfield(L, -2, "timeout_closed");
+	return 1;
+}
+
+// pool:close() - closes idle connections, borrowed ones are closed when
+// they are released
+int lsi_conn_pool_close(lua_State *L)
+{
+	lsi_conn_pool *pool = (lsi_conn_pool *)luaL_checkudata(
+		L, 1, LSI_CONN_POOL_METATABLE);
+	if (pool->closed) {
+		return 0;
+	}
+	lua_settop(L, 1);
+	while (pool->idle > 0) {
+		pop_idle(L, pool, 1);
+		close_connection(L);
+	}
+	free(pool->idle_since);
+	pool->idle_since = NULL;
+	pool->closed = 1;
+	return 0;
+}
+
+int lsi_conn_pool_tostring(lua_State *L)
+{
+	luaL_checkudata(L, 1, LSI_CONN_POOL_METATABLE);
+	lua_getiuservalue(L, 1, 1);
+	lua_pushfstring(L, "pool(%s)", lua_tostring(L, -1));
+	return 1;
+}
+
+int lsi_create_conn_pool_meta(lua_State *L)
+{
+	luaL_newmetatable(L, LSI_CONN_POOL_METATABLE);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, lsi_conn_pool_acquire);
+	lua_setfield(L, -2, "acquire");
+	lua_pushcfunction(L, lsi_conn_pool_release);
+	lua_setfield(L, -2, "release");
+	lua_pushcfunction(L, lsi_conn_pool_check);
+	lua_setfield(L, -2, "check");
+	lua_pushcfunction(L, lsi_conn_pool_get_stats);
+	lua_setfield(L, -2, "get_stats");
+	lua_pushcfunction(L, lsi_conn_pool_close);
+	lua_setfield(L, -2, "close");
+	lua_pushcfunction(L, lsi_conn_pool_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushstring(L, LSI_CONN_POOL_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lsi_conn_pool_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lsi_conn_pool_close);
+	lua_setfield(L, -2, "__close");
+
+	lua_pop(L, 1);
+	return 0;
+}
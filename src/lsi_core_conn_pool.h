@@ -0,0 +1,30 @@
+#ifndef LSI_CORE_CONN_POOL_H__
+#define LSI_CORE_CONN_POOL_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "lua.h"
+
+#define LSI_CONN_POOL_METATABLE "LSI_CONN_POOL"
+#define DEFAULT_POOL_MAX        16
+
+// warm connections to one endpoint, uservalues are the endpoint, the connect
+// options, the stack of idle sockets and the set of borrowed ones
+typedef struct lsi_conn_pool {
+    size_t min; // kept open by pool:check()
+    size_t max; // idle and borrowed together
+    uint32_t idle_timeout; // ms, idle connections above min are closed
+    size_t idle;
+    size_t borrowed;
+    uint64_t* idle_since; // release times, parallel to the idle stack
+    uint64_t connects;
+    uint64_t reuses;
+    uint64_t health_closed; // failed the health check
+    uint64_t timeout_closed;
+    int closed;
+} lsi_conn_pool;
+
+int lsi_create_conn_pool_meta(lua_State* L);
+int lsi_conn_pool_new(lua_State* L);
+
+#endif /* LSI_CORE_CONN_POOL_H__ */
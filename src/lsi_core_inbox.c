@@ -0,0 +1,122 @@
+#include <stdint.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_core_inbox.h"
+#include "lsi_errors.h"
+#include "lua.h"
+#include "lerror.h"
+
+void lsi_inbox_ref_push(lua_State *L, struct lsi_inbox *inbox)
+{
+	lsi_inbox_ref *ref =
+		(lsi_inbox_ref *)lua_newuserdatauv(L, sizeof(lsi_inbox_ref), 0);
+	ref->inbox = inbox;
+	luaL_getmetatable(L, LSI_INBOX_METATABLE);
+	lua_setmetatable(L, -2);
+}
+
+// core.open_inbox(handle) - opens inbox from handle returned by
+// inbox:handle(), fails once every other reference is gone
+int lsi_inbox_open(lua_State *L)
+{
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lua_Integer handle = luaL_checkinteger(L, 1);
+	lsi_inbox *inbox = handle > 0 ? lsi_inbox_acquire((uint64_t)handle) :
+					NULL;
+	if (inbox == NULL) {
+		return push_error(L, ERROR_INBOX_CLOSED);
+	}
+	lsi_inbox_ref_push(L, inbox);
+	return 1;
+#endif
+}
+
+// inbox:post(clientid, data) - queues data for the server client
+int lsi_inbox_post_lua(lua_State *L)
+{
+	lsi_inbox_ref *ref =
+		(lsi_inbox_ref *)luaL_checkudata(L, 1, LSI_INBOX_METATABLE);
+	lua_Integer clientid = luaL_checkinteger(L, 2);
+	size_t size;
+	const char *data = luaL_checklstring(L, 3, &size);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	if (ref->inbox == NULL) {
+		return push_error(L, ERROR_INBOX_CLOSED);
+	}
+	if (lsi_inbox_post(ref->inbox, (int)clientid, data, size) == -1) {
+		return push_error(L, atomic_load(&ref->inbox->closed) ?
+					     ERROR_SERVER_CLOSED :
+					     ERROR_OUT_OF_MEMORY);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+// inbox:handle() - integer to pass to core.open_inbox in another state
+int lsi_inbox_handle(lua_State *L)
+{
+	lsi_inbox_ref *ref =
+		(lsi_inbox_ref *)luaL_checkudata(L, 1, LSI_INBOX_METATABLE);
+	if (ref->inbox == NULL) {
+		return push_error(L, ERROR_INBOX_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lua_pushinteger(L, (lua_Integer)ref->inbox->id);
+	return 1;
+#endif
+}
+
+int lsi_inbox_close(lua_State *L)
+{
+	lsi_inbox_ref *ref =
+		(lsi_inbox_ref *)luaL_checkudata(L, 1, LSI_INBOX_METATABLE);
+#ifndef _WIN32
+	if (ref->inbox != NULL) {
+		lsi_inbox_release(ref->inbox);
+	}
+#endif
+	ref->inbox = NULL;
+	return 0;
+}
+
+int lsi_inbox_tostring(lua_State *L)
+{
+	lsi_inbox_ref *ref =
+		(lsi_inbox_ref *)luaL_checkudata(L, 1, LSI_INBOX_METATABLE);
+	lua_pushfstring(L, "inbox(%p)", (void *)ref->inbox);
+	return 1;
+}
+
+int lsi_create_inbox_meta(lua_State *L)
+{
+	luaL_newmetatable(L, LSI_INBOX_METATABLE);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, lsi_inbox_post_lua);
+	lua_setfield(L, -2, "post");
+	lua_pushcfunction(L, lsi_inbox_handle);
+	lua_setfield(L, -2, "handle");
+	lua_pushcfunction(L, lsi_inbox_close);
+	lua_setfield(L, -2, "close");
+	lua_pushcfunction(L, lsi_inbox_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushstring(L, LSI_INBOX_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lsi_inbox_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lsi_inbox_close);
+	lua_setfield(L, -2, "__close");
+
+	lua_pop(L, 1);
+	return 0;
+}
@@ -0,0 +1,19 @@
+#ifndef LSI_CORE_INBOX_H__
+#define LSI_CORE_INBOX_H__
+
+#include "lsi_inbox.h"
+#include "lua.h"
+
+#define LSI_INBOX_METATABLE "LSI_INBOX"
+
+// reference to server inbox, usable from any lua state
+typedef struct lsi_inbox_ref {
+    struct lsi_inbox* inbox;
+} lsi_inbox_ref;
+
+int lsi_create_inbox_meta(lua_State* L);
+int lsi_inbox_open(lua_State* L);
+// pushes userdata taking over the inbox reference
+void lsi_inbox_ref_push(lua_State* L, struct lsi_inbox* inbox);
+
+#endif /* LSI_CORE_INBOX_H__ */
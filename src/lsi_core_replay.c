@@ -0,0 +1,402 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_capture.h"
+#include "lsi_common.h"
+#include "lsi_core_replay.h"
+#include "lsi_core_socket.h"
+#include "lsi_errors.h"
+#include "lua.h"
+#include "lerror.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef _WIN32
+static int connect_endpoint(lsi_replay *replay)
+{
+	int fd;
+	if (lsi_is_tcp_endpoint(replay->endpoint)) {
+		fd = lsi_tcp_connect(replay->endpoint, &replay->tcp_options);
+	} else {
+		struct sockaddr_un addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sun_family = AF_UNIX;
+		strncpy(addr.sun_path, replay->endpoint,
+			sizeof(addr.sun_path) - 1);
+		fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (fd != -1 &&
+		    connect(fd, (struct sockaddr *)&addr, sizeof(addr)) == -1) {
+			close(fd);
+			fd = -1;
+		}
+	}
+	if (fd != -1) {
+		fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+	}
+	return fd;
+}
+
+static int add_connection(lsi_replay *replay, uint32_t id, int fd)
+{
+	if (replay->count == replay->capacity) {
+		size_t capacity =
+			replay->capacity == 0 ? 16 : replay->capacity * 2;
+		lsi_replay_connection *connections =
+			(lsi_replay_connection *)realloc(
+				replay->connections,
+				capacity * sizeof(lsi_replay_connection));
+		if (connections == NULL) {
+			return -1;
+		}
+		replay->connections = connections;
+		struct pollfd *fds = (struct pollfd *)realloc(
+			replay->fds, capacity * sizeof(struct pollfd));
+		if (fds == NULL) {
+			return -1;
+		}
+		replay->fds = fds;
+		replay->capacity = capacity;
+	}
+	replay->connections[replay->count].id = id;
+	replay->connections[replay->count].sent_at = 0;
+	replay->fds[replay->count].fd = fd;
+	replay->fds[replay->count].events = POLLIN;
+	replay->fds[replay->count].revents = 0;
+	replay->count++;
+	return 0;
+}
+
+// index of the open connection with id, -1 if there is none
+static long find_connection(lsi_replay *replay, uint32_t id)
+{
+	size_t low = 0;
+	size_t high = replay->count;
+	while (low < high) {
+		size_t mid = low + (high - low) / 2;
+		if (replay->connections[mid].id < id) {
+			low = mid + 1;
+		} else {
+			high = mid;
+		}
+	}
+	if (low == replay->count || replay->connections[low].id != id ||
+	    replay->fds[low].fd == -1) {
+		return -1;
+	}
+	return (long)low;
+}
+
+static void close_connection(lsi_replay *replay, size_t index)
+{
+	close(replay->fds[index].fd);
+	replay->fds[index].fd = -1;
+	replay->connections[index].sent_at = 0;
+}
+
+static void add_latency(lsi_replay *replay, uint64_t latency)
+{
+	if (replay->latency_count == replay->latency_capacity) {
+		size_t capacity = replay->latency_capacity == 0 ?
+					  1024 :
+					  replay->latency_capacity * 2;
+		uint64_t *latencies = (uint64_t *)realloc(
+			replay->latencies, capacity * sizeof(uint64_t));
+		if (latencies == NULL) {
+			return; // sample dropped
+		}
+		replay->latencies = latencies;
+		replay->latency_capacity = capacity;
+	}
+	replay->latencies[replay->latency_count++] = latency;
+}
+
+// drains everything the server sent, the first bytes answer the outstanding
+// write
+static void receive_replies(lsi_replay *replay, size_t index)
+{
+	char buffer[REPLAY_READ_SIZE];
+	for (;;) {
+		ssize_t got = recv(replay->fds[index].fd, buffer,
+				   sizeof(buffer), 0);
+		if (got > 0) {
+			lsi_replay_connection *conn =
+				&replay->connections[index];
+			if (conn->sent_at != 0) {
+				add_latency(replay,
+					    lsi_now_us() - conn->sent_at);
+				conn->sent_at = 0;
+			}
+			continue;
+		}
+		if (got == -1 && errno == EINTR) {
+			continue;
+		}
+		if (got == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+			close_connection(replay, index);
+		}
+		return;
+	}
+}
+
+// polls connections until the given time, 0 polls once without waiting
+static void wait_until(lsi_replay *replay, uint64_t due_us)
+{
+	for (;;) {
+		uint64_t now = lsi_now_us();
+		int timeout = due_us > now ? (int)((due_us - now) / 1000) : 0;
+		int ready = poll(replay->fds, replay->count, timeout);
+		if (ready > 0) {
+			for (size_t i = 0; i < replay->count; i++) {
+				if (replay->fds[i].fd != -1 &&
+				    replay->fds[i].revents != 0) {
+					receive_replies(replay, i);
+				}
+			}
+		}
+		if (lsi_now_us() >= due_us) {
+			return;
+		}
+	}
+}
+
+static void send_data(lsi_replay *replay, size_t index, const char *data,
+		      size_t size)
+{
+	lsi_replay_connection *conn = &replay->connections[index];
+	if (conn->sent_at == 0) {
+		conn->sent_at = lsi_now_us();
+	}
+	while (size > 0 && replay->fds[index].fd != -1) {
+		ssize_t sent = send(replay->fds[index].fd, data, size,
+				    MSG_NOSIGNAL);
+		if (sent > 0) {
+			data += sent;
+			size -= sent;
+			continue;
+		}
+		if (errno == EINTR) {
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			close_connection(replay, index);
+			return;
+		}
+		// the server is not reading, keep taking its replies meanwhile
+		struct pollfd pfd = replay->fds[index];
+		pfd.events = POLLIN | POLLOUT;
+		if (poll(&pfd, 1, -1) > 0 && (pfd.revents & POLLIN)) {
+			receive_replies(replay, index);
+		}
+	}
+}
+
+// data of a record, zeros for captures without payloads
+static const char *record_data(lsi_replay *replay, lsi_capture_record *record)
+{
+	if (record->data != NULL) {
+		return record->data;
+	}
+	if (record->size > replay->filler_size) {
+		char *filler = (char *)realloc(replay->filler, record->size);
+		if (filler == NULL) {
+			return NULL;
+		}
+		memset(filler, 0, record->size);
+		replay->filler = filler;
+		replay->filler_size = record->size;
+	}
+	return replay->filler;
+}
+
+static int run_replay(lsi_replay *replay, lsi_capture *capture, double speed,
+		      uint32_t drain_timeout)
+{
+	lsi_capture_record record;
+	uint64_t started = lsi_now_us();
+	uint64_t first = 0;
+	int res;
+	while ((res = lsi_capture_next(capture, &record)) == 1) {
+		if (capture->records == 1) {
+			// timing is relative to the first record
+			first = record.time_us;
+		}
+		if (speed > 0) {
+			uint64_t offset = record.time_us - first;
+			uint64_t due = started + (uint64_t)(offset / speed);
+			wait_until(replay, due);
+			uint64_t now = lsi_now_us();
+			if (now - due > replay->max_lag_us) {
+				replay->max_lag_us = now - due;
+			}
+		} else {
+			wait_until(replay, 0);
+		}
+		long index = find_connection(replay, record.connection);
+		if (record.type == CAPTURE_OPEN) {
+			int fd = connect_endpoint(replay);
+			if (fd == -1) {
+				replay->connect_failures++;
+			} else if (add_connection(replay, record.connection,
+						  fd) == -1) {
+				close(fd);
+				return -1;
+			}
+		} else if (record.type == CAPTURE_CLOSE && index != -1) {
+			close_connection(replay, index);
+		} else if (record.type == CAPTURE_DATA && index != -1) {
+			const char *data = record_data(replay, &record);
+			if (data == NULL) {
+				return -1;
+			}
+			send_data(replay, index, data, record.size);
+			replay->messages++;
+			replay->bytes += record.size;
+		}
+	}
+	// replies to the last writes
+	uint64_t deadline = lsi_now_us() + (uint64_t)drain_timeout * 1000;
+	for (;;) {
+		int outstanding = 0;
+		for (size_t i = 0; i < replay->count; i++) {
+			if (replay->fds[i].fd != -1 &&
+			    replay->connections[i].sent_at != 0) {
+				outstanding = 1;
+				break;
+			}
+		}
+		if (!outstanding || lsi_now_us() >= deadline) {
+			break;
+		}
+		uint64_t step = lsi_now_us() + 1000;
+		wait_until(replay, step < deadline ? step : deadline);
+	}
+	return res;
+}
+
+static void free_replay(lsi_replay *replay)
+{
+	for (size_t i = 0; i < replay->count; i++) {
+		if (replay->fds[i].fd != -1) {
+			close(replay->fds[i].fd);
+		}
+	}
+	free(replay->connections);
+	free(replay->fds);
+	free(replay->filler);
+	free(replay->latencies);
+	free(replay->endpoint);
+}
+
+static int compare_latency(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *)a;
+	uint64_t y = *(const uint64_t *)b;
+	return x < y ? -1 : x > y;
+}
+
+static void push_results(lua_State *L, lsi_replay *replay, double duration,
+			 int truncated)
+{
+	lua_newtable(L);
+	lua_pushinteger(L, replay->count);
+	lua_setfield(L, -2, "connections");
+	lua_pushinteger(L, replay->connect_failures);
+	lua_setfield(L, -2, "connect_failures");
+	lua_pushinteger(L, replay->messages);
+	lua_setfield(L, -2, "messages");
+	lua_pushinteger(L, replay->bytes);
+	lua_setfield(L, -2, "bytes");
+	lua_pushnumber(L, duration);
+	lua_setfield(L, -2, "duration");
+	lua_pushnumber(L, duration > 0 ? replay->messages / duration : 0);
+	lua_setfield(L, -2, "messages_per_sec");
+	lua_pushnumber(L, duration > 0 ? replay->bytes / duration : 0);
+	lua_setfield(L, -2, "bytes_per_sec");
+	lua_pushinteger(L, replay->max_lag_us);
+	lua_setfield(L, -2, "max_lag_us");
+	lua_pushinteger(L, replay->latency_count);
+	lua_setfield(L, -2, "replies");
+	lua_pushboolean(L, truncated);
+	lua_setfield(L, -2, "truncated");
+	size_t n = replay->latency_count;
+	if (n == 0) {
+		return;
+	}
+	qsort(replay->latencies, n, sizeof(uint64_t), compare_latency);
+	uint64_t sum = 0;
+	for (size_t i = 0; i < n; i++) {
+		sum += replay->latencies[i];
+	}
+	lua_pushinteger(L, replay->latencies[0]);
+	lua_setfield(L, -2, "latency_min_us");
+	lua_pushinteger(L, sum / n);
+	lua_setfield(L, -2, "latency_avg_us");
+	lua_pushinteger(L, replay->latencies[(n - 1) / 2]);
+	lua_setfield(L, -2, "latency_p50_us");
+	lua_pushinteger(L, replay->latencies[(n - 1) * 99 / 100]);
+	lua_setfield(L, -2, "latency_p99_us");
+	lua_pushinteger(L, replay->latencies[n - 1]);
+	lua_setfield(L, -2, "latency_max_us");
+}
+#endif
+
+// core.replay(capture, endpoint, [options]) - opens the captured connections
+// against endpoint and sends the recorded data with the recorded timing,
+// options: speed factor (default 1, 0 sends as fast as possible),
+// drain_timeout in ms to wait for the last replies, tcp options as for
+// core.connect, returns table with throughput and reply latency
+// blocks until done, the server has to run in another process
+int lsi_replay_run(lua_State *L)
+{
+	const char *path = luaL_checkstring(L, 1);
+	size_t endpoint_len;
+	const char *endpoint = luaL_checklstring(L, 2, &endpoint_len);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	double speed = 1;
+	uint32_t drain_timeout = REPLAY_DRAIN_TIMEOUT;
+	lsi_replay replay;
+	memset(&replay, 0, sizeof(lsi_replay));
+	lsi_tcp_options_init(&replay.tcp_options);
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "speed");
+		speed = luaL_optnumber(L, -1, 1);
+		lua_getfield(L, 3, "drain_timeout");
+		drain_timeout = luaL_optinteger(L, -1, REPLAY_DRAIN_TIMEOUT);
+		lua_pop(L, 2);
+		lsi_socket_read_tcp_options(L, 3, &replay.tcp_options);
+	}
+	replay.endpoint = get_endpoint_path(endpoint, &endpoint_len);
+	if (replay.endpoint == NULL) {
+		return push_error(L, ERROR_PATH_IS_NIL);
+	}
+	lsi_capture capture;
+	if (lsi_capture_open(&capture, path) == -1) {
+		free_replay(&replay);
+		return push_error(L, ERROR_INVALID_CAPTURE);
+	}
+	uint64_t started = lsi_now_us();
+	int res = run_replay(&replay, &capture, speed, drain_timeout);
+	double duration = (double)(lsi_now_us() - started) / 1000000;
+	lsi_capture_close(&capture);
+	if (res == -1 && replay.messages == 0 && replay.count == 0) {
+		free_replay(&replay);
+		return push_error(L, ERROR_INVALID_CAPTURE);
+	}
+	// a capture cut short by a crashed server still replays up to the
+	// last complete record
+	push_results(L, &replay, duration, res == -1);
+	free_replay(&replay);
+	return 1;
+#endif
+}
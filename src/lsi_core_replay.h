@@ -0,0 +1,44 @@
+#ifndef LSI_CORE_REPLAY_H__
+#define LSI_CORE_REPLAY_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "lsi_tcp.h"
+#include "lua.h"
+
+#define REPLAY_DRAIN_TIMEOUT 1000 // ms waiting for replies after the last record
+#define REPLAY_READ_SIZE     65536
+
+#ifndef _WIN32
+#include <poll.h>
+
+// captured connection, latency runs from the first write after the last
+// reply until the next reply arrives
+typedef struct lsi_replay_connection {
+    uint32_t id;
+    uint64_t sent_at; // us, 0 while nothing is outstanding
+} lsi_replay_connection;
+
+typedef struct lsi_replay {
+    char* endpoint;
+    lsi_tcp_options tcp_options;
+    // sorted by id, captured connection ids only increase
+    lsi_replay_connection* connections;
+    struct pollfd* fds; // parallel to connections, fd -1 once closed
+    size_t count;
+    size_t capacity;
+    char* filler; // zeros written for captures without payloads
+    size_t filler_size;
+    uint64_t* latencies;
+    size_t latency_count;
+    size_t latency_capacity;
+    uint64_t messages;
+    uint64_t bytes;
+    uint64_t connect_failures;
+    uint64_t max_lag_us; // how far sends fell behind the schedule
+} lsi_replay;
+#endif
+
+int lsi_replay_run(lua_State* L);
+
+#endif /* LSI_CORE_REPLAY_H__ */
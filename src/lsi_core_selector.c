@@ -0,0 +1,367 @@
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_core_selector.h"
+#include "lsi_core_server.h"
+#include "lsi_core_socket.h"
+#include "lsi_errors.h"
+#include "lua.h"
+#include "lerror.h"
+
+#ifndef _WIN32
+#include <poll.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
+#endif
+
+#ifndef _WIN32
+// resolves fd to wait on for the socket or server at idx
+static int get_object_fd(lua_State *L, int idx, lsi_server **server)
+{
+	*server = NULL;
+	lsi_socket *sock =
+		(lsi_socket *)luaL_testudata(L, idx, LSI_SOCKET_METATABLE);
+	if (sock != NULL) {
+		return sock->closed ? -1 : sock->fd;
+	}
+	lsi_server *srv =
+		(lsi_server *)luaL_testudata(L, idx, LSI_SERVER_METATABLE);
+	if (srv != NULL && !srv->closed) {
+		*server = srv;
+		return lsi_server_poll_fd(srv);
+	}
+	return -1;
+}
+
+static int find_entry(lsi_selector *selector, int fd)
+{
+	for (size_t i = 0; i < selector->count; i++) {
+		if (selector->entries[i].fd == fd) {
+			return (int)i;
+		}
+	}
+	return -1;
+}
+
+// whether the entry for fd was registered with the object at idx
+static int entry_is_object(lua_State *L, int fd, int idx)
+{
+	lua_getiuservalue(L, 1, 1);
+	lua_pushinteger(L, fd);
+	lua_gettable(L, -2);
+	int same = lua_rawequal(L, -1, idx);
+	lua_pop(L, 2);
+	return same;
+}
+
+static void remove_entry(lua_State *L, lsi_selector *selector, int index)
+{
+	int fd = selector->entries[index].fd;
+#ifdef __linux__
+	epoll_ctl(selector->epfd, EPOLL_CTL_DEL, fd, NULL);
+#endif
+	selector->entries[index] = selector->entries[selector->count - 1];
+	selector->count--;
+
+	lua_getiuservalue(L, 1, 1);
+	lua_pushinteger(L, fd);
+	lua_pushnil(L);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
+}
+#endif
+
+int lsi_selector_new(lua_State *L)
+{
+	lsi_selector *selector = (lsi_selector *)lua_newuserdatauv(
+		L, sizeof(lsi_selector), 1);
+	if (selector == NULL) {
+		return push_error(L, ERROR_FAILED_TO_CREATE_SELECTOR_INSTANCE);
+	}
+	memset(selector, 0, sizeof(lsi_selector));
+	selector->closed = 1;
+	luaL_getmetatable(L, LSI_SELECTOR_METATABLE);
+	lua_setmetatable(L, -2);
+
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+#ifdef __linux__
+	selector->epfd = epoll_create1(EPOLL_CLOEXEC);
+	if (selector->epfd == -1) {
+		return push_error(L, ERROR_FAILED_TO_CREATE_SELECTOR_INSTANCE);
+	}
+#else
+	selector->epfd = -1;
+#endif
+	// registered objects by fd
+	lua_newtable(L);
+	lua_setiuservalue(L, -2, 1);
+	selector->closed = 0;
+	return 1;
+#endif
+}
+
+static lsi_selector *check_selector(lua_State *L)
+{
+	return (lsi_selector *)luaL_checkudata(L, 1, LSI_SELECTOR_METATABLE);
+}
+
+// selector:register(socket_or_server)
+int lsi_selector_register(lua_State *L)
+{
+	lsi_selector *selector = check_selector(L);
+	if (selector->closed) {
+		return push_error(L, ERROR_SELECTOR_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_server *server;
+	int fd = get_object_fd(L, 2, &server);
+	if (fd == -1) {
+		return push_error(L, ERROR_INVALID_SELECTOR_OBJECT);
+	}
+	int index = find_entry(selector, fd);
+	if (index != -1) {
+		if (entry_is_object(L, fd, 2)) {
+			lua_pushboolean(L, 1);
+			return 1;
+		}
+		// fd number reused after the registered object was closed, the
+		// kernel dropped the old one from the epoll set already
+		remove_entry(L, selector, index);
+	}
+	if (selector->count == selector->capacity) {
+		size_t capacity =
+			selector->capacity == 0 ? 16 : selector->capacity * 2;
+		lsi_selector_entry *entries = (lsi_selector_entry *)realloc(
+			selector->entries,
+			capacity * sizeof(lsi_selector_entry));
+		if (entries == NULL) {
+			return push_error(L, ERROR_OUT_OF_MEMORY);
+		}
+		selector->entries = entries;
+		selector->capacity = capacity;
+	}
+#ifdef __linux__
+	struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+	if (epoll_ctl(selector->epfd, EPOLL_CTL_ADD, fd, &ev) == -1 &&
+	    (errno != EEXIST ||
+	     epoll_ctl(selector->epfd, EPOLL_CTL_MOD, fd, &ev) == -1)) {
+		return push_error(L, ERROR_POLL_FAILED);
+	}
+#endif
+	selector->entries[selector->count].fd = fd;
+	selector->entries[selector->count].server = server;
+	selector->count++;
+
+	lua_getiuservalue(L, 1, 1);
+	lua_pushinteger(L, fd);
+	lua_pushvalue(L, 2);
+	lua_settable(L, -3);
+	lua_pop(L, 1);
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+// selector:unregister(socket_or_server)
+int lsi_selector_unregister(lua_State *L)
+{
+	lsi_selector *selector = check_selector(L);
+	if (selector->closed) {
+		return push_error(L, ERROR_SELECTOR_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_server *server;
+	int fd = get_object_fd(L, 2, &server);
+	int index = fd == -1 ? -1 : find_entry(selector, fd);
+	if (index != -1 && !entry_is_object(L, fd, 2)) {
+		index = -1; // stale entry of a closed object
+	}
+	if (index == -1) {
+		// closed objects can not be resolved to fd anymore
+		for (size_t i = 0; i < selector->count; i++) {
+			if (entry_is_object(L, selector->entries[i].fd, 2)) {
+				index = (int)i;
+				break;
+			}
+		}
+	}
+	if (index != -1) {
+		remove_entry(L, selector, index);
+	}
+	lua_pushboolean(L, index != -1);
+	return 1;
+#endif
+}
+
+#if !defined(_WIN32) && !defined(__linux__)
+// poll based fallback, servers contribute all of their fds
+static int wait_poll(lsi_selector *selector, int timeout, int *ready)
+{
+	size_t nfds = 0;
+	for (size_t i = 0; i < selector->count; i++) {
+		lsi_server *server = selector->entries[i].server;
+		nfds += server != NULL ? server->nfds : 1;
+	}
+	struct pollfd *fds = malloc((nfds + 1) * sizeof(struct pollfd));
+	int *owners = malloc((nfds + 1) * sizeof(int));
+	if (fds == NULL || owners == NULL) {
+		free(fds);
+		free(owners);
+		return -1;
+	}
+	size_t n = 0;
+	for (size_t i = 0; i < selector->count; i++) {
+		lsi_server *server = selector->entries[i].server;
+		if (server != NULL) {
+			for (size_t j = 0; j < server->nfds; j++) {
+				fds[n].fd = server->fds[j].fd;
+				fds[n].events = POLLIN;
+				owners[n++] = (int)i;
+			}
+		} else {
+			fds[n].fd = selector->entries[i].fd;
+			fds[n].events = POLLIN;
+			owners[n++] = (int)i;
+		}
+	}
+	int res = poll(fds, n, timeout);
+	int count = 0;
+	if (res > 0) {
+		for (size_t i = 0; i < n; i++) {
+			if (fds[i].revents == 0) {
+				continue;
+			}
+			int fd = selector->entries[owners[i]].fd;
+			int seen = 0;
+			for (int j = 0; j < count; j++) {
+				seen |= ready[j] == fd;
+			}
+			if (!seen && count < SELECTOR_MAX_EVENTS) {
+				ready[count++] = fd;
+			}
+		}
+	}
+	free(fds);
+	free(owners);
+	if (res == -1) {
+		return errno == EINTR ? 0 : -1;
+	}
+	return count;
+}
+#endif
+
+// selector:wait([timeout]) - returns list of ready sockets and servers
+int lsi_selector_wait(lua_State *L)
+{
+	lsi_selector *selector = check_selector(L);
+	if (selector->closed) {
+		return push_error(L, ERROR_SELECTOR_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	int timeout = (int)luaL_optinteger(L, 2, -1);
+	int ready[SELECTOR_MAX_EVENTS];
+	int count;
+#ifdef __linux__
+	struct epoll_event events[SELECTOR_MAX_EVENTS];
+	count = epoll_wait(selector->epfd, events, SELECTOR_MAX_EVENTS,
+			   timeout);
+	if (count == -1 && errno == EINTR) {
+		count = 0;
+	}
+	for (int i = 0; i < count; i++) {
+		ready[i] = events[i].data.fd;
+	}
+#else
+	count = wait_poll(selector, timeout, ready);
+#endif
+	if (count == -1) {
+		return push_error(L, ERROR_POLL_FAILED);
+	}
+
+	lua_createtable(L, count, 0);
+	lua_getiuservalue(L, 1, 1);
+	int n = 0;
+	for (int i = 0; i < count; i++) {
+		lua_pushinteger(L, ready[i]);
+		if (lua_gettable(L, -2) == LUA_TNIL) {
+			lua_pop(L, 1);
+			continue;
+		}
+		lua_rawseti(L, -3, ++n);
+	}
+	lua_pop(L, 1); // discard uv
+	return 1;
+#endif
+}
+
+int lsi_selector_close(lua_State *L)
+{
+	lsi_selector *selector =
+		(lsi_selector *)lua_touserdata(L, 1);
+	if (selector == NULL || selector->closed) {
+		return 0;
+	}
+	selector->closed = 1;
+#ifndef _WIN32
+	if (selector->epfd != -1) {
+		close(selector->epfd);
+		selector->epfd = -1;
+	}
+	free(selector->entries);
+	selector->entries = NULL;
+	selector->count = 0;
+	selector->capacity = 0;
+#endif
+	return 0;
+}
+
+int lsi_selector_tostring(lua_State *L)
+{
+	lsi_selector *selector = check_selector(L);
+#ifdef _WIN32
+	lua_pushfstring(L, "selector(%p)", selector);
+#else
+	lua_pushfstring(L, "selector(%d)", (int)selector->count);
+#endif
+	return 1;
+}
+
+int lsi_create_selector_meta(lua_State *L)
+{
+	luaL_newmetatable(L, LSI_SELECTOR_METATABLE);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, lsi_selector_register);
+	lua_setfield(L, -2, "register");
+	lua_pushcfunction(L, lsi_selector_unregister);
+	lua_setfield(L, -2, "unregister");
+	lua_pushcfunction(L, lsi_selector_wait);
+	lua_setfield(L, -2, "wait");
+	lua_pushcfunction(L, lsi_selector_close);
+	lua_setfield(L, -2, "close");
+	lua_pushcfunction(L, lsi_selector_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushstring(L, LSI_SELECTOR_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lsi_selector_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lsi_selector_close);
+	lua_setfield(L, -2, "__close");
+
+	lua_pop(L, 1);
+	return 0;
+}
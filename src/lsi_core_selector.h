@@ -0,0 +1,32 @@
+#ifndef LSI_CORE_SELECTOR_H__
+#define LSI_CORE_SELECTOR_H__
+
+#include "lsi_core.h"
+#include "lua.h"
+
+#define LSI_SELECTOR_METATABLE "LSI_SELECTOR"
+#define SELECTOR_MAX_EVENTS    64
+
+#ifndef _WIN32
+typedef struct lsi_selector_entry {
+    int fd;
+    struct lsi_server* server; // NULL for sockets
+} lsi_selector_entry;
+#endif
+
+typedef struct lsi_selector {
+#ifndef _WIN32
+    int epfd; // -1 when epoll is not available
+    // registered objects, servers are expanded to all of their fds
+    // by the poll fallback
+    lsi_selector_entry* entries;
+    size_t count;
+    size_t capacity;
+#endif
+    int closed;
+} lsi_selector;
+
+int lsi_create_selector_meta(lua_State* L);
+int lsi_selector_new(lua_State* L);
+
+#endif /* LSI_CORE_SELECTOR_H__ */
@@ -1,12 +1,17 @@
 #include <errno.h>
+#include <signal.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include "lauxlib.h"
 #include "lsi_common.h"
+#include "lsi_core_buffer.h"
 #include "lsi_core_server.h"
 #include "lsi_core_socket.h"
+#include "lsi_core_stream.h"
 #include "lsi_errors.h"
+#include "lsi_value.h"
 #include "lua.h"
 #include "lerror.h"
 
@@ -15,11 +20,18 @@
 #else
 #include <fcntl.h>
 #include <poll.h>
+#ifdef __linux__
+#include <sys/epoll.h>
+#endif
 #include <sys/socket.h>
 #include <sys/un.h>
 #include <unistd.h>
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
 static void push_client_from_server(lua_State *L, lua_Integer id)
 {
 	lua_getiuservalue(L, 1, 1);
@@ -91,6 +103,296 @@ static HANDLE DisconnectAndReconnect(PIPE_INSTANCE *pipeInst)
 }
 #endif
 
+#ifndef _WIN32
+// keeps the epoll set exposed through server:get_fd() in sync with fds
+static void watch_fd(lsi_server *server, int fd)
+{
+#ifdef __linux__
+	if (server->epfd != -1) {
+		struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+		epoll_ctl(server->epfd, EPOLL_CTL_ADD, fd, &ev);
+	}
+#endif
+}
+
+static void set_interest(lsi_server *server, size_t index, short events)
+{
+	if (server->fds[index].events == events) {
+		return;
+	}
+	server->fds[index].events = events;
+#ifdef __linux__
+	if (server->epfd != -1) {
+		struct epoll_event ev = { .events = 0,
+					  .data.fd = server->fds[index].fd };
+		ev.events |= (events & POLLIN) ? EPOLLIN : 0;
+		ev.events |= (events & POLLOUT) ? EPOLLOUT : 0;
+		epoll_ctl(server->epfd, EPOLL_CTL_MOD, server->fds[index].fd,
+			  &ev);
+	}
+#endif
+}
+
+static lsi_client *acquire_client_slot(lsi_server *server)
+{
+	if (server->free_clients == NULL) {
+		lsi_client_slab *slab =
+			(lsi_client_slab *)malloc(sizeof(lsi_client_slab));
+		if (slab == NULL) {
+			return NULL;
+		}
+		slab->next = server->slabs;
+		server->slabs = slab;
+		for (int i = CLIENT_SLAB_SIZE - 1; i >= 0; i--) {
+			slab->slots[i].next_free = server->free_clients;
+			server->free_clients = &slab->slots[i];
+		}
+	}
+	lsi_client *client = server->free_clients;
+	server->free_clients = client->next_free;
+	memset(client, 0, sizeof(lsi_client));
+	return client;
+}
+
+// stops capturing on failure instead of writing more after a broken record
+static void capture(lsi_server *server, int type, lsi_client *client,
+		    const char *data, size_t size)
+{
+	if (server->capture.file != NULL &&
+	    lsi_capture_write(&server->capture, type, (uint32_t)client->serial,
+			      data, size) == -1) {
+		lsi_capture_close(&server->capture);
+	}
+}
+
+static void release_client_slot(lsi_server *server, lsi_client *client)
+{
+	if (client->serial != 0) {
+		capture(server, CAPTURE_CLOSE, client, NULL, 0);
+	}
+	lsi_buffer_free(&client->rbuf);
+	for (size_t i = 0; i < client->topic_count; i++) {
+		lsi_topic_remove(&server->topics, client->topics[i], client);
+	}
+	free(client->topics);
+	lsi_timer_cancel(&server->timers, &client->timer);
+	lsi_timer_cancel(&server->resume_timers, &client->resume);
+	client->serial = 0; // invalidates replies from workers
+	client->dirty = 0;
+	if (client->socket != NULL) {
+		lsi_wqueue_clear(&client->socket->wq);
+		client->socket->wq.pool = NULL;
+		client->socket->server = NULL;
+		client->socket->client = NULL;
+	}
+	client->next_free = server->free_clients;
+	server->free_clients = client;
+}
+
+// clients in the middle of a message may read past memory_limit into a
+// reserve of a quarter of it so that their buffers can drain, nobody reads
+// once the reserve is used up
+static int memory_reserve_exhausted(lsi_server *server)
+{
+	return server->memory_limit > 0 &&
+	       server->pool.in_use >=
+		       server->memory_limit + server->memory_limit / 4;
+}
+
+// POLLIN unless reading is paused, POLLOUT while writes are pending
+static void update_interest(lsi_server *server, lsi_client *client)
+{
+	int reading = !client->paused &&
+		      (!server->memory_paused ||
+		       (client->rbuf.data != NULL && !server->memory_exhausted));
+	short events = reading ? POLLIN : 0;
+	if (client->socket != NULL && client->socket->wq.head != NULL &&
+	    !client->corked) {
+		events |= POLLOUT;
+	}
+	set_interest(server, client->index, events);
+}
+
+// pauses or resumes reading when pooled memory crossed the limit
+static void check_memory(lsi_server *server)
+{
+	if (server->memory_limit == 0) {
+		return;
+	}
+	int paused = server->memory_paused ?
+			     server->pool.in_use > server->memory_limit / 4 * 3 :
+			     server->pool.in_use >= server->memory_limit;
+	int exhausted = memory_reserve_exhausted(server);
+	if (paused == server->memory_paused &&
+	    exhausted == server->memory_exhausted) {
+		return;
+	}
+	int pausing = paused && !server->memory_paused;
+	server->memory_paused = paused;
+	server->memory_exhausted = exhausted;
+	if (pausing) {
+		server->memory_pauses++;
+	}
+	for (size_t i = 1; i < server->nfds; i++) {
+		if (server->clients[i] != NULL) {
+			update_interest(server, server->clients[i]);
+		}
+	}
+}
+
+static void refill_client(lsi_client *client, uint64_t now)
+{
+	client->tokens += (double)(now - client->refilled) * client->rate / 1000;
+	if (client->tokens > client->burst) {
+		client->tokens = client->burst;
+	}
+	client->refilled = now;
+}
+
+// takes received bytes from the client token bucket, reading is paused
+// until the deficit is refilled
+static void charge_client(lsi_server *server, lsi_client *client,
+			  size_t bytes, uint64_t now)
+{
+	if (client->rate == 0) {
+		return;
+	}
+	refill_client(client, now);
+	client->tokens -= bytes;
+	if (client->tokens >= 0) {
+		return;
+	}
+	uint64_t wait = (uint64_t)(-client->tokens * 1000 / client->rate) + 1;
+	client->paused = 1;
+	update_interest(server, client);
+	lsi_timer_schedule(&server->resume_timers, &client->resume, now + wait);
+}
+
+// re-enables reading for clients with refilled buckets, returns their count
+static int resume_clients(lsi_server *server)
+{
+	int resumed = 0;
+	uint64_t now = lsi_now_ms();
+	lsi_timer *timer;
+	while ((timer = lsi_timers_expire(&server->resume_timers, now)) !=
+	       NULL) {
+		lsi_client *client =
+			(lsi_client *)((char *)timer -
+				       offsetof(lsi_client, resume));
+		refill_client(client, now);
+		client->paused = 0;
+		update_interest(server, client);
+		resumed++;
+	}
+	return resumed;
+}
+
+// makes room for one more entry in fds, grows geometrically
+static int reserve_fds(lsi_server *server)
+{
+	if (server->nfds < server->fds_capacity) {
+		return 0;
+	}
+	size_t capacity = server->fds_capacity == 0 ?
+				  INITIAL_FDS_CAPACITY :
+				  server->fds_capacity * 2;
+	struct pollfd *fds = (struct pollfd *)realloc(
+		server->fds, capacity * sizeof(struct pollfd));
+	if (fds == NULL) {
+		return -1;
+	}
+	server->fds = fds;
+	lsi_client **clients = (lsi_client **)realloc(
+		server->clients, capacity * sizeof(lsi_client *));
+	if (clients == NULL) {
+		return -1;
+	}
+	server->clients = clients;
+	server->fds_capacity = capacity;
+	return 0;
+}
+
+static void release_client_fd(lsi_server *server, int index)
+{
+#ifdef __linux__
+	if (server->epfd != -1) {
+		epoll_ctl(server->epfd, EPOLL_CTL_DEL, server->fds[index].fd,
+			  NULL);
+	}
+#endif
+	if (server->clients[index] != NULL) {
+		release_client_slot(server, server->clients[index]);
+		server->clients[index] = NULL;
+	}
+	server->fds[index].fd = -1;
+	server->client_count--;
+}
+
+// earliest client deadline, 0 when no timeout applies
+static uint64_t client_deadline(lsi_client *client, const char **kind)
+{
+	uint64_t deadline = 0;
+	const char *expired = NULL;
+	if (client->idle_timeout > 0) {
+		uint64_t last = client->last_read > client->last_write ?
+					client->last_read :
+					client->last_write;
+		deadline = last + client->idle_timeout;
+		expired = "idle";
+	}
+	if (client->read_timeout > 0 &&
+	    (deadline == 0 ||
+	     client->last_read + client->read_timeout < deadline)) {
+		deadline = client->last_read + client->read_timeout;
+		expired = "read";
+	}
+	if (client->write_timeout > 0 && client->socket != NULL &&
+	    client->socket->wq.head != NULL &&
+	    (deadline == 0 ||
+	     client->last_write + client->write_timeout < deadline)) {
+		deadline = client->last_write + client->write_timeout;
+		expired = "write";
+	}
+	if (kind != NULL) {
+		*kind = expired;
+	}
+	return deadline;
+}
+
+// moves the client timer forward if the deadline got closer, later deadlines
+// are picked up when the timer fires
+static void schedule_client_timer(lsi_server *server, lsi_client *client)
+{
+	uint64_t deadline = client_deadline(client, NULL);
+	if (deadline == 0) {
+		lsi_timer_cancel(&server->timers, &client->timer);
+	} else if (client->timer.expires == 0 ||
+		   deadline < client->timer.expires) {
+		lsi_timer_schedule(&server->timers, &client->timer, deadline);
+	}
+}
+#endif
+
+// reports error on top of the stack (popped) to the error callback
+static void callback_failed(lua_State *L, const char *id, lua_Integer clientid)
+{
+	if (lua_type(L, 2) != LUA_TTABLE) {
+		lua_pop(L, 1); // discard error
+		return;
+	}
+	if (lua_getfield(L, 2, "error") == LUA_TFUNCTION) {
+		lua_insert(L, -2); // error_cb error
+		lua_pushstring(L, id);
+		lua_insert(L, -2); // error_cb id error
+		push_client_from_server(L, clientid);
+		if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+			lua_pop(L, 1); // discard error
+		}
+	} else {
+		lua_pop(L, 2); // discard nil and error
+	}
+}
+
 static void callback_error(lua_State *L, const char *id, lua_Integer *clientid,
 			   const char *err)
 {
@@ -98,8 +400,8 @@ static void callback_error(lua_State *L, const char *id, lua_Integer *clientid,
 		if (lua_getfield(L, 2, "error") == LUA_TFUNCTION) {
 			// call error handler with the error pushed by lua_pcall
 			lua_pushstring(L, id); // error id
-			push_error_string(L, id);
-			if (id != NULL) {
+			push_error_string(L, err);
+			if (clientid != NULL) {
 				push_client_from_server(L, *clientid);
 			} else {
 				lua_pushnil(L);
@@ -113,15 +415,40 @@ static void callback_error(lua_State *L, const char *id, lua_Integer *clientid,
 	}
 }
 
+#ifndef _WIN32
+// sends the whole credit window to a new client of a flow controlled server
+static void grant_initial_credits(lua_State *L, lsi_server *server,
+				  lsi_client *client, lua_Integer clientid)
+{
+	lsi_socket *sock = client->socket;
+	sock->mux = lsi_mux_new(1);
+	if (sock->mux == NULL) {
+		callback_error(L, "accept", &clientid, ERROR_OUT_OF_MEMORY);
+		return;
+	}
+	lsi_mux_set_max_message(sock->mux, server->max_frame_size);
+	lsi_mux_set_window(sock->mux, server->credit_messages,
+			   server->credit_bytes);
+	char frame[MUX_GRANT_SIZE];
+	lsi_mux_grant(sock->mux, frame);
+	if (lsi_server_send(server, client, frame, MUX_GRANT_SIZE) == -1) {
+		callback_error(L, "write", &clientid, ERROR_WRITE_FAILED);
+	}
+}
+#endif
+
 // we assume that server is always the first argument
 // and options is always the second argument
 // instanceIndex is relevant only in windows version
-static int accept_client(lua_State *L, lsi_server *server, int instanceIndex)
+// returns -1 if there was nothing to accept, 0 if the connection was refused
+// and 1 if the client was registered (its id is stored in acceptedid)
+static int accept_client(lua_State *L, lsi_server *server, int instanceIndex,
+			 lua_Integer *acceptedid)
 {
 	int hasOptions = lua_type(L, 2) == LUA_TTABLE;
 
 	lsi_socket *client =
-		(lsi_socket *)lua_newuserdatauv(L, sizeof(lsi_socket), 0);
+		(lsi_socket *)lua_newuserdatauv(L, sizeof(lsi_socket), 1);
 	if (client == NULL) {
 		if (hasOptions) {
 			if (lua_getfield(L, 2, "error") == LUA_TFUNCTION) {
@@ -153,7 +480,20 @@ static int accept_client(lua_State *L, lsi_server *server, int instanceIndex)
 	if (client->fd == -1) {
 		client->closed = 1;
 		lua_pop(L, 1); // discard client userdata
-		return 0;
+		return -1;
+	}
+	// queued writes and sendfile must never block the server loop
+	int flags = fcntl(client->fd, F_GETFL, 0);
+	if (flags == -1 ||
+	    fcntl(client->fd, F_SETFL, flags | O_NONBLOCK) == -1) {
+		close(client->fd);
+		client->fd = -1;
+		client->closed = 1;
+		lua_pop(L, 1); // discard client userdata
+		return -1;
+	}
+	if (server->tcp) {
+		lsi_tcp_configure(client->fd, &server->tcp_options);
 	}
 	lua_Integer clientid = (lua_Integer)client->fd;
 #endif
@@ -161,7 +501,20 @@ static int accept_client(lua_State *L, lsi_server *server, int instanceIndex)
 #ifdef _WIN32
 	int shouldAccept = 1;
 #else
-	int shouldAccept = server->client_count < server->max_clients;
+	int shouldAccept = server->max_clients == 0 ||
+			   server->client_count < server->max_clients;
+#endif
+#ifndef _WIN32
+	lsi_client *slot = NULL;
+	if (shouldAccept) {
+		slot = reserve_fds(server) == 0 ? acquire_client_slot(server) :
+						  NULL;
+		if (slot == NULL) {
+			callback_error(L, "accept", &clientid,
+				       ERROR_OUT_OF_MEMORY);
+			shouldAccept = 0;
+		}
+	}
 #endif
 	if (hasOptions) {
 		if (shouldAccept &&
@@ -170,14 +523,8 @@ static int accept_client(lua_State *L, lsi_server *server, int instanceIndex)
 			lua_pushvalue(L, -2);
 			if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
 				// call error handler
-				lua_pushstring(L, "accept"); // error "accept"
-				// bring error to the top of the stack
-				lua_insert(L, -2); // "accept" error
-				push_client_from_server(
-					L, clientid); // accept error userdata
-				if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
-					lua_pop(L, 1); // discard error
-				}
+				callback_failed(L, "accept", clientid);
+				lua_pushnil(L); // placeholder for return value
 				shouldAccept = 0;
 			} else if (lua_isboolean(L, -1) &&
 				   !lua_toboolean(L, -1)) {
@@ -197,15 +544,57 @@ static int accept_client(lua_State *L, lsi_server *server, int instanceIndex)
 			 &pipe->bytesRead, &pipe->dataOverlap);
 #else
 		server->fds[server->nfds].fd = client->fd;
-		server->fds[server->nfds].events = POLLIN;
+		server->fds[server->nfds].events =
+			server->memory_paused ? 0 : POLLIN;
+		server->fds[server->nfds].revents = 0;
+		server->clients[server->nfds] = slot;
+		slot->fd = client->fd;
+		slot->index = server->nfds;
+		slot->socket = client;
+		slot->rbuf.pool = &server->pool;
+		client->wq.pool = &server->pool;
+		slot->serial = ++server->next_serial;
+		capture(server, CAPTURE_OPEN, slot, NULL, 0);
+		slot->last_read = slot->last_write = lsi_now_ms();
+		slot->idle_timeout = server->idle_timeout;
+		slot->read_timeout = server->read_timeout;
+		slot->write_timeout = server->write_timeout;
+		schedule_client_timer(server, slot);
+		slot->rate = server->rate_limit;
+		slot->burst = server->rate_burst > 0 ? server->rate_burst :
+						       server->rate_limit;
+		slot->tokens = slot->burst;
+		slot->refilled = slot->last_read;
+		slot->read_size = server->buffer_size;
+		if (server->read_max > 0) {
+			if (slot->read_size < server->read_min) {
+				slot->read_size = server->read_min;
+			} else if (slot->read_size > server->read_max) {
+				slot->read_size = server->read_max;
+			}
+		}
+		client->server = server;
+		client->client = slot;
+		if (server->decode == DECODE_BUFFER) {
+			// receive buffer reused for the whole connection
+			slot->inbox = lsi_byte_buffer_push(L);
+			lua_setiuservalue(L, -2, 1);
+		}
 		server->nfds++;
 		server->client_count++;
+		watch_fd(server, client->fd);
+		if (server->credit_messages > 0) {
+			grant_initial_credits(L, server, slot, clientid);
+		}
 #endif
 		lua_getiuservalue(L, 1, 1);
 		lua_pushinteger(L, clientid);
 		lua_pushvalue(L, -3); // push client userdata
 		lua_settable(L, -3);
 		lua_pop(L, 1); // discard uv table
+		if (acceptedid != NULL) {
+			*acceptedid = clientid;
+		}
 	} else {
 #ifdef _WIN32
 		if (DisconnectAndReconnect(pipe) == INVALID_HANDLE_VALUE) {
@@ -213,12 +602,15 @@ static int accept_client(lua_State *L, lsi_server *server, int instanceIndex)
 				       ERROR_FAILED_TO_RECREATE_PIPE);
 		}
 #else
+		if (slot != NULL) {
+			release_client_slot(server, slot);
+		}
 		close(client->fd);
 #endif
 		client->closed = 1;
 	}
 	lua_pop(L, 1); // discard client userdata
-	return 0;
+	return shouldAccept;
 }
 
 static void client_disconnected(lua_State *L, lsi_server *server,
@@ -238,16 +630,7 @@ static void client_disconnected(lua_State *L, lsi_server *server,
 			lua_pushstring(L, "disconnected");
 			lua_pushinteger(L, clientid);
 			if ((lua_pcall(L, 2, 0, 0) != LUA_OK)) { // error
-				lua_pushstring(
-					L,
-					"disconnected"); // error "disconnected"
-				// bring error to the top of the stack
-				lua_insert(L, -2); // "disconnected" error
-				push_client_from_server(
-					L, clientid); // accept error userdata
-				if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
-					lua_pop(L, 1); // discard error
-				}
+				callback_failed(L, "disconnected", clientid);
 			}
 		} else {
 			lua_pop(L, 1); // discard nil
@@ -261,39 +644,1502 @@ static void client_disconnected(lua_State *L, lsi_server *server,
 			       ERROR_FAILED_TO_RECREATE_PIPE);
 	}
 #else
-	server->fds[instanceIndex].fd = -1;
-	server->client_count--;
+	release_client_fd(server, instanceIndex);
 #endif
 }
 
-static void data_received(lua_State *L, lua_Integer clientid, char *buffer,
-			  size_t data_len)
+#ifndef _WIN32
+// disconnects the client and closes its socket
+static void drop_client(lua_State *L, lsi_server *server, lsi_client *client)
+{
+	lsi_socket *sock = client->socket;
+	client_disconnected(L, server, client->index);
+	if (sock != NULL && !sock->closed) {
+		close(sock->fd);
+		sock->fd = -1;
+		lsi_buffer_free(&sock->rbuf);
+		sock->closed = 1;
+	}
+}
+#endif
+
+// calls data callback with the client and the value on top of the stack
+static void deliver_data(lua_State *L, lua_Integer clientid)
 {
 	int hasOptions = lua_type(L, 2) == LUA_TTABLE;
 
 	if (hasOptions) {
 		if (lua_getfield(L, 2, "data") == LUA_TFUNCTION) {
+			lua_insert(L, -2); // data value
 			push_client_from_server(L, clientid);
-			lua_pushlstring(L, buffer, data_len);
+			lua_insert(L, -2); // data client value
 			if ((lua_pcall(L, 2, 0, 0) != LUA_OK)) {
-				lua_pushstring(L, "data"); // error "data"
-				// bring error to the top of the stack
-				lua_insert(L, -2); // "data" error
-				push_client_from_server(
-					L, clientid); // data error userdata
-				if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
-					lua_pop(L, 1); // discard error
-				}
+				callback_failed(L, "data", clientid);
+			}
+		} else {
+			lua_pop(L, 2); // discard nil and value
+		}
+	} else {
+		lua_pop(L, 1); // discard value
+	}
+}
+
+static void data_received(lua_State *L, lua_Integer clientid, char *buffer,
+			  size_t data_len)
+{
+	lua_pushlstring(L, buffer, data_len);
+	deliver_data(L, clientid);
+}
+
+#ifndef _WIN32
+// hands complete message to the worker owning the client, messages of one
+// client always go to the same worker to keep them ordered
+static void submit_to_worker(lua_State *L, lsi_server *server,
+			     lsi_client *client, const char *data, size_t size)
+{
+	lsi_workers *pool = server->workers;
+	if (lsi_workers_submit(pool, client->serial % pool->count, client,
+			       client->serial, client->fd, data, size) == -1) {
+		lua_Integer clientid = (lua_Integer)client->fd;
+		callback_error(L, "worker", &clientid, ERROR_OUT_OF_MEMORY);
+	}
+}
+
+// sends worker replies to clients which are still connected
+static int worker_replies(lua_State *L, lsi_server *server)
+{
+	int count = 0;
+	lsi_job *reply = lsi_workers_replies(server->workers);
+	while (reply != NULL) {
+		lsi_job *next = reply->next;
+		lsi_client *client = reply->client;
+		if (!server->closed && client->serial == reply->serial &&
+		    client->socket != NULL) {
+			if (reply->failed) {
+				lua_pushlstring(L, reply->data, reply->size);
+				callback_failed(L, "worker", client->fd);
+			} else if (lsi_server_send(server, client, reply->data,
+						   reply->size) == -1) {
+				lua_Integer clientid = (lua_Integer)client->fd;
+				callback_error(L, "write", &clientid,
+					       ERROR_WRITE_FAILED);
+			}
+			count++;
+		}
+		free(reply);
+		reply = next;
+	}
+	return count;
+}
+
+// sends posts queued from other threads or states
+static int inbox_received(lua_State *L, lsi_server *server)
+{
+	int count = 0;
+	// callbacks may close the server which drops its reference
+	lsi_inbox *inbox = server->inbox;
+	lsi_inbox_retain(inbox);
+	lsi_inbox_begin_drain(inbox);
+	lsi_post *post;
+	while ((post = lsi_inbox_pop(inbox)) != NULL) {
+		lua_Integer clientid = post->clientid;
+		lua_getiuservalue(L, 1, 1);
+		lua_rawgeti(L, -1, clientid);
+		lsi_socket *sock = (lsi_socket *)luaL_testudata(
+			L, -1, LSI_SOCKET_METATABLE);
+		lua_pop(L, 2);
+		if (server->closed) {
+			free(post);
+			continue;
+		}
+		if (sock == NULL || sock->client == NULL) {
+			callback_error(L, "post", &clientid,
+				       ERROR_UNKNOWN_CLIENT);
+		} else if (lsi_server_send(server, sock->client, post->data,
+					   post->size) == -1) {
+			callback_error(L, "write", &clientid,
+				       ERROR_WRITE_FAILED);
+		} else {
+			count++;
+		}
+		free(post);
+	}
+	lsi_inbox_release(inbox);
+	return count;
+}
+
+// handles readiness of poll entries without client
+static int wakeup_received(lua_State *L, lsi_server *server, int fd)
+{
+	if (server->workers != NULL && fd == server->workers->wake[0]) {
+		return worker_replies(L, server);
+	}
+	if (server->inbox != NULL && fd == server->inbox->wake_fd) {
+		return inbox_received(L, server);
+	}
+	return 0;
+}
+
+// decodes and delivers all complete values buffered for the client
+static void values_received(lua_State *L, lsi_server *server,
+			    lsi_client *client, lua_Integer clientid)
+{
+	while (!server->closed && lsi_buffer_size(&client->rbuf) > 0) {
+		size_t size;
+		int res = lsi_value_scan_next(
+			&client->scanner, lsi_buffer_begin(&client->rbuf),
+			lsi_buffer_size(&client->rbuf), server->max_value_size,
+			&size);
+		if (res == 0) {
+			break;
+		}
+		if (res == VALUE_TOO_LARGE) {
+			uint64_t serial = client->serial;
+			callback_error(L, "decode", &clientid,
+				       ERROR_VALUE_TOO_LARGE);
+			if (!server->closed && client->serial == serial) {
+				drop_client(L, server, client);
+			}
+			break;
+		}
+		if (res == -1) {
+			memset(&client->scanner, 0, sizeof(lsi_value_scanner));
+			// stream can not be resynchronized, drop buffered data
+			lsi_buffer_consume(&client->rbuf,
+					   lsi_buffer_size(&client->rbuf));
+			callback_error(L, "decode", &clientid,
+				       ERROR_INVALID_VALUE);
+			break;
+		}
+		if (server->workers != NULL) {
+			// decoded by the worker state
+			submit_to_worker(L, server, client,
+					 lsi_buffer_begin(&client->rbuf), size);
+			lsi_buffer_consume(&client->rbuf, size);
+			continue;
+		}
+		lsi_value_decode(L, lsi_buffer_begin(&client->rbuf), size);
+		lsi_buffer_consume(&client->rbuf, size);
+		deliver_data(L, clientid);
+	}
+}
+#endif
+
+#ifndef _WIN32
+// delivers all complete frames buffered for the client, without delimiter
+static void frames_received(lua_State *L, lsi_server *server,
+			    lsi_client *client, lua_Integer clientid)
+{
+	while (!server->closed) {
+		size_t size = lsi_buffer_size(&client->rbuf);
+		// resume the search where the previous one stopped
+		size_t from = client->scanned;
+		if (from + 1 >= server->delimiter_len) {
+			from = from + 1 - server->delimiter_len;
+		} else {
+			from = 0;
+		}
+		const char *begin = lsi_buffer_begin(&client->rbuf);
+		const char *found = lsi_memmem(begin + from, size - from,
+					       server->delimiter,
+					       server->delimiter_len);
+		if (found == NULL) {
+			client->scanned = size;
+			if (server->max_frame_size > 0 &&
+			    size > server->max_frame_size) {
+				lsi_buffer_consume(&client->rbuf, size);
+				client->scanned = 0;
+				callback_error(L, "decode", &clientid,
+					       ERROR_FRAME_TOO_LARGE);
+			}
+			break;
+		}
+		size_t frame_len = found - begin;
+		if (server->workers != NULL) {
+			submit_to_worker(L, server, client, begin, frame_len);
+		} else {
+			lua_pushlstring(L, begin, frame_len);
+		}
+		lsi_buffer_consume(&client->rbuf,
+				   frame_len + server->delimiter_len);
+		client->scanned = 0;
+		if (server->workers == NULL) {
+			deliver_data(L, clientid);
+		}
+	}
+}
+
+// calls options.streams[stream] or data callback with the client, the message
+// on top of the stack and the stream id
+static void deliver_stream_data(lua_State *L, lua_Integer clientid,
+				uint32_t stream)
+{
+	if (lua_type(L, 2) != LUA_TTABLE) {
+		lua_pop(L, 1); // discard message
+		return;
+	}
+	int handler = LUA_TNIL;
+	if (lua_getfield(L, 2, "streams") == LUA_TTABLE) {
+		handler = lua_geti(L, -1, stream);
+		lua_remove(L, -2); // streams
+	}
+	if (handler != LUA_TFUNCTION) {
+		lua_pop(L, 1);
+		lua_getfield(L, 2, "data");
+	}
+	if (lua_type(L, -1) != LUA_TFUNCTION) {
+		lua_pop(L, 2); // discard nil and message
+		return;
+	}
+	lua_insert(L, -2); // callback message
+	push_client_from_server(L, clientid);
+	lua_insert(L, -2); // callback client message
+	lua_pushinteger(L, stream);
+	if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+		callback_failed(L, "data", clientid);
+	}
+}
+
+// calls writable callback with the client and its credits
+static void client_writable(lua_State *L, lsi_mux *mux, lua_Integer clientid)
+{
+	if (lua_type(L, 2) != LUA_TTABLE) {
+		return;
+	}
+	if (lua_getfield(L, 2, "writable") != LUA_TFUNCTION) {
+		lua_pop(L, 1);
+		return;
+	}
+	push_client_from_server(L, clientid);
+	lua_pushinteger(L, mux->credit_messages);
+	lua_pushinteger(L, mux->credit_bytes);
+	if (lua_pcall(L, 3, 0, 0) != LUA_OK) {
+		callback_failed(L, "writable", clientid);
+	}
+}
+
+// delivers all complete messages of multiplexed streams
+static void streams_received(lua_State *L, lsi_server *server,
+			     lsi_client *client, lua_Integer clientid)
+{
+	lsi_socket *sock = client->socket;
+	if (sock->mux == NULL) {
+		sock->mux = lsi_mux_new(1);
+		if (sock->mux == NULL) {
+			callback_error(L, "read", &clientid,
+				       ERROR_OUT_OF_MEMORY);
+			return;
+		}
+		lsi_mux_set_max_message(sock->mux, server->max_frame_size);
+	}
+	uint64_t serial = client->serial;
+	int was_blocked = sock->mux->blocked;
+	// callbacks may close the server or the client
+	while (!server->closed && client->serial == serial && !sock->closed) {
+		uint32_t stream;
+		lsi_buffer *message;
+		int res = lsi_mux_receive(sock->mux, &client->rbuf, &stream,
+					  &message);
+		if (res == 0) {
+			break;
+		}
+		if (res < 0) {
+			// framing is lost or the peer ignores the limits
+			callback_error(L, "decode", &clientid,
+				       lsi_mux_error(res));
+			if (!server->closed && client->serial == serial) {
+				drop_client(L, server, client);
+			}
+			return;
+		}
+		size_t size = lsi_buffer_size(message);
+		lua_pushlstring(L, lsi_buffer_begin(message), size);
+		deliver_stream_data(L, clientid, stream);
+		// credits are returned once the callback is done with it
+		if (!server->closed && client->serial == serial &&
+		    !sock->closed && lsi_mux_consumed(sock->mux, size)) {
+			char frame[MUX_GRANT_SIZE];
+			lsi_mux_grant(sock->mux, frame);
+			lsi_server_send(server, client, frame, MUX_GRANT_SIZE);
+		}
+	}
+	if (server->closed || client->serial != serial || sock->closed ||
+	    !sock->mux->granted) {
+		return;
+	}
+	sock->mux->granted = 0;
+	lsi_server_flush(server, client);
+	if (was_blocked || sock->mux->blocked) {
+		// messages were held back for lack of credits
+		client_writable(L, sock->mux, clientid);
+	}
+}
+
+// calls options[name] with the client and nargs values on top of the stack
+static void message_callback(lua_State *L, const char *name,
+			     lua_Integer clientid, int nargs)
+{
+	if (lua_type(L, 2) != LUA_TTABLE) {
+		lua_pop(L, nargs);
+		return;
+	}
+	if (lua_getfield(L, 2, name) != LUA_TFUNCTION) {
+		lua_pop(L, nargs + 1);
+		return;
+	}
+	lua_insert(L, -1 - nargs);
+	push_client_from_server(L, clientid);
+	lua_insert(L, -1 - nargs);
+	if (lua_pcall(L, 1 + nargs, 0, 0) != LUA_OK) {
+		callback_failed(L, name, clientid);
+	}
+}
+
+// hands stream mode data to message_start, message_chunk and message_end
+// as it arrives, nothing beyond the read buffer is held whatever the
+// message size, a message cut short by a disconnect gets no message_end
+static void chunks_received(lua_State *L, lsi_server *server,
+			    lsi_client *client, lua_Integer clientid,
+			    const char *data, size_t size)
+{
+	uint64_t serial = client->serial;
+	// callbacks may close the server or the client
+	while (size > 0 && !server->closed && client->serial == serial) {
+		if (!client->in_message) {
+			size_t have = lsi_buffer_size(&client->rbuf);
+			size_t take = STREAM_HEADER_SIZE - have;
+			if (take > size) {
+				take = size;
+			}
+			if (lsi_buffer_append(&client->rbuf, data, take) ==
+			    -1) {
+				callback_error(L, "read", &clientid,
+					       ERROR_OUT_OF_MEMORY);
+				return;
+			}
+			data += take;
+			size -= take;
+			if (have + take < STREAM_HEADER_SIZE) {
+				return;
+			}
+			uint64_t length =
+				lsi_get_u64(lsi_buffer_begin(&client->rbuf));
+			lsi_buffer_consume(&client->rbuf, STREAM_HEADER_SIZE);
+			client->in_message = length > 0;
+			client->message_remaining = length;
+			lua_pushinteger(L, (lua_Integer)length);
+			message_callback(L, "message_start", clientid, 1);
+			if (length == 0 && !server->closed &&
+			    client->serial == serial) {
+				message_callback(L, "message_end", clientid, 0);
+			}
+			continue;
+		}
+		size_t chunk = size;
+		if (chunk > client->message_remaining) {
+			chunk = (size_t)client->message_remaining;
+		}
+		client->message_remaining -= chunk;
+		int last = client->message_remaining == 0;
+		if (last) {
+			client->in_message = 0;
+		}
+		lua_pushlstring(L, data, chunk);
+		data += chunk;
+		size -= chunk;
+		message_callback(L, "message_chunk", clientid, 1);
+		if (last && !server->closed && client->serial == serial) {
+			message_callback(L, "message_end", clientid, 0);
+		}
+	}
+}
+
+// doubles kernel buffer option of fd up to limit, size caches the current
+// value as reported by the kernel
+static void grow_kernel_buffer(lsi_server *server, int fd, int option,
+			       int *size, int limit)
+{
+	socklen_t len = sizeof(int);
+	if (*size == 0 && getsockopt(fd, SOL_SOCKET, option, size, &len) == -1) {
+		return;
+	}
+	if (*size >= limit) {
+		return;
+	}
+	int next = *size > limit / 2 ? limit : *size * 2;
+	if (setsockopt(fd, SOL_SOCKET, option, &next, sizeof(next)) == -1) {
+		return;
+	}
+	len = sizeof(int);
+	if (getsockopt(fd, SOL_SOCKET, option, size, &len) == -1) {
+		*size = next;
+	}
+	server->kernel_grows++;
+}
+
+// grows the receive chunk after reads filling it and shrinks it after a run
+// of small reads, the kernel receive buffer grows once the chunk is maxed
+static void adapt_read_size(lsi_server *server, lsi_client *client,
+			    size_t count)
+{
+	if (count == client->read_size) {
+		client->small_reads = 0;
+		if (client->read_size < server->read_max) {
+			client->read_size *= 2;
+			if (client->read_size > server->read_max) {
+				client->read_size = server->read_max;
+			}
+			server->read_grows++;
+		} else if (server->rcvbuf_max > 0) {
+			grow_kernel_buffer(server, client->fd, SO_RCVBUF,
+					   &client->rcvbuf, server->rcvbuf_max);
+		}
+	} else if (count < client->read_size / 4 && server->read_max > 0) {
+		if (++client->small_reads >= READ_SHRINK_AFTER &&
+		    client->read_size > server->read_min) {
+			client->read_size /= 2;
+			if (client->read_size < server->read_min) {
+				client->read_size = server->read_min;
+			}
+			client->small_reads = 0;
+			server->read_shrinks++;
+		}
+	} else {
+		client->small_reads = 0;
+	}
+}
+
+// size of the shared read buffer, fits the largest client chunk
+static size_t read_capacity(lsi_server *server)
+{
+	return server->read_max > server->buffer_size ? server->read_max :
+							server->buffer_size;
+}
+
+// hands the receive buffer back to the pool once everything was consumed so
+// that idle clients hold no buffer memory
+static void release_idle_buffer(lsi_server *server, lsi_client *client)
+{
+	if (client->rbuf.data == NULL || lsi_buffer_size(&client->rbuf) > 0) {
+		return;
+	}
+	lsi_buffer_free(&client->rbuf);
+	client->scanned = 0;
+	if (server->memory_paused) {
+		update_interest(server, client);
+	}
+}
+
+// returns number of bytes read
+static size_t read_client(lua_State *L, lsi_server *server, int index,
+			  char *buffer)
+{
+	lua_Integer clientid = (lua_Integer)server->fds[index].fd;
+	lsi_client *client = server->clients[index];
+	if (memory_reserve_exhausted(server)) {
+		// checked per read, the pause only starts once the tick ends
+		check_memory(server);
+		update_interest(server, client);
+		return 0;
+	}
+	uint64_t serial = client->serial;
+	uint64_t now = lsi_now_ms();
+	client->last_read = now;
+	// values are decoded in place and buffers are handed to lua as they
+	// are, both read straight into the client owned buffer
+	lsi_buffer *target = NULL;
+	if (server->decode == DECODE_VALUE ||
+	    server->decode == DECODE_DELIMITED ||
+	    server->decode == DECODE_MUX) {
+		target = &client->rbuf;
+	} else if (server->decode == DECODE_BUFFER) {
+		target = &client->inbox->buffer;
+	}
+	size_t read_size = client->read_size;
+	if (target != NULL) {
+		if (lsi_buffer_reserve(target, read_size) == -1) {
+			callback_error(L, "read", &clientid,
+				       ERROR_OUT_OF_MEMORY);
+			return 0;
+		}
+		buffer = lsi_buffer_end(target);
+	}
+	ssize_t count = read(server->fds[index].fd, buffer, read_size);
+	if (count > 0) {
+		// before the callbacks which may release the client
+		capture(server, CAPTURE_DATA, client, buffer, count);
+		charge_client(server, client, count, now);
+		adapt_read_size(server, client, count);
+	}
+	if (count == -1) {
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			callback_error(L, "read", &clientid, ERROR_READ_FAILED);
+			remove_client_from_server(L, clientid);
+			release_client_fd(server, index);
+		}
+		return 0;
+	} else if (count == 0) {
+		client_disconnected(L, server, index);
+		return 0;
+	} else if (server->decode == DECODE_VALUE) {
+		client->rbuf.len += count;
+		values_received(L, server, client, clientid);
+	} else if (server->decode == DECODE_DELIMITED) {
+		client->rbuf.len += count;
+		frames_received(L, server, client, clientid);
+	} else if (server->decode == DECODE_MUX) {
+		client->rbuf.len += count;
+		streams_received(L, server, client, clientid);
+	} else if (server->decode == DECODE_STREAM) {
+		chunks_received(L, server, client, clientid, buffer, count);
+	} else if (server->decode == DECODE_BUFFER) {
+		target->len += count;
+		push_client_from_server(L, clientid);
+		lua_getiuservalue(L, -1, 1); // client buffer
+		lua_remove(L, -2);
+		deliver_data(L, clientid);
+	} else if (server->workers != NULL) {
+		submit_to_worker(L, server, client, buffer, count);
+	} else {
+		data_received(L, clientid, buffer, count);
+	}
+	// server:close() in a callback frees the client slabs and the pool
+	if (!server->closed && client->serial == serial) {
+		release_idle_buffer(server, client);
+	}
+	return count;
+}
+
+static void flush_client(lsi_server *server, size_t index)
+{
+	lsi_client *client = server->clients[index];
+	if (client == NULL || client->socket == NULL) {
+		return;
+	}
+	lsi_socket *sock = client->socket;
+	int res;
+	int progress = 0;
+	for (;;) {
+		// keep only a window of stream frames queued so that urgent
+		// messages pushed later still overtake bulk transfers
+		if (sock->mux != NULL && sock->wq.size < MUX_WINDOW) {
+			long added = lsi_mux_fill(sock->mux, &sock->wq,
+						  MUX_WINDOW);
+			if (added == -1) {
+				res = -1;
+				break;
+			}
+		}
+		size_t pending = sock->wq.size;
+		res = lsi_wqueue_flush(&sock->wq, client->fd);
+		if (sock->wq.size != pending) {
+			progress = 1;
+		}
+		if (res != 0 || sock->mux == NULL || sock->mux->queued == 0 ||
+		    sock->mux->blocked) {
+			break;
+		}
+	}
+	if (res == -1) {
+		// peer is gone, the read path reports the disconnect
+		lsi_wqueue_clear(&sock->wq);
+	} else if (progress) {
+		client->last_write = lsi_now_ms();
+	}
+	update_interest(server, client);
+	if (res == 1 && server->sndbuf_max > 0) {
+		// the peer keeps up but the kernel buffer is too small
+		grow_kernel_buffer(server, client->fd, SO_SNDBUF,
+				   &client->sndbuf, server->sndbuf_max);
+	}
+	if (res == 1 && client->write_timeout > 0) {
+		schedule_client_timer(server, client);
+	}
+}
+
+int lsi_server_flush(lsi_server *server, lsi_client *client)
+{
+	flush_client(server, client->index);
+	return 0;
+}
+
+// whether writes to the client are held back instead of sent right away
+static int coalescing(lsi_server *server, lsi_client *client)
+{
+	return client->corked || (server->coalesce > 0 && server->in_tick);
+}
+
+// called after data was queued for a coalescing client, flushes once the
+// threshold is reached and otherwise at the end of the tick
+static void coalesce_client(lsi_server *server, lsi_client *client)
+{
+	size_t limit = server->coalesce > 0 ? server->coalesce :
+					      DEFAULT_COALESCE_SIZE;
+	if (client->socket->wq.size >= limit) {
+		flush_client(server, client->index);
+		return;
+	}
+	if (client->corked || client->dirty) {
+		return;
+	}
+	if (server->dirty_count == server->dirty_capacity) {
+		size_t capacity = server->dirty_capacity > 0 ?
+					  server->dirty_capacity * 2 :
+					  INITIAL_FDS_CAPACITY;
+		lsi_client **dirty = (lsi_client **)realloc(
+			server->dirty, capacity * sizeof(lsi_client *));
+		if (dirty == NULL) {
+			flush_client(server, client->index);
+			return;
+		}
+		server->dirty = dirty;
+		server->dirty_capacity = capacity;
+	}
+	server->dirty[server->dirty_count++] = client;
+	client->dirty = 1;
+}
+
+// end of tick, one gathered write per client written to during the tick
+static void flush_dirty(lsi_server *server)
+{
+	for (size_t i = 0; i < server->dirty_count; i++) {
+		lsi_client *client = server->dirty[i];
+		// released slots are cleared, reused ones are flushed anyway
+		if (client->dirty) {
+			client->dirty = 0;
+			flush_client(server, client->index);
+		}
+	}
+	server->dirty_count = 0;
+}
+
+void lsi_server_cork(lsi_server *server, lsi_client *client, int corked)
+{
+	client->corked = corked;
+	if (!corked) {
+		flush_client(server, client->index);
+	}
+}
+
+int lsi_server_send(lsi_server *server, lsi_client *client, const char *data,
+		    size_t size)
+{
+	lsi_wqueue *wq = &client->socket->wq;
+	int coalesce = coalescing(server, client);
+	if (wq->head == NULL && !coalesce) {
+		client->last_write = lsi_now_ms();
+		// nothing queued, try to write directly
+		ssize_t written = send(client->fd, data, size,
+				       MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written == -1) {
+			if (errno != EAGAIN && errno != EWOULDBLOCK &&
+			    errno != EINTR) {
+				return -1;
+			}
+			written = 0;
+		}
+		data += written;
+		size -= written;
+		if (size == 0) {
+			return 0;
+		}
+	}
+	if (lsi_wqueue_push_copy(wq, data, size) == -1) {
+		return -1;
+	}
+	if (coalesce) {
+		coalesce_client(server, client);
+		return 0;
+	}
+	update_interest(server, client);
+	if (client->write_timeout > 0) {
+		schedule_client_timer(server, client);
+	}
+	return 0;
+}
+
+void lsi_server_set_timeouts(lsi_server *server, lsi_client *client,
+			     lua_Integer idle_ms, lua_Integer read_ms,
+			     lua_Integer write_ms)
+{
+	if (idle_ms >= 0) {
+		client->idle_timeout = (uint32_t)idle_ms;
+	}
+	if (read_ms >= 0) {
+		client->read_timeout = (uint32_t)read_ms;
+	}
+	if (write_ms >= 0) {
+		client->write_timeout = (uint32_t)write_ms;
+	}
+	schedule_client_timer(server, client);
+}
+
+void lsi_server_set_rate_limit(lsi_server *server, lsi_client *client,
+			       uint32_t rate, uint32_t burst)
+{
+	uint64_t now = lsi_now_ms();
+	if (client->rate == 0) {
+		client->refilled = now;
+		client->tokens = burst > 0 ? burst : rate;
+	} else {
+		refill_client(client, now);
+	}
+	client->rate = rate;
+	client->burst = burst > 0 ? burst : rate;
+	if (client->tokens > client->burst) {
+		client->tokens = client->burst;
+	}
+	if (rate == 0 && client->paused) {
+		lsi_timer_cancel(&server->resume_timers, &client->resume);
+		client->paused = 0;
+		update_interest(server, client);
+	}
+}
+
+lsi_inbox *lsi_server_get_inbox(lsi_server *server)
+{
+	if (server->inbox == NULL) {
+		if (reserve_fds(server) == -1) {
+			return NULL;
+		}
+		server->inbox = lsi_inbox_new();
+		if (server->inbox == NULL) {
+			return NULL;
+		}
+		server->fds[server->nfds].fd = server->inbox->wake_fd;
+		server->fds[server->nfds].events = POLLIN;
+		server->fds[server->nfds].revents = 0;
+		server->clients[server->nfds] = NULL;
+		server->nfds++;
+		watch_fd(server, server->inbox->wake_fd);
+	}
+	lsi_inbox_retain(server->inbox);
+	return server->inbox;
+}
+
+// closes client which missed its deadline, unless the timeout callback
+// returns true in which case the expired period starts over
+static void client_timed_out(lua_State *L, lsi_server *server,
+			     lsi_client *client, const char *kind, uint64_t now)
+{
+	size_t index = client->index;
+	lua_Integer clientid = (lua_Integer)client->fd;
+	int keep = 0;
+	if (lua_type(L, 2) == LUA_TTABLE &&
+	    lua_getfield(L, 2, "timeout") == LUA_TFUNCTION) {
+		push_client_from_server(L, clientid);
+		lua_pushstring(L, kind);
+		if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+			callback_failed(L, "timeout", clientid);
+		} else {
+			keep = lua_toboolean(L, -1);
+			lua_pop(L, 1); // discard return value
+		}
+	} else if (lua_type(L, 2) == LUA_TTABLE) {
+		lua_pop(L, 1); // discard nil
+	}
+	if (server->closed || server->clients[index] != client) {
+		return; // released by the callback
+	}
+	if (keep) {
+		if (strcmp(kind, "write") != 0) {
+			client->last_read = now;
+		}
+		if (strcmp(kind, "read") != 0) {
+			client->last_write = now;
+		}
+		schedule_client_timer(server, client);
+		return;
+	}
+	drop_client(L, server, client);
+}
+
+// handles clients with expired timers, returns number of timed out clients
+static int expire_clients(lua_State *L, lsi_server *server)
+{
+	int expired = 0;
+	uint64_t now = lsi_now_ms();
+	lsi_timer *timer;
+	while (!server->closed &&
+	       (timer = lsi_timers_expire(&server->timers, now)) != NULL) {
+		lsi_client *client =
+			(lsi_client *)((char *)timer -
+				       offsetof(lsi_client, timer));
+		const char *kind;
+		uint64_t deadline = client_deadline(client, &kind);
+		if (deadline == 0) {
+			continue;
+		}
+		if (deadline > now) {
+			// activity moved the deadline since it was scheduled
+			lsi_timer_schedule(&server->timers, &client->timer,
+					   deadline);
+			continue;
+		}
+		expired++;
+		client_timed_out(L, server, client, kind, now);
+	}
+	return expired;
+}
+
+int lsi_server_send_file(lsi_server *server, lsi_client *client, int file_fd,
+			 uint64_t offset, size_t length, int owns_fd)
+{
+	if (lsi_wqueue_push_file(&client->socket->wq, file_fd, offset, length,
+				 owns_fd) == -1) {
+		return -1;
+	}
+	// sent in kernel space as the socket drains
+	flush_client(server, client->index);
+	return 0;
+}
+
+// queues shared payload for the client, returns -1 on failure
+static int send_payload(lsi_server *server, lsi_client *client,
+			lsi_payload *payload)
+{
+	if (client->socket == NULL || client->socket->closed) {
+		return -1;
+	}
+	if (lsi_wqueue_push(&client->socket->wq, payload) == -1) {
+		return -1;
+	}
+	if (coalescing(server, client)) {
+		coalesce_client(server, client);
+	} else {
+		flush_client(server, client->index);
+	}
+	return 0;
+}
+
+int lsi_server_subscribe(lsi_server *server, lsi_client *client,
+			 const char *topic_name, size_t topic_len)
+{
+	lsi_topic *topic = lsi_topics_get(&server->topics, topic_name,
+					  topic_len);
+	if (topic == NULL) {
+		return -1;
+	}
+	for (size_t i = 0; i < client->topic_count; i++) {
+		if (client->topics[i] == topic) {
+			return 0;
+		}
+	}
+	if (client->topic_count == client->topic_capacity) {
+		size_t capacity = client->topic_capacity == 0 ?
+					  4 :
+					  client->topic_capacity * 2;
+		lsi_topic **topics = (lsi_topic **)realloc(
+			client->topics, capacity * sizeof(lsi_topic *));
+		if (topics == NULL) {
+			return -1;
+		}
+		client->topics = topics;
+		client->topic_capacity = capacity;
+	}
+	if (lsi_topic_add(topic, client) == -1) {
+		return -1;
+	}
+	client->topics[client->topic_count++] = topic;
+	return 0;
+}
+
+int lsi_server_unsubscribe(lsi_server *server, lsi_client *client,
+			   const char *topic_name, size_t topic_len)
+{
+	lsi_topic *topic = lsi_topics_find(&server->topics, topic_name,
+					   topic_len);
+	if (topic == NULL) {
+		return 0;
+	}
+	for (size_t i = 0; i < client->topic_count; i++) {
+		if (client->topics[i] == topic) {
+			client->topics[i] =
+				client->topics[--client->topic_count];
+			lsi_topic_remove(&server->topics, topic, client);
+			return 1;
+		}
+	}
+	return 0;
+}
+
+// drops disconnected clients from the fds array
+static void compact_fds(lsi_server *server)
+{
+	size_t j = 0;
+	size_t cursor = 0;
+	for (size_t i = 0; i < server->nfds; i++) {
+		if (server->fds[i].fd == -1) {
+			continue;
+		}
+		if (cursor == 0 && i >= server->cursor && i > 0) {
+			cursor = j; // first live entry at or after the cursor
+		}
+		if (i != j) {
+			server->fds[j] = server->fds[i];
+			server->clients[j] = server->clients[i];
+			if (server->clients[j] != NULL) {
+				server->clients[j]->index = j;
+			}
+		}
+		j++;
+	}
+	server->nfds = j;
+	server->cursor = cursor;
+}
+#endif
+
+// waits up to timeout ms for events and dispatches them to the callbacks
+// returns number of ready handles, 0 on timeout or -1 on failure
+#ifndef _WIN32
+// shortens timeout in ms to the nearest timer, -1 waits without limit
+static int next_timeout(lsi_server *server, int timeout)
+{
+	uint64_t now = lsi_now_ms();
+	int timers_timeout = lsi_timers_timeout(&server->timers, now);
+	if (timers_timeout >= 0 && (timeout < 0 || timers_timeout < timeout)) {
+		timeout = timers_timeout;
+	}
+	timers_timeout = lsi_timers_timeout(&server->resume_timers, now);
+	if (timers_timeout >= 0 && (timeout < 0 || timers_timeout < timeout)) {
+		timeout = timers_timeout;
+	}
+	return timeout;
+}
+
+// work due at the end of every tick, returns number of handled timers
+static int finish_tick(lua_State *L, lsi_server *server)
+{
+	int ret = resume_clients(server);
+	ret += expire_clients(L, server);
+	if (!server->closed) {
+		flush_dirty(server);
+	}
+	check_memory(server);
+	server->in_tick = 0;
+	compact_fds(server);
+	return ret;
+}
+#endif
+
+static int server_poll(lua_State *L, lsi_server *server, int timeout)
+{
+#ifdef _WIN32
+	DWORD wait_res = WaitForMultipleObjects(
+		server->max_clients, server->hEvents, FALSE, timeout);
+	if (wait_res == WAIT_FAILED) {
+		return -1;
+	}
+	if (wait_res == WAIT_TIMEOUT) {
+		return 0;
+	}
+	// connections
+	for (int i = 0; i < server->max_clients; i++) {
+		PIPE_INSTANCE *pipe = &server->instances[i];
+		if (WaitForSingleObject(pipe->connectOverlap.hEvent, 0) ==
+		    WAIT_OBJECT_0) {
+			ResetEvent(pipe->connectOverlap.hEvent);
+			accept_client(L, server, i, NULL);
+		}
+	}
+	// data
+	for (int i = 0; i < server->max_clients; i++) {
+		PIPE_INSTANCE *pipe = &server->instances[i];
+		lua_Integer clientid = (lua_Integer)pipe->hPipe;
+		if (WaitForSingleObject(pipe->dataOverlap.hEvent, 0) ==
+		    WAIT_OBJECT_0) {
+			ResetEvent(pipe->dataOverlap.hEvent);
+
+			BOOL fSuccess = GetOverlappedResult(pipe->hPipe,
+							    &pipe->dataOverlap,
+							    &pipe->bytesRead,
+							    FALSE);
+			if (!fSuccess) {
+				if (GetLastError() == ERROR_BROKEN_PIPE) {
+					// Client disconnected
+					client_disconnected(L, server, i);
+				} else {
+					callback_error(L, "read", &clientid,
+						       ERROR_READ_FAILED);
+					remove_client_from_server(L, clientid);
+					if (DisconnectAndReconnect(pipe) ==
+					    INVALID_HANDLE_VALUE) {
+						callback_error(
+							L, "internal",
+							&clientid,
+							ERROR_FAILED_TO_RECREATE_PIPE);
+					}
+				}
+			} else {
+				if (pipe->bytesRead > 0) {
+					data_received(L, clientid, pipe->buffer,
+						      pipe->bytesRead);
+				} else { // no data read, client may have disconnected
+					client_disconnected(L, server, i);
+				}
+			}
+		}
+	}
+	return 1;
+#else
+	// memory may have been released outside of the loop
+	check_memory(server);
+	// wake up for the nearest client deadline
+	timeout = next_timeout(server, timeout);
+	int ret = lsi_spin_poll(&server->spin, server->fds, server->nfds,
+				timeout);
+	if (ret == -1) {
+		// interrupted by a signal, let the caller decide what to do
+		return errno == EINTR ? 0 : -1;
+	}
+	server->in_tick = 1;
+
+	// Check for new connection
+	if (server->fds[0].revents & POLLIN) {
+		// accept in while loop
+		while (accept_client(
+			       L, server,
+			       0 /* instance index is relevant only in windows version */,
+			       NULL) != -1) {
+		}
+	}
+	// Check each client for data
+	size_t capacity = read_capacity(server);
+	char *buffer = (char *)lsi_pool_alloc(&server->pool, &capacity);
+	// round robin from the cursor so a budget does not favour low indices
+	size_t count = server->nfds - 1;
+	size_t start = server->cursor >= 1 && server->cursor < server->nfds ?
+			       server->cursor :
+			       1;
+	size_t handled = 0;
+	size_t bytes = 0;
+	for (size_t n = 0; n < count && !server->closed; n++) {
+		size_t i = 1 + (start - 1 + n) % count;
+		short revents = server->fds[i].revents;
+		if (revents == 0 || server->fds[i].fd == -1) {
+			continue;
+		}
+		if (server->clients[i] == NULL) {
+			// worker or inbox wake fd, not subject to the budget
+			ret += wakeup_received(L, server, server->fds[i].fd);
+			continue;
+		}
+		if ((server->max_events > 0 && handled >= server->max_events) ||
+		    (server->max_bytes > 0 && bytes >= server->max_bytes)) {
+			// still ready, reported again by the next poll
+			server->cursor = i;
+			break;
+		}
+		handled++;
+		if (revents & POLLOUT) {
+			flush_client(server, i);
+		}
+		if (revents & (POLLIN | POLLHUP | POLLERR | POLLNVAL)) {
+			bytes += read_client(L, server, i, buffer);
+		}
+	}
+	if (server->closed) {
+		// pool is gone with the clients
+		free(buffer);
+		return ret;
+	}
+	lsi_pool_release(&server->pool, buffer, capacity);
+	return ret + finish_tick(L, server);
+#endif
+}
+
+int lsi_server_process_events(lua_State *L)
+{
+	lsi_server *server = (lsi_server *)lua_touserdata(L, 1);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+	int hasOptions = lua_type(L, 2) == LUA_TTABLE;
+
+	int timeout = 0;
+	if (hasOptions) {
+		lua_getfield(L, 2, "timeout");
+		timeout = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+	}
+	if (server_poll(L, server, timeout) == -1) {
+		return push_error(L, ERROR_POLL_FAILED);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+static int accept_async_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, 2);
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	for (;;) {
+		lua_Integer clientid;
+		int res = accept_client(L, server, 0, &clientid);
+		if (res == 1) {
+			push_client_from_server(L, clientid);
+			return 1;
+		}
+		if (res == 0) {
+			continue; // refused, wait for the next one
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK) {
+			return push_error(L, ERROR_ACCEPT_FAILED);
+		}
+		if (lua_isyieldable(L)) {
+			// let the scheduler wait for the listening socket
+			lua_pushinteger(L, server->fd);
+			lua_pushstring(L, "read");
+			return lua_yieldk(L, 2, ctx, accept_async_k);
+		}
+		struct pollfd pfd = { .fd = server->fd, .events = POLLIN };
+		if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+			return push_error(L, ERROR_POLL_FAILED);
+		}
+	}
+#endif
+}
+
+// accepts the next client, yielding (fd, "read") to the running coroutine
+// scheduler while there is nothing to accept
+int lsi_server_accept_async(lua_State *L)
+{
+	return accept_async_k(L, LUA_OK, 0);
+}
+
+#ifndef _WIN32
+int lsi_server_poll_fd(lsi_server *server)
+{
+#ifdef __linux__
+	if (server->epfd == -1) {
+		server->epfd = epoll_create1(EPOLL_CLOEXEC);
+		if (server->epfd == -1) {
+			return -1;
+		}
+		for (size_t i = 0; i < server->nfds; i++) {
+			if (server->fds[i].fd != -1) {
+				watch_fd(server, server->fds[i].fd);
+			}
+		}
+	}
+	return server->epfd;
+#else
+	return server->fd;
+#endif
+}
+#endif
+
+// returns fd which becomes readable whenever the server has work to do
+// on linux this is an epoll fd covering the listening socket and all clients,
+// elsewhere it is the listening socket only
+int lsi_server_get_fd(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	int fd = lsi_server_poll_fd(server);
+	if (fd == -1) {
+		return push_error(L, ERROR_POLL_FAILED);
+	}
+	lua_pushinteger(L, fd);
+	return 1;
+#endif
+}
+
+// server:get_timeout() - ms until the next client timeout or rate limit
+// resume is due, -1 when none is scheduled, for external event loops
+int lsi_server_get_timeout(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lua_pushinteger(L, next_timeout(server, -1));
+	return 1;
+#endif
+}
+
+// server:dispatch(fd, [events], [options]) - handles readiness reported by an
+// external event loop for the given fd without polling, client timeouts,
+// rate limit resumes and coalesced writes are handled by every call, a nil
+// fd only runs those and should be dispatched at least every
+// server:get_timeout() ms
+int lsi_server_dispatch(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	int fd = lua_isnoneornil(L, 2) ? -1 : (int)luaL_checkinteger(L, 2);
+	int events = (int)luaL_optinteger(L, 3, POLLIN);
+	// callbacks expect options at index 2
+	lua_settop(L, 4);
+	lua_replace(L, 2);
+	lua_settop(L, 2);
+
+#ifdef __linux__
+	if (fd != -1 && fd == server->epfd) {
+		if (server_poll(L, server, 0) == -1) {
+			return push_error(L, ERROR_POLL_FAILED);
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+#endif
+	int found = fd == -1;
+	server->in_tick = 1;
+	if (fd != -1 && fd == server->fd) {
+		while (accept_client(L, server, 0, NULL) != -1) {
+		}
+		found = 1;
+	}
+	for (size_t i = 1; !found && i < server->nfds; i++) {
+		if (server->fds[i].fd != fd) {
+			continue;
+		}
+		found = 1;
+		if (server->clients[i] == NULL) {
+			wakeup_received(L, server, fd);
+			break;
+		}
+		if (events & POLLOUT) {
+			flush_client(server, i);
+		}
+		if (events & (POLLIN | POLLHUP | POLLERR)) {
+			size_t capacity = read_capacity(server);
+			char *buffer = (char *)lsi_pool_alloc(&server->pool,
+							      &capacity);
+			if (buffer == NULL) {
+				server->in_tick = 0;
+				return push_error(L, ERROR_READ_FAILED);
+			}
+			read_client(L, server, i, buffer);
+			if (server->closed) {
+				// pool is gone with the clients
+				free(buffer);
+				break;
+			}
+			lsi_pool_release(&server->pool, buffer, capacity);
+		}
+	}
+	if (!server->closed) {
+		finish_tick(L, server);
+	}
+	if (!found) {
+		return push_error(L, ERROR_UNKNOWN_FD);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+// server:broadcast(data, [{ except = client_or_id }])
+// queues one shared copy of data to every connected client
+int lsi_server_broadcast(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+	size_t size;
+	const char *data = luaL_checklstring(L, 2, &size);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_socket *except = NULL;
+	lua_Integer except_id = -1;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "except");
+		except = (lsi_socket *)luaL_testudata(L, -1,
+						      LSI_SOCKET_METATABLE);
+		if (except == NULL && lua_isinteger(L, -1)) {
+			except_id = lua_tointeger(L, -1);
+		}
+		lua_pop(L, 1);
+	}
+
+	lsi_payload *payload =
+		lsi_payload_new_pooled(&server->pool, data, size);
+	if (payload == NULL) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	lua_Integer count = 0;
+	for (size_t i = 1; i < server->nfds; i++) {
+		lsi_client *client = server->clients[i];
+		if (client == NULL || client->fd == except_id ||
+		    (except != NULL && client->socket == except)) {
+			continue;
+		}
+		if (send_payload(server, client, payload) == 0) {
+			count++;
+		}
+	}
+	lsi_payload_release(payload);
+	lua_pushinteger(L, count);
+	return 1;
+#endif
+}
+
+// server:publish(topic, data) - queues one shared copy of data to every
+// client subscribed to topic through client:subscribe(topic)
+int lsi_server_publish(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+	size_t topic_len, size;
+	const char *topic_name = luaL_checklstring(L, 2, &topic_len);
+	const char *data = luaL_checklstring(L, 3, &size);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_topic *topic =
+		lsi_topics_find(&server->topics, topic_name, topic_len);
+	if (topic == NULL) {
+		lua_pushinteger(L, 0);
+		return 1;
+	}
+	lsi_payload *payload =
+		lsi_payload_new_pooled(&server->pool, data, size);
+	if (payload == NULL) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	lua_Integer count = 0;
+	for (size_t i = 0; i < topic->count; i++) {
+		if (send_payload(server, topic->members[i], payload) == 0) {
+			count++;
+		}
+	}
+	lsi_payload_release(payload);
+	lua_pushinteger(L, count);
+	return 1;
+#endif
+}
+
+static volatile sig_atomic_t stop_signal_received = 0;
+
+static void stop_signal_handler(int sig)
+{
+	stop_signal_received = sig;
+}
+
+static int signal_from_name(const char *name)
+{
+	if (strcmp(name, "SIGINT") == 0) {
+		return SIGINT;
+	}
+	if (strcmp(name, "SIGTERM") == 0) {
+		return SIGTERM;
+	}
+#ifndef _WIN32
+	if (strcmp(name, "SIGHUP") == 0) {
+		return SIGHUP;
+	}
+	if (strcmp(name, "SIGUSR1") == 0) {
+		return SIGUSR1;
+	}
+	if (strcmp(name, "SIGUSR2") == 0) {
+		return SIGUSR2;
+	}
+#endif
+	return 0;
+}
+
+static int signal_from_value(lua_State *L, int idx)
+{
+	if (lua_type(L, idx) == LUA_TNUMBER) {
+		return (int)lua_tointeger(L, idx);
+	}
+	if (lua_type(L, idx) == LUA_TSTRING) {
+		return signal_from_name(lua_tostring(L, idx));
+	}
+	return 0;
+}
+
+// collects signals from stop_on option (single value or list)
+static int collect_stop_signals(lua_State *L, int *signals)
+{
+	int count = 0;
+	lua_getfield(L, 2, "stop_on");
+	if (lua_type(L, -1) == LUA_TTABLE) {
+		size_t len = lua_rawlen(L, -1);
+		for (size_t i = 1; i <= len && count < MAX_STOP_SIGNALS; i++) {
+			lua_rawgeti(L, -1, i);
+			int sig = signal_from_value(L, -1);
+			if (sig > 0) {
+				signals[count++] = sig;
 			}
-		} else {
-			lua_pop(L, 1); // discard nil
+			lua_pop(L, 1);
+		}
+	} else {
+		int sig = signal_from_value(L, -1);
+		if (sig > 0) {
+			signals[count++] = sig;
 		}
 	}
+	lua_pop(L, 1);
+	return count;
 }
 
-int lsi_server_process_events(lua_State *L)
+static void call_tick(lua_State *L)
 {
-	lsi_server *server = (lsi_server *)lua_touserdata(L, 1);
+	if (lua_getfield(L, 2, "tick") == LUA_TFUNCTION) {
+		if (lua_pcall(L, 0, 0, 0) != LUA_OK) {
+			callback_failed(L, "tick", 0);
+		}
+	} else {
+		lua_pop(L, 1); // discard nil
+	}
+}
+
+// server:run({ until_idle, deadline, stop_on, interval, tick, ...callbacks })
+// keeps dispatching events inside C until one of the stop conditions is met
+int lsi_server_run(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
 	if (server == NULL) {
 		return push_error(L, ERROR_SERVER_IS_NIL);
 	}
@@ -302,113 +2148,103 @@ int lsi_server_process_events(lua_State *L)
 	}
 	int hasOptions = lua_type(L, 2) == LUA_TTABLE;
 
-	int timeout = 0;
+	int until_idle = 0;
+	lua_Integer deadline_ms = -1;
+	lua_Integer interval = 0;
+	int signals[MAX_STOP_SIGNALS];
+	int signal_count = 0;
 	if (hasOptions) {
-		lua_getfield(L, 2, "timeout");
-		timeout = luaL_optinteger(L, -1, 0);
+		lua_getfield(L, 2, "until_idle");
+		until_idle = lua_toboolean(L, -1);
 		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "deadline");
+		deadline_ms = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "interval");
+		interval = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		signal_count = collect_stop_signals(L, signals);
 	}
-#ifdef _WIN32
-	DWORD wait_res = WaitForMultipleObjects(
-		server->max_clients, server->hEvents, FALSE, timeout);
-	if (wait_res == WAIT_FAILED) {
-		return push_error(L, ERROR_POLL_FAILED);
-	}
-	// connections
-	for (int i = 0; i < server->max_clients; i++) {
-		PIPE_INSTANCE *pipe = &server->instances[i];
-		if (WaitForSingleObject(pipe->connectOverlap.hEvent, 0) ==
-		    WAIT_OBJECT_0) {
-			ResetEvent(pipe->connectOverlap.hEvent);
-			accept_client(L, server, i);
-		}
+
+	void (*previous_handlers[MAX_STOP_SIGNALS])(int);
+	stop_signal_received = 0;
+	for (int i = 0; i < signal_count; i++) {
+		previous_handlers[i] = signal(signals[i], stop_signal_handler);
 	}
-	// data
-	for (int i = 0; i < server->max_clients; i++) {
-		PIPE_INSTANCE *pipe = &server->instances[i];
-		lua_Integer clientid = (lua_Integer)pipe->hPipe;
-		if (WaitForSingleObject(pipe->dataOverlap.hEvent, 0) ==
-		    WAIT_OBJECT_0) {
-			ResetEvent(pipe->dataOverlap.hEvent);
 
-			BOOL fSuccess = GetOverlappedResult(pipe->hPipe,
-							    &pipe->dataOverlap,
-							    &pipe->bytesRead,
-							    FALSE);
-			if (!fSuccess) {
-				if (GetLastError() == ERROR_BROKEN_PIPE) {
-					// Client disconnected
-					client_disconnected(L, server, i);
-				} else {
-					callback_error(L, "read", &clientid,
-						       ERROR_READ_FAILED);
-					remove_client_from_server(L, clientid);
-					if (DisconnectAndReconnect(pipe) ==
-					    INVALID_HANDLE_VALUE) {
-						callback_error(
-							L, "internal",
-							&clientid,
-							ERROR_FAILED_TO_RECREATE_PIPE);
-					}
-				}
-			} else {
-				if (pipe->bytesRead > 0) {
-					data_received(L, clientid, pipe->buffer,
-						      pipe->bytesRead);
-				} else { // no data read, client may have disconnected
-					client_disconnected(L, server, i);
-				}
+	uint64_t now = lsi_now_ms();
+	uint64_t deadline = deadline_ms >= 0 ? now + deadline_ms : 0;
+	uint64_t next_tick = interval > 0 ? now + interval : 0;
+	const char *reason = NULL;
+	int failed = 0;
+	server->stop_requested = 0;
+	while (reason == NULL) {
+		int timeout = until_idle ? 0 : -1;
+		if (deadline_ms >= 0) {
+			int remaining = now >= deadline ? 0 : (int)(deadline - now);
+			if (timeout == -1 || remaining < timeout) {
+				timeout = remaining;
 			}
 		}
-	}
-#else
-	int ret = poll(server->fds, server->nfds, timeout);
-	if (ret == -1) {
-		return push_error(L, ERROR_POLL_FAILED);
-	}
+		if (interval > 0) {
+			int remaining = now >= next_tick ? 0 :
+							   (int)(next_tick - now);
+			if (timeout == -1 || remaining < timeout) {
+				timeout = remaining;
+			}
+		}
+#ifdef _WIN32
+		// WaitForMultipleObjects is not interrupted by signals
+		if (signal_count > 0 &&
+		    (timeout == -1 || timeout > RUN_SIGNAL_CHECK_INTERVAL)) {
+			timeout = RUN_SIGNAL_CHECK_INTERVAL;
+		}
+#endif
+		int ret = server_poll(L, server, timeout);
+		if (ret == -1) {
+			failed = 1;
+			break;
+		}
+		now = lsi_now_ms();
+		if (interval > 0 && now >= next_tick) {
+			call_tick(L);
+			next_tick = now + interval;
+		}
 
-	// Check for new connection
-	if (server->fds[0].revents & POLLIN) {
-		// accept in while loop
-		while (accept_client(
-			L, server,
-			0 /* instance index is relevant only in windows version */)) {
+		if (server->closed || server->stop_requested) {
+			reason = "stopped";
+		} else if (stop_signal_received) {
+			reason = "signal";
+		} else if (deadline_ms >= 0 && now >= deadline) {
+			reason = "deadline";
+		} else if (until_idle && ret == 0) {
+			reason = "idle";
 		}
 	}
-	// Check each client for data
-	char *buffer = malloc(server->buffer_size * sizeof(char));
-	for (int i = 1; i < server->nfds; i++) {
-		if (server->fds[i].revents & POLLIN) {
-			lua_Integer clientid = (lua_Integer)server->fds[i].fd;
-			ssize_t count = read(server->fds[i].fd, buffer,
-					     server->buffer_size);
-			if (count == -1) {
-				if (errno != EAGAIN && errno != EWOULDBLOCK) {
-					callback_error(L, "read", &clientid,
-						       ERROR_READ_FAILED);
-					remove_client_from_server(L, clientid);
-					server->fds[i].fd = -1;
-					server->client_count--;
-				}
-			} else if (count == 0) {
-				client_disconnected(L, server, i);
-			} else {
-				data_received(L, clientid, buffer, count);
-			}
-		}
+
+	for (int i = 0; i < signal_count; i++) {
+		signal(signals[i], previous_handlers[i]);
 	}
-	free(buffer);
-	// Compress the fds array
-	for (int i = 0; i < server->nfds; i++) {
-		if (server->fds[i].fd == -1) {
-			for (int j = i; j < server->nfds - 1; j++) {
-				server->fds[j] = server->fds[j + 1];
-			}
-			i--;
-			server->nfds--;
-		}
+	server->stop_requested = 0;
+	if (failed) {
+		return push_error(L, ERROR_POLL_FAILED);
 	}
-#endif
+	lua_pushboolean(L, 1);
+	lua_pushstring(L, reason);
+	return 2;
+}
+
+int lsi_server_stop(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	server->stop_requested = 1;
 	lua_pushboolean(L, 1);
 	return 1;
 }
@@ -426,6 +2262,13 @@ lsi_server *create_server_instance(lua_State *L, const char *path,
 	server->closed = 1;
 	server->buffer_size = DEFAULT_BUFFER_SIZE;
 	server->max_clients = DEFAULT_MAX_CLIENTS;
+#ifndef _WIN32
+	server->fd = -1;
+	server->epfd = -1;
+	lsi_timers_init(&server->timers, lsi_now_ms());
+	lsi_timers_init(&server->resume_timers, lsi_now_ms());
+	lsi_pool_init(&server->pool, POOL_DEFAULT_CACHE);
+#endif
 	luaL_getmetatable(L, LSI_SERVER_METATABLE);
 	lua_setmetatable(L, -2);
 
@@ -435,6 +2278,9 @@ lsi_server *create_server_instance(lua_State *L, const char *path,
 	if (server->path == NULL) {
 		return NULL;
 	}
+	server->tcp = lsi_is_tcp_endpoint(server->path);
+	lsi_tcp_options_init(&server->tcp_options);
+	lsi_socket_read_tcp_options(L, 2, &server->tcp_options);
 
 	// options
 	if (lua_type(L, 2) == LUA_TTABLE) { // options table
@@ -444,6 +2290,106 @@ lsi_server *create_server_instance(lua_State *L, const char *path,
 			luaL_optinteger(L, -1, DEFAULT_MAX_CLIENTS);
 		lua_pop(L, 1);
 
+		lua_getfield(L, 2, "decode");
+		if (lua_type(L, -1) == LUA_TSTRING) {
+			if (strcmp(lua_tostring(L, -1), "value") == 0) {
+				server->decode = DECODE_VALUE;
+			} else if (strcmp(lua_tostring(L, -1), "buffer") == 0) {
+				server->decode = DECODE_BUFFER;
+			} else if (strcmp(lua_tostring(L, -1), "stream") == 0) {
+				server->decode = DECODE_STREAM;
+			}
+		}
+		lua_pop(L, 1);
+
+		// frame data callback input on delimiter, e.g. "\n"
+		lua_getfield(L, 2, "delimiter");
+		if (lua_type(L, -1) == LUA_TSTRING &&
+		    lua_rawlen(L, -1) > 0) {
+			size_t delimiter_len;
+			const char *delimiter =
+				lua_tolstring(L, -1, &delimiter_len);
+			server->delimiter = (char *)malloc(delimiter_len);
+			if (server->delimiter == NULL) {
+				lua_pop(L, 1);
+				return NULL;
+			}
+			memcpy(server->delimiter, delimiter, delimiter_len);
+			server->delimiter_len = delimiter_len;
+			server->decode = DECODE_DELIMITED;
+		}
+		lua_pop(L, 1);
+
+		// streams opened with socket:open_stream on connecting side
+		lua_getfield(L, 2, "multiplex");
+		if (lua_toboolean(L, -1)) {
+			server->decode = DECODE_MUX;
+		}
+		lua_pop(L, 1);
+#ifndef _WIN32
+		if (lsi_stream_read_credits(L, 2, &server->credit_messages,
+					    &server->credit_bytes)) {
+			server->decode = DECODE_MUX;
+		}
+#endif
+
+		lua_getfield(L, 2, "max_frame_size");
+		server->max_frame_size = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "max_value_size");
+		server->max_value_size = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+#ifndef _WIN32
+		// client timeouts in ms
+		lua_getfield(L, 2, "idle_timeout");
+		server->idle_timeout = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "read_timeout");
+		server->read_timeout = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "write_timeout");
+		server->write_timeout = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		// fairness budget per process_events call
+		lua_getfield(L, 2, "max_events");
+		server->max_events = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "max_bytes");
+		server->max_bytes = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		// per client bytes per second
+		lua_getfield(L, 2, "rate_limit");
+		server->rate_limit = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "rate_burst");
+		server->rate_burst =
+			luaL_optinteger(L, -1, server->rate_limit);
+		lua_pop(L, 1);
+
+		// true or flush threshold in bytes
+		lua_getfield(L, 2, "coalesce");
+		if (lua_isboolean(L, -1)) {
+			server->coalesce =
+				lua_toboolean(L, -1) ? DEFAULT_COALESCE_SIZE : 0;
+		} else {
+			server->coalesce = luaL_optinteger(L, -1, 0);
+		}
+		lua_pop(L, 1);
+
+		// busy-poll window in microseconds
+		lua_getfield(L, 2, "spin_us");
+		lsi_spin_init(&server->spin, luaL_optinteger(L, -1, 0));
+		lua_pop(L, 1);
+#endif
+
 		// get max msg size
 		lua_getfield(L, 2, "buffer_size");
 		server->buffer_size =
@@ -452,6 +2398,52 @@ lsi_server *create_server_instance(lua_State *L, const char *path,
 			server->buffer_size = DEFAULT_BUFFER_SIZE;
 		}
 		lua_pop(L, 1);
+#ifndef _WIN32
+		// true or { min = bytes, max = bytes }, buffer_size is the
+		// initial chunk then
+		int type = lua_getfield(L, 2, "adaptive_buffer");
+		if (type == LUA_TTABLE || lua_toboolean(L, -1)) {
+			server->read_min = ADAPTIVE_READ_MIN;
+			server->read_max = ADAPTIVE_READ_MAX;
+			if (type == LUA_TTABLE) {
+				lua_getfield(L, -1, "min");
+				server->read_min =
+					luaL_optinteger(L, -1, ADAPTIVE_READ_MIN);
+				lua_getfield(L, -2, "max");
+				server->read_max =
+					luaL_optinteger(L, -1, ADAPTIVE_READ_MAX);
+				lua_pop(L, 2);
+			}
+			if (server->read_min < 1) {
+				server->read_min = 1;
+			}
+			if (server->read_max < server->read_min) {
+				server->read_max = server->read_min;
+			}
+		}
+		lua_pop(L, 1);
+
+		// { recv_max = bytes, send_max = bytes } kernel buffer limits
+		if (lua_getfield(L, 2, "kernel_buffers") == LUA_TTABLE) {
+			lua_getfield(L, -1, "recv_max");
+			server->rcvbuf_max = luaL_optinteger(L, -1, 0);
+			lua_getfield(L, -2, "send_max");
+			server->sndbuf_max = luaL_optinteger(L, -1, 0);
+			lua_pop(L, 2);
+		}
+		lua_pop(L, 1);
+
+		// pooled bytes at which reading pauses
+		lua_getfield(L, 2, "memory_limit");
+		server->memory_limit = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		// free buffer bytes kept for reuse
+		lua_getfield(L, 2, "pool_cache");
+		server->pool.max_cached =
+			luaL_optinteger(L, -1, POOL_DEFAULT_CACHE);
+		lua_pop(L, 1);
+#endif
 	}
 	// clients tables
 	lua_newtable(L);
@@ -477,6 +2469,99 @@ void close_server_handles(lsi_server *server)
 }
 #endif
 
+#ifndef _WIN32
+// starts pool described by { module = "name", count = n } at idx, leaves
+// error message on the stack and returns -1 on failure
+static int start_workers(lua_State *L, lsi_server *server, int idx)
+{
+	lua_getfield(L, idx, "module");
+	lua_getfield(L, idx, "count");
+	const char *module = lua_tostring(L, -2);
+	lua_Integer count = luaL_optinteger(L, -1, 1);
+	if (module == NULL || count < 1) {
+		lua_pushstring(L, ERROR_INVALID_WORKERS);
+		return -1;
+	}
+	if (server->decode == DECODE_BUFFER || server->decode == DECODE_MUX ||
+	    server->decode == DECODE_STREAM) {
+		lua_pushstring(L, ERROR_NOT_SUPPORTED);
+		return -1;
+	}
+	// workers resolve modules the same way as this state
+	const char *path = NULL;
+	const char *cpath = NULL;
+	if (lua_getglobal(L, "package") == LUA_TTABLE) {
+		lua_getfield(L, -1, "path");
+		lua_getfield(L, -2, "cpath");
+		path = lua_tostring(L, -2);
+		cpath = lua_tostring(L, -1);
+	}
+	char *err = NULL;
+	lsi_workers *pool =
+		lsi_workers_start(module, count, server->decode == DECODE_VALUE,
+				  path, cpath, &err);
+	if (pool == NULL) {
+		lua_pushstring(L, err != NULL ? err : ERROR_OUT_OF_MEMORY);
+		free(err);
+		return -1;
+	}
+	if (reserve_fds(server) == -1) {
+		lsi_workers_stop(pool);
+		lua_pushstring(L, ERROR_OUT_OF_MEMORY);
+		return -1;
+	}
+	server->workers = pool;
+	server->fds[server->nfds].fd = pool->wake[0];
+	server->fds[server->nfds].events = POLLIN;
+	server->fds[server->nfds].revents = 0;
+	server->clients[server->nfds] = NULL;
+	server->nfds++;
+	watch_fd(server, pool->wake[0]);
+	lua_settop(L, idx);
+	return 0;
+}
+
+// capture = path or { path = path, payloads = false } to record sizes only
+static int start_capture(lua_State *L, lsi_server *server)
+{
+	int top = lua_gettop(L);
+	int type = lua_getfield(L, 2, "capture");
+	const char *path = NULL;
+	int payloads = 1;
+	if (type == LUA_TSTRING) {
+		path = lua_tostring(L, -1);
+	} else if (type == LUA_TTABLE) {
+		lua_getfield(L, -1, "path");
+		path = lua_tostring(L, -1);
+		if (lua_getfield(L, -2, "payloads") != LUA_TNIL) {
+			payloads = lua_toboolean(L, -1);
+		}
+	}
+	int res = path == NULL ? 0 :
+				 lsi_capture_create(&server->capture, path,
+						    payloads);
+	lua_settop(L, top);
+	return res;
+}
+
+// binds server->fd to the socket file, replacing a stale one
+static int bind_unix_socket(lsi_server *server)
+{
+	struct sockaddr_un server_addr;
+	memset(&server_addr, 0, sizeof(struct sockaddr_un));
+	server_addr.sun_family = AF_UNIX;
+	memcpy((void *)server_addr.sun_path, server->path, server->path_len);
+	if (unlink(server->path) == -1 && errno != ENOENT) {
+		return -1;
+	}
+	if (bind(server->fd, (struct sockaddr *)&server_addr,
+		 sizeof(server_addr)) == -1) {
+		return -1;
+	}
+	return listen(server->fd, SOMAXCONN);
+}
+#endif
+
 int lsi_listen(lua_State *L)
 {
 	size_t path_len;
@@ -485,7 +2570,7 @@ int lsi_listen(lua_State *L)
 		return push_error(L, ERROR_PATH_IS_NIL);
 	}
 
-	if (path_len > MAX_PATH_LEN) {
+	if (path_len > MAX_PATH_LEN && !lsi_is_tcp_endpoint(path)) {
 		return push_error(L, ERROR_PATH_TOO_LONG);
 	}
 
@@ -495,6 +2580,9 @@ int lsi_listen(lua_State *L)
 	}
 
 #ifdef _WIN32
+	if (server->tcp) {
+		return push_error(L, ERROR_NOT_SUPPORTED);
+	}
 	server->hEvents =
 		(HANDLE *)malloc(server->max_clients * sizeof(HANDLE) * 2);
 	if (server->hEvents == NULL) {
@@ -537,16 +2625,16 @@ int lsi_listen(lua_State *L)
 	}
 	server->closed = 0;
 #else
-	server->fds = malloc(sizeof(struct pollfd) * (server->max_clients + 1));
-	if (server->fds == NULL) {
+	if (reserve_fds(server) == -1) {
 		return push_error(L, ERROR_FAILED_TO_CREATE_SERVER_INSTANCE);
 	}
-	for (size_t i = 0; i < server->max_clients + 1; i++) {
-		server->fds[i].fd = -1;
-		server->fds[i].events = POLLIN;
-	}
 
-	server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (server->tcp) {
+		// bound and listening already
+		server->fd = lsi_tcp_listen(server->path, &server->tcp_options);
+	} else {
+		server->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+	}
 	if (server->fd == -1) {
 		return push_error(L, ERROR_FAILED_TO_CREATE_SERVER_INSTANCE);
 	}
@@ -560,25 +2648,24 @@ int lsi_listen(lua_State *L)
 		return push_error(L, ERROR_STATE_CHECK_FAILED);
 	}
 	server->fds[0].fd = server->fd;
+	server->fds[0].events = POLLIN;
+	server->clients[0] = NULL;
 	server->nfds = 1;
 
-	struct sockaddr_un server_addr;
-	memset(&server_addr, 0, sizeof(struct sockaddr_un));
-	server_addr.sun_family = AF_UNIX;
-	if (memcpy((void *)server_addr.sun_path, server->path,
-		   server->path_len) == NULL) {
+	if (!server->tcp && bind_unix_socket(server) == -1) {
 		return push_error(L, ERROR_FAILED_TO_CREATE_SERVER_INSTANCE);
 	}
 
-	if (unlink(server->path) == -1 && errno != ENOENT) {
-		return push_error(L, ERROR_FAILED_TO_CREATE_SERVER_INSTANCE);
-	}
-	if (bind(server->fd, (struct sockaddr *)&server_addr,
-		 sizeof(server_addr)) == -1) {
-		return push_error(L, ERROR_FAILED_TO_CREATE_SERVER_INSTANCE);
-	}
-	if (listen(server->fd, server->max_clients) == -1) {
-		return push_error(L, ERROR_FAILED_TO_CREATE_SERVER_INSTANCE);
+	if (lua_type(L, 2) == LUA_TTABLE) {
+		lua_getfield(L, 2, "workers");
+		if (lua_istable(L, -1) &&
+		    start_workers(L, server, lua_gettop(L)) == -1) {
+			return push_error(L, lua_tostring(L, -1));
+		}
+		lua_pop(L, 1);
+		if (start_capture(L, server) == -1) {
+			return push_error(L, ERROR_CAPTURE_OPEN_FAILED);
+		}
 	}
 #endif
 	return 1;
@@ -638,20 +2725,62 @@ int lst_server_close(lua_State *L)
 		free((void *)server->path);
 	}
 #else
+	if (server->workers != NULL) {
+		lsi_workers_stop(server->workers);
+		server->workers = NULL;
+	}
+	if (server->inbox != NULL) {
+		// other references may outlive the server, posts fail from now
+		atomic_store(&server->inbox->closed, 1);
+		lsi_inbox_release(server->inbox);
+		server->inbox = NULL;
+	}
+	for (size_t i = 1; i < server->nfds; i++) {
+		if (server->clients[i] != NULL) {
+			release_client_slot(server, server->clients[i]);
+		}
+	}
 	server->client_count = 0;
 	server->nfds = 0;
 	if (server->fds != NULL) {
 		free(server->fds);
+		server->fds = NULL;
 	}
+	free(server->clients);
+	server->clients = NULL;
+	server->fds_capacity = 0;
+	lsi_topics_free(&server->topics);
+	free(server->dirty);
+	server->dirty = NULL;
+	server->dirty_count = server->dirty_capacity = 0;
+	server->in_tick = 0;
+	while (server->slabs != NULL) {
+		lsi_client_slab *next = server->slabs->next;
+		free(server->slabs);
+		server->slabs = next;
+	}
+	server->free_clients = NULL;
+	lsi_pool_free(&server->pool);
+	lsi_capture_close(&server->capture);
 	if (server->path != NULL) {
-		unlink(server->path);
+		if (!server->tcp) {
+			unlink(server->path);
+		}
 		free((void *)server->path);
 	}
 	if (server->fd != -1) {
 		close(server->fd);
 		server->fd = -1;
 	}
+	if (server->epfd != -1) {
+		close(server->epfd);
+		server->epfd = -1;
+	}
 #endif
+	if (server->delimiter != NULL) {
+		free(server->delimiter);
+		server->delimiter = NULL;
+	}
 
 	if (closeClients) {
 		lua_getiuservalue(L, 1, 1); // uv
@@ -719,6 +2848,98 @@ int lsi_server_get_client_limit(lua_State *L)
 	return 1;
 }
 
+// server:post(clientid, data) - queues data for the client, it is written
+// by the event loop, see also server:get_inbox()
+int lsi_server_post(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	lua_Integer clientid = luaL_checkinteger(L, 2);
+	size_t size;
+	const char *data = luaL_checklstring(L, 3, &size);
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_inbox *inbox = lsi_server_get_inbox(server);
+	if (inbox == NULL) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	int res = lsi_inbox_post(inbox, (int)clientid, data, size);
+	lsi_inbox_release(inbox);
+	if (res == -1) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+// server:get_inbox() - returns inbox which can be posted to from other
+// threads and, through inbox:handle(), from other lua states
+int lsi_server_get_inbox_lua(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server->closed) {
+		return push_error(L, ERROR_SERVER_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_inbox *inbox = lsi_server_get_inbox(server);
+	if (inbox == NULL) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	lsi_inbox_ref_push(L, inbox);
+	return 1;
+#endif
+}
+
+// server:get_stats() - returns table with event loop counters
+int lsi_server_get_stats(lua_State *L)
+{
+	lsi_server *server =
+		(lsi_server *)luaL_checkudata(L, 1, LSI_SERVER_METATABLE);
+	if (server == NULL) {
+		return push_error(L, ERROR_SERVER_IS_NIL);
+	}
+	lua_newtable(L);
+#ifndef _WIN32
+	lua_pushinteger(L, server->client_count);
+	lua_setfield(L, -2, "clients");
+	lua_pushinteger(L, server->spin.hits);
+	lua_setfield(L, -2, "spin_hits");
+	lua_pushinteger(L, server->spin.misses);
+	lua_setfield(L, -2, "spin_misses");
+	lua_pushinteger(L, server->spin.window_us);
+	lua_setfield(L, -2, "spin_window_us");
+	lua_pushinteger(L, server->read_grows);
+	lua_setfield(L, -2, "read_grows");
+	lua_pushinteger(L, server->read_shrinks);
+	lua_setfield(L, -2, "read_shrinks");
+	lua_pushinteger(L, server->kernel_grows);
+	lua_setfield(L, -2, "kernel_buffer_grows");
+	lua_pushinteger(L, server->pool.hits);
+	lua_setfield(L, -2, "pool_hits");
+	lua_pushinteger(L, server->pool.misses);
+	lua_setfield(L, -2, "pool_misses");
+	lua_pushinteger(L, server->pool.in_use);
+	lua_setfield(L, -2, "pool_in_use");
+	lua_pushinteger(L, server->pool.cached);
+	lua_setfield(L, -2, "pool_cached");
+	lua_pushboolean(L, server->memory_paused);
+	lua_setfield(L, -2, "memory_paused");
+	lua_pushinteger(L, server->memory_pauses);
+	lua_setfield(L, -2, "memory_pauses");
+	lua_pushinteger(L, server->capture.records);
+	lua_setfield(L, -2, "capture_records");
+#endif
+	return 1;
+}
+
 int lsi_create_server_meta(lua_State *L)
 {
 	luaL_newmetatable(L, LSI_SERVER_METATABLE);
@@ -729,10 +2950,32 @@ int lsi_create_server_meta(lua_State *L)
 	lua_setfield(L, -2, "close");
 	lua_pushcfunction(L, lsi_server_process_events);
 	lua_setfield(L, -2, "process_events");
+	lua_pushcfunction(L, lsi_server_accept_async);
+	lua_setfield(L, -2, "accept_async");
+	lua_pushcfunction(L, lsi_server_get_fd);
+	lua_setfield(L, -2, "get_fd");
+	lua_pushcfunction(L, lsi_server_get_timeout);
+	lua_setfield(L, -2, "get_timeout");
+	lua_pushcfunction(L, lsi_server_dispatch);
+	lua_setfield(L, -2, "dispatch");
+	lua_pushcfunction(L, lsi_server_broadcast);
+	lua_setfield(L, -2, "broadcast");
+	lua_pushcfunction(L, lsi_server_publish);
+	lua_setfield(L, -2, "publish");
+	lua_pushcfunction(L, lsi_server_run);
+	lua_setfield(L, -2, "run");
+	lua_pushcfunction(L, lsi_server_stop);
+	lua_setfield(L, -2, "stop");
 	lua_pushcfunction(L, lsi_server_clients);
 	lua_setfield(L, -2, "get_clients");
-	lua_pushcfunction(L, lsi_server_tostring);
+	lua_pushcfunction(L, lsi_server_get_client_limit);
 	lua_setfield(L, -2, "get_client_limit");
+	lua_pushcfunction(L, lsi_server_get_stats);
+	lua_setfield(L, -2, "get_stats");
+	lua_pushcfunction(L, lsi_server_post);
+	lua_setfield(L, -2, "post");
+	lua_pushcfunction(L, lsi_server_get_inbox_lua);
+	lua_setfield(L, -2, "get_inbox");
 	lua_pushcfunction(L, lsi_server_tostring);
 	lua_setfield(L, -2, "__tostring");
 	lua_pushstring(L, LSI_SERVER_METATABLE);
@@ -1,15 +1,48 @@
 #ifndef LSI_CORE_SERVER_H__
 #define LSI_CORE_SERVER_H__
 
+#include "lsi_buffer.h"
+#include "lsi_capture.h"
 #include "lsi_core.h"
+#include "lsi_inbox.h"
+#include "lsi_pool.h"
+#include "lsi_spin.h"
+#include "lsi_tcp.h"
+#include "lsi_timers.h"
+#include "lsi_topics.h"
+#include "lsi_value.h"
+#include "lsi_workers.h"
+#include "lsi_wqueue.h"
 #include "lua.h"
 
+#ifdef _WIN32
 #define DEFAULT_MAX_CLIENTS  5
+#else
+#define DEFAULT_MAX_CLIENTS  0 // no limit, capacity grows on demand
+#endif
+#define MAX_STOP_SIGNALS     8
+#define CLIENT_SLAB_SIZE     32
+#define INITIAL_FDS_CAPACITY 16
+// adaptive receive chunk, doubled after full reads and halved after a run
+// of reads using less than a quarter of it
+#define ADAPTIVE_READ_MIN    256
+#define ADAPTIVE_READ_MAX    (256 * 1024)
+#define READ_SHRINK_AFTER    8
+
+// how received data is passed to the data callback
+#define DECODE_RAW           0
+#define DECODE_VALUE         1 // see lsi_value.h
+#define DECODE_BUFFER        2 // per client LSI_BUFFER, see lsi_core_buffer.h
+#define DECODE_DELIMITED     3 // frames split on server->delimiter
+#define DECODE_MUX           4 // multiplexed streams, see lsi_mux.h
+#define DECODE_STREAM        5 // length prefixed, delivered in chunks
+#define STREAM_HEADER_SIZE   8 // u64 message length, big endian
 
 #define LSI_SERVER_METATABLE "LSI_SERVER"
 
 #ifdef _WIN32
 #define PIPE_TIMEOUT 5000
+#define RUN_SIGNAL_CHECK_INTERVAL 100
 
 typedef struct {
     HANDLE hPipe;
@@ -21,26 +54,160 @@ typedef struct {
 } PIPE_INSTANCE;
 #endif
 
+#ifndef _WIN32
+// per connection state, allocated from slabs and reused on disconnect
+typedef struct lsi_client {
+    int fd;
+    size_t index; // position in server->fds
+    lsi_buffer rbuf; // partially received values or frames
+    size_t scanned; // rbuf bytes already searched for the delimiter
+    lsi_value_scanner scanner; // DECODE_VALUE progress through rbuf
+    struct lsi_byte_buffer* inbox; // DECODE_BUFFER receive buffer
+    struct lsi_socket* socket; // userdata kept alive by the clients table
+    lsi_topic** topics; // subscriptions
+    size_t topic_count;
+    size_t topic_capacity;
+    // timeouts in ms, 0 disables, timer holds the earliest deadline and is
+    // rescheduled lazily when it fires before the real deadline
+    lsi_timer timer;
+    uint64_t last_read;
+    uint64_t last_write; // last write progress
+    uint32_t idle_timeout;
+    uint32_t read_timeout;
+    uint32_t write_timeout; // pending writes have to make progress in time
+    // token bucket limiting received bytes per second, rate 0 disables
+    uint32_t rate;
+    uint32_t burst;
+    double tokens;
+    uint64_t refilled;
+    int paused; // POLLIN interest dropped until resume fires
+    lsi_timer resume;
+    uint64_t serial; // unique per connection, 0 once released
+    int corked; // writes held until socket:uncork()
+    int dirty; // in server->dirty, flushed at the end of the tick
+    size_t read_size; // receive chunk, adapts when server->read_max is set
+    int small_reads; // consecutive reads under a quarter of read_size
+    int rcvbuf; // kernel buffer sizes, 0 until autotuning first looked
+    int sndbuf;
+    // DECODE_STREAM message being received, rbuf holds a partial header
+    int in_message;
+    uint64_t message_remaining;
+    struct lsi_client* next_free;
+} lsi_client;
+
+typedef struct lsi_client_slab {
+    struct lsi_client_slab* next;
+    lsi_client slots[CLIENT_SLAB_SIZE];
+} lsi_client_slab;
+#endif
+
 typedef struct lsi_server {
 #ifndef _WIN32
     int fd;
+    int epfd; // created on demand by server:get_fd()
 #endif
-    const char* path;
+    const char* path; // socket file or tcp://host:port
     size_t path_len;
-    size_t max_clients;
+    int tcp;
+    lsi_tcp_options tcp_options;
+    size_t max_clients; // soft cap on posix, 0 means unlimited
     size_t buffer_size;
+    int decode;
+    char* delimiter; // DECODE_DELIMITED frame separator
+    size_t delimiter_len;
+    size_t max_frame_size; // 0 means unlimited, MUX_MAX_MESSAGE for streams
+    size_t max_value_size; // DECODE_VALUE clients are closed beyond it
 #ifdef _WIN32
     HANDLE* hEvents;
     PIPE_INSTANCE* instances;
 #else
     size_t client_count;
     struct pollfd* fds;
+    lsi_client** clients; // parallel to fds, NULL for the listening socket
     size_t nfds;
+    size_t fds_capacity;
+    lsi_client_slab* slabs;
+    lsi_client* free_clients;
+    lsi_topics topics;
+    lsi_timers timers;
+    // defaults for new clients
+    uint32_t idle_timeout;
+    uint32_t read_timeout;
+    uint32_t write_timeout;
+    // per call budget, 0 means unlimited, cursor is where the next call
+    // resumes when the budget ran out
+    size_t max_events;
+    size_t max_bytes;
+    size_t cursor;
+    uint32_t rate_limit;
+    uint32_t rate_burst;
+    lsi_timers resume_timers; // paused clients
+    lsi_spin spin; // busy-poll before blocking in poll()
+    // messages are handled by worker states when set, wake fd is polled
+    // as an entry without client
+    lsi_workers* workers;
+    uint64_t next_serial;
+    lsi_inbox* inbox; // created on first use, wake fd polled like workers
+    // credits granted to each client of a multiplexed server, 0 disables
+    // flow control
+    uint32_t credit_messages;
+    uint32_t credit_bytes;
+    // receive chunk bounds per client, read_max 0 uses buffer_size for all
+    size_t read_min;
+    size_t read_max;
+    // kernel buffers double while a client saturates them, up to these
+    // limits, 0 leaves them alone
+    int rcvbuf_max;
+    int sndbuf_max;
+    size_t read_grows;
+    size_t read_shrinks;
+    size_t kernel_grows;
+    // writes made while events are dispatched are flushed together at the
+    // end of the tick or once coalesce bytes are queued, 0 disables
+    size_t coalesce;
+    int in_tick;
+    lsi_client** dirty;
+    size_t dirty_count;
+    size_t dirty_capacity;
+    // receive buffers, queued writes and the per tick read buffer are
+    // borrowed from the pool, reading pauses while more than memory_limit
+    // bytes are borrowed and resumes below three quarters of it, clients
+    // with a partial message keep reading up to a quarter above the limit
+    lsi_pool pool;
+    size_t memory_limit; // 0 means unlimited
+    int memory_paused;
+    int memory_exhausted; // reserve above memory_limit used up as well
+    size_t memory_pauses;
+    // connections and received data are recorded for core.replay() while
+    // capture.file is set
+    lsi_capture capture;
 #endif
     int closed;
+    int stop_requested; // set by server:stop(), checked by server:run()
 } lsi_server;
 
 int lsi_listen(lua_State* L);
 int lsi_create_server_meta(lua_State* L);
+#ifndef _WIN32
+// fd which becomes readable when the server has pending events
+int lsi_server_poll_fd(lsi_server* server);
+// queues data for the client and writes as much as possible right away
+int lsi_server_send(lsi_server* server, lsi_client* client, const char* data, size_t size);
+// queues file range, file_fd is closed once sent if owns_fd is set
+int lsi_server_send_file(lsi_server* server, lsi_client* client, int file_fd, uint64_t offset, size_t length, int owns_fd);
+// writes as much queued data, including stream frames, as possible
+int lsi_server_flush(lsi_server* server, lsi_client* client);
+// holds writes to the client until uncorked
+void lsi_server_cork(lsi_server* server, lsi_client* client, int corked);
+// changes client timeouts, negative values are left unchanged
+void lsi_server_set_timeouts(lsi_server* server, lsi_client* client, lua_Integer idle_ms, lua_Integer read_ms, lua_Integer write_ms);
+// changes client rate limit in bytes per second, 0 disables it
+void lsi_server_set_rate_limit(lsi_server* server, lsi_client* client, uint32_t rate, uint32_t burst);
+// returns inbox reference for posting from other threads, release with
+// lsi_inbox_release, NULL on failure
+lsi_inbox* lsi_server_get_inbox(lsi_server* server);
+int lsi_server_subscribe(lsi_server* server, lsi_client* client, const char* topic, size_t topic_len);
+int lsi_server_unsubscribe(lsi_server* server, lsi_client* client, const char* topic, size_t topic_len);
+#endif
 
 #endif /* LSI_CORE_SERVER_H__ */
\ No newline at end of file
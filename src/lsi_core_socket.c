@@ -6,8 +6,11 @@
 #include <string.h>
 #include "lauxlib.h"
 #include "lsi_common.h"
+#include "lsi_core_buffer.h"
 #include "lsi_core_socket.h"
+#include "lsi_core_stream.h"
 #include "lsi_errors.h"
+#include "lsi_value.h"
 #include "lua.h"
 #include "lerror.h"
 
@@ -18,11 +21,47 @@
 #include <netinet/in.h>
 #include <poll.h>
 #include <sys/socket.h>
+#include <sys/stat.h>
 #include <sys/types.h>
 #include <sys/un.h>
 #include <unistd.h>
 #endif
 
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+#ifndef _WIN32
+static int send_grant(lsi_socket *sock);
+static int is_nonblocking(lsi_socket *sock);
+static int flush_queue(lsi_socket *sock, int nonblocking);
+static int wait_ready_blocking(int fd, short events);
+#endif
+
+void lsi_socket_read_tcp_options(lua_State *L, int idx,
+				 lsi_tcp_options *options)
+{
+	if (!lua_istable(L, idx)) {
+		return;
+	}
+	if (lua_getfield(L, idx, "nodelay") != LUA_TNIL) {
+		options->nodelay = lua_toboolean(L, -1);
+	}
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "reuse_port");
+	options->reuse_port = lua_toboolean(L, -1);
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "send_buffer");
+	options->send_buffer = luaL_optinteger(L, -1, 0);
+	lua_pop(L, 1);
+
+	lua_getfield(L, idx, "recv_buffer");
+	options->recv_buffer = luaL_optinteger(L, -1, 0);
+	lua_pop(L, 1);
+}
+
 int lsi_socket_connect(lua_State *L)
 {
 	size_t endpoint_len;
@@ -33,7 +72,7 @@ int lsi_socket_connect(lua_State *L)
 	}
 
 	lsi_socket *sock =
-		(lsi_socket *)lua_newuserdatauv(L, sizeof(lsi_socket), 0);
+		(lsi_socket *)lua_newuserdatauv(L, sizeof(lsi_socket), 1);
 	if (sock == NULL) {
 		return push_error(L, ERROR_FAILED_TO_CREATE_SOCKET_INSTANCE);
 	}
@@ -42,6 +81,12 @@ int lsi_socket_connect(lua_State *L)
 	lua_setmetatable(L, -2);
 
 #ifdef _WIN32
+	if (lsi_is_tcp_endpoint(endpoint)) {
+		free(endpoint);
+		sock->hPipe = INVALID_HANDLE_VALUE;
+		sock->closed = 1;
+		return push_error(L, ERROR_NOT_SUPPORTED);
+	}
 	sock->hPipe = CreateFile(endpoint, GENERIC_READ | GENERIC_WRITE, 0,
 				 NULL, OPEN_EXISTING, FILE_FLAG_OVERLAPPED,
 				 NULL);
@@ -50,72 +95,1065 @@ int lsi_socket_connect(lua_State *L)
 		return push_error(L, ERROR_FAILED_TO_CONNECT);
 	}
 #else
-	sock->fd = socket(AF_UNIX, SOCK_STREAM, 0);
-	if (sock->fd == -1) {
-		sock->closed = 1;
-		return push_error(L, ERROR_FAILED_TO_CREATE_SOCKET_INSTANCE);
-	}
-
-	struct sockaddr_un server_addr;
-	memset(&server_addr, 0, sizeof(struct sockaddr_un));
-	server_addr.sun_family = AF_UNIX;
-	if (memcpy((void *)server_addr.sun_path, endpoint, endpoint_len + 1) ==
-	    NULL) {
-		return push_error(L, ERROR_FAILED_TO_CONNECT);
-	}
-
-	if (connect(sock->fd, (struct sockaddr *)&server_addr,
-		    sizeof(server_addr)) == -1) {
-		return push_error(L, ERROR_FAILED_TO_CONNECT);
+	if (lsi_is_tcp_endpoint(endpoint)) {
+		lsi_tcp_options tcp_options;
+		lsi_tcp_options_init(&tcp_options);
+		lsi_socket_read_tcp_options(L, 2, &tcp_options);
+		sock->fd = lsi_tcp_connect(endpoint, &tcp_options);
+		if (sock->fd == -1) {
+			sock->closed = 1;
+			return push_error(L, ERROR_FAILED_TO_CONNECT);
+		}
+	} else {
+		sock->fd = socket(AF_UNIX, SOCK_STREAM, 0);
+		if (sock->fd == -1) {
+			sock->closed = 1;
+			return push_error(
+				L, ERROR_FAILED_TO_CREATE_SOCKET_INSTANCE);
+		}
+
+		struct sockaddr_un server_addr;
+		memset(&server_addr, 0, sizeof(struct sockaddr_un));
+		server_addr.sun_family = AF_UNIX;
+		if (memcpy((void *)server_addr.sun_path, endpoint,
+			   endpoint_len + 1) == NULL) {
+			return push_error(L, ERROR_FAILED_TO_CONNECT);
+		}
+
+		if (connect(sock->fd, (struct sockaddr *)&server_addr,
+			    sizeof(server_addr)) == -1) {
+			return push_error(L, ERROR_FAILED_TO_CONNECT);
+		}
+	}
+
+	if (lua_istable(L, 2)) {
+		// busy-poll window in microseconds
+		lua_getfield(L, 2, "spin_us");
+		lsi_spin_init(&sock->spin, luaL_optinteger(L, -1, 0));
+		lua_pop(L, 1);
+	}
+
+	// flow control of messages sent to this socket on multiplexed streams
+	uint32_t credit_messages, credit_bytes;
+	if (lsi_stream_read_credits(L, 2, &credit_messages, &credit_bytes)) {
+		sock->mux = lsi_mux_new(0);
+		if (sock->mux == NULL) {
+			return push_error(L, ERROR_OUT_OF_MEMORY);
+		}
+		lsi_mux_set_window(sock->mux, credit_messages, credit_bytes);
+		if (send_grant(sock) == -1) {
+			return push_error(L, ERROR_FAILED_TO_CONNECT);
+		}
+	}
+#endif
+	return 1;
+}
+
+int lsi_socket_close(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return 0;
+	}
+	if (sock->closed) {
+		return 0;
+	}
+#ifdef _WIN32
+	if (sock->hPipe != INVALID_HANDLE_VALUE) {
+		CloseHandle(sock->hPipe);
+		sock->hPipe = INVALID_HANDLE_VALUE;
+	}
+#else
+	if (sock->fd != -1) {
+		if (sock->corked && sock->client == NULL) {
+			// corked data is not dropped, best effort
+			flush_queue(sock, is_nonblocking(sock));
+		}
+		close(sock->fd);
+		sock->fd = -1;
+	}
+#endif
+	lsi_buffer_free(&sock->rbuf);
+	lsi_wqueue_clear(&sock->wq);
+	if (sock->mux != NULL) {
+		lsi_mux_free(sock->mux);
+		sock->mux = NULL;
+	}
+	sock->closed = 1;
+	return 0;
+}
+
+// writes whole data, retrying on partial writes
+static int write_fully(lsi_socket *sock, const char *data, size_t size)
+{
+#ifdef _WIN32
+	while (size > 0) {
+		DWORD bytes_written;
+		if (WriteFile(sock->hPipe, data, size, &bytes_written, NULL) ==
+		    0) {
+			return -1;
+		}
+		data += bytes_written;
+		size -= bytes_written;
+	}
+#else
+	while (size > 0) {
+		ssize_t res = write(sock->fd, data, size);
+		if (res == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    wait_ready_blocking(sock->fd, POLLOUT) == 0) {
+				continue;
+			}
+			return -1;
+		}
+		data += res;
+		size -= res;
+	}
+#endif
+	return 0;
+}
+
+// reads up to size bytes into the socket buffer
+// returns number of bytes read, 0 on timeout or -1 on failure
+// (closed connection is reported as failure with errno set to ECONNRESET)
+static int fill_buffer(lsi_socket *sock, size_t size, int timeout)
+{
+	if (lsi_buffer_reserve(&sock->rbuf, size) == -1) {
+		return -1;
+	}
+#ifdef _WIN32
+	// named pipes are read in blocking mode, timeout is not applied
+	DWORD bytes_read;
+	if (ReadFile(sock->hPipe, lsi_buffer_end(&sock->rbuf), size,
+		     &bytes_read, NULL) == 0) {
+		return -1;
+	}
+	int read_size = (int)bytes_read;
+#else
+	if (timeout >= 0 || sock->spin.max_us > 0) {
+		struct pollfd fds[1];
+		fds[0].fd = sock->fd;
+		fds[0].events = POLLIN;
+		int poll_res = lsi_spin_poll(&sock->spin, fds, 1, timeout);
+		if (poll_res == -1) {
+			return -1;
+		}
+		if (poll_res == 0) {
+			return 0;
+		}
+	}
+	int read_size = read(sock->fd, lsi_buffer_end(&sock->rbuf), size);
+	if (read_size == -1) {
+		return -1;
+	}
+#endif
+	if (read_size == 0) {
+		errno = ECONNRESET;
+		return -1;
+	}
+	sock->rbuf.len += read_size;
+	return read_size;
+}
+
+// reads buffer_size, timeout and max_size from options table at idx
+static void read_frame_options(lua_State *L, int idx, int *buffer_size,
+			       int *timeout, size_t *max_size)
+{
+	*buffer_size = DEFAULT_BUFFER_SIZE;
+	*timeout = -1;
+	*max_size = 0;
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "buffer_size");
+		*buffer_size = luaL_optinteger(L, -1, DEFAULT_BUFFER_SIZE);
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "timeout");
+		*timeout = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 1);
+
+		lua_getfield(L, idx, "max_size");
+		*max_size = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+	}
+}
+
+// fills the read-ahead buffer until it holds a complete frame, frame ends
+// with delim if set or is count bytes long otherwise
+// returns frame length including delimiter, 0 on timeout or -1 on failure
+// (frame over max_size is reported with errno set to EMSGSIZE)
+static long buffer_frame(lsi_socket *sock, const char *delim, size_t delim_len,
+			 size_t count, size_t max_size, int buffer_size,
+			 int timeout)
+{
+	uint64_t deadline = timeout >= 0 ? lsi_now_ms() + timeout : 0;
+	size_t scanned = 0;
+	for (;;) {
+		size_t size = lsi_buffer_size(&sock->rbuf);
+		if (delim != NULL) {
+			// skip bytes searched in previous rounds
+			size_t from = scanned + 1 >= delim_len ?
+					      scanned + 1 - delim_len :
+					      0;
+			const char *begin = lsi_buffer_begin(&sock->rbuf);
+			const char *found = lsi_memmem(begin + from,
+						       size - from, delim,
+						       delim_len);
+			if (found != NULL) {
+				return (long)(found - begin + delim_len);
+			}
+			scanned = size;
+			if (max_size > 0 && size > max_size) {
+				errno = EMSGSIZE;
+				return -1;
+			}
+		} else if (size >= count) {
+			return (long)count;
+		}
+		int remaining = -1;
+		if (timeout >= 0) {
+			uint64_t now = lsi_now_ms();
+			remaining = now >= deadline ? 0 : (int)(deadline - now);
+		}
+		size_t want = buffer_size;
+		if (delim == NULL && count - size > want) {
+			want = count - size; // read rest of the frame at once
+		}
+		int read_size = fill_buffer(sock, want, remaining);
+		if (read_size <= 0) {
+			return read_size;
+		}
+	}
+}
+
+// pushes the result of failed or timed out buffer_frame
+static int push_frame_error(lua_State *L, long res)
+{
+	if (res == 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, ERROR_TIMEOUT);
+		return 2;
+	}
+	if (errno == EMSGSIZE) {
+		return push_error(L, ERROR_FRAME_TOO_LARGE);
+	}
+	return push_error(L, errno == ECONNRESET ? ERROR_CONNECTION_CLOSED :
+						   ERROR_READ_FAILED);
+}
+
+// returns NULL when the socket is closed
+static lsi_socket *check_open_socket(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	return sock->closed ? NULL : sock;
+}
+
+// socket:read_until(delimiter, [options]) - returns data before delimiter
+int lsi_socket_read_until(lua_State *L)
+{
+	lsi_socket *sock = check_open_socket(L);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	size_t delim_len;
+	const char *delim = luaL_checklstring(L, 2, &delim_len);
+	luaL_argcheck(L, delim_len > 0, 2, "delimiter must not be empty");
+	int buffer_size, timeout;
+	size_t max_size;
+	read_frame_options(L, 3, &buffer_size, &timeout, &max_size);
+	long res = buffer_frame(sock, delim, delim_len, 0, max_size,
+				buffer_size, timeout);
+	if (res <= 0) {
+		return push_frame_error(L, res);
+	}
+	lua_pushlstring(L, lsi_buffer_begin(&sock->rbuf), res - delim_len);
+	lsi_buffer_consume(&sock->rbuf, res);
+	return 1;
+}
+
+// socket:read_line([options]) - returns line without "\n" or "\r\n"
+int lsi_socket_read_line(lua_State *L)
+{
+	lsi_socket *sock = check_open_socket(L);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	int buffer_size, timeout;
+	size_t max_size;
+	read_frame_options(L, 2, &buffer_size, &timeout, &max_size);
+	long res = buffer_frame(sock, "\n", 1, 0, max_size, buffer_size,
+				timeout);
+	if (res <= 0) {
+		return push_frame_error(L, res);
+	}
+	const char *line = lsi_buffer_begin(&sock->rbuf);
+	size_t line_len = res - 1;
+	if (line_len > 0 && line[line_len - 1] == '\r') {
+		line_len--;
+	}
+	lua_pushlstring(L, line, line_len);
+	lsi_buffer_consume(&sock->rbuf, res);
+	return 1;
+}
+
+// socket:read_exact(count, [options]) - returns exactly count bytes
+int lsi_socket_read_exact(lua_State *L)
+{
+	lsi_socket *sock = check_open_socket(L);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	lua_Integer count = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, count >= 0, 2, "count must be non-negative");
+	int buffer_size, timeout;
+	size_t max_size;
+	read_frame_options(L, 3, &buffer_size, &timeout, &max_size);
+	long res = count == 0 ? 0 :
+				buffer_frame(sock, NULL, 0, count, 0,
+					     buffer_size, timeout);
+	if (count > 0 && res <= 0) {
+		return push_frame_error(L, res);
+	}
+	lua_pushlstring(L, lsi_buffer_begin(&sock->rbuf), count);
+	lsi_buffer_consume(&sock->rbuf, count);
+	return 1;
+}
+
+// socket:peek(count, [options]) - like read_exact but leaves data buffered
+int lsi_socket_peek(lua_State *L)
+{
+	lsi_socket *sock = check_open_socket(L);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	lua_Integer count = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, count >= 0, 2, "count must be non-negative");
+	int buffer_size, timeout;
+	size_t max_size;
+	read_frame_options(L, 3, &buffer_size, &timeout, &max_size);
+	long res = count == 0 ? 0 :
+				buffer_frame(sock, NULL, 0, count, 0,
+					     buffer_size, timeout);
+	if (count > 0 && res <= 0) {
+		return push_frame_error(L, res);
+	}
+	lua_pushlstring(L, lsi_buffer_begin(&sock->rbuf), count);
+	return 1;
+}
+
+// socket:read_into(buffer, [options]) - appends received data to buffer
+// returns number of bytes read
+int lsi_socket_read_into(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	lsi_byte_buffer *buf =
+		(lsi_byte_buffer *)luaL_checkudata(L, 2, LSI_BUFFER_METATABLE);
+	if (buf->parent != NULL) {
+		return push_error(L, ERROR_BUFFER_VIEW_READ_ONLY);
+	}
+	int timeout = -1;
+	int buffer_size = DEFAULT_BUFFER_SIZE;
+	if (lua_istable(L, 3)) {
+		lua_getfield(L, 3, "buffer_size");
+		buffer_size = luaL_optinteger(L, -1, DEFAULT_BUFFER_SIZE);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 3, "timeout");
+		timeout = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 1);
+	}
+	size_t size = lsi_buffer_size(&sock->rbuf);
+	if (size > 0) {
+		if (lsi_buffer_append(&buf->buffer, lsi_buffer_begin(&sock->rbuf),
+				      size) == -1) {
+			return push_error(L, ERROR_OUT_OF_MEMORY);
+		}
+		lsi_buffer_consume(&sock->rbuf, size);
+		lua_pushinteger(L, size);
+		return 1;
+	}
+	// borrow the socket read buffer slot: read directly into buf
+	lsi_buffer rbuf = sock->rbuf;
+	sock->rbuf = buf->buffer;
+	int read_size = fill_buffer(sock, buffer_size, timeout);
+	buf->buffer = sock->rbuf;
+	sock->rbuf = rbuf;
+	if (read_size == -1) {
+		return push_error(L, errno == ECONNRESET ?
+					     ERROR_CONNECTION_CLOSED :
+					     ERROR_READ_FAILED);
+	}
+	if (read_size == 0) {
+		lua_pushnil(L);
+		lua_pushstring(L, ERROR_TIMEOUT);
+		return 2;
+	}
+	lua_pushinteger(L, read_size);
+	return 1;
+}
+
+// writes whole data behind anything written before, server owned sockets
+// queue it in the server so that it never blocks the server loop
+static int send_ordered(lsi_socket *sock, const char *data, size_t size)
+{
+#ifndef _WIN32
+	if (sock->client != NULL) {
+		return lsi_server_send(sock->server, sock->client, data, size);
+	}
+	if (sock->corked || sock->wq.head != NULL) {
+		// coalesced like socket:write() while corked
+		if (lsi_wqueue_push_copy(&sock->wq, data, size) == -1) {
+			return -1;
+		}
+		if ((!sock->corked || sock->wq.size >= DEFAULT_COALESCE_SIZE) &&
+		    flush_queue(sock, is_nonblocking(sock)) == -1) {
+			return -1;
+		}
+		return 0;
+	}
+#endif
+	return write_fully(sock, data, size);
+}
+
+// socket:send_value(value) - sends value encoded by lsi_value_encode
+int lsi_socket_send_value(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	luaL_checkany(L, 2);
+	lsi_buffer buffer = { 0 };
+	const char *err = lsi_value_encode(L, 2, &buffer);
+	if (err != NULL) {
+		lsi_buffer_free(&buffer);
+		return push_error(L, err);
+	}
+	int res = send_ordered(sock, lsi_buffer_begin(&buffer),
+			       lsi_buffer_size(&buffer));
+	lsi_buffer_free(&buffer);
+	if (res == -1) {
+		return push_error(L, ERROR_WRITE_FAILED);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// socket:read_value([options]) - reads one value sent by send_value, the
+// socket is closed when the value exceeds options.max_size
+int lsi_socket_read_value(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	int timeout = -1;
+	int buffer_size = DEFAULT_BUFFER_SIZE;
+	size_t max_size = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "buffer_size");
+		buffer_size = luaL_optinteger(L, -1, DEFAULT_BUFFER_SIZE);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "max_size");
+		max_size = luaL_optinteger(L, -1, 0);
+		lua_pop(L, 1);
+
+		lua_getfield(L, 2, "timeout");
+		timeout = luaL_optinteger(L, -1, -1);
+		lua_pop(L, 1);
+	}
+	uint64_t deadline = timeout >= 0 ? lsi_now_ms() + timeout : 0;
+
+	for (;;) {
+		size_t size;
+		int res = lsi_value_scan_next(&sock->scanner,
+					      lsi_buffer_begin(&sock->rbuf),
+					      lsi_buffer_size(&sock->rbuf),
+					      max_size, &size);
+		if (res == 1) {
+			lsi_value_decode(L, lsi_buffer_begin(&sock->rbuf),
+					 size);
+			lsi_buffer_consume(&sock->rbuf, size);
+			return 1;
+		}
+		if (res == VALUE_TOO_LARGE) {
+			// the rest of the value can not be told apart from
+			// the following ones
+			lua_settop(L, 1);
+			lsi_socket_close(L);
+			return push_error(L, ERROR_VALUE_TOO_LARGE);
+		}
+		if (res == -1) {
+			memset(&sock->scanner, 0, sizeof(lsi_value_scanner));
+			lsi_buffer_consume(&sock->rbuf,
+					   lsi_buffer_size(&sock->rbuf));
+			return push_error(L, ERROR_INVALID_VALUE);
+		}
+		int remaining = -1;
+		if (timeout >= 0) {
+			uint64_t now = lsi_now_ms();
+			remaining = now >= deadline ? 0 : (int)(deadline - now);
+		}
+		int read_size = fill_buffer(sock, buffer_size, remaining);
+		if (read_size == -1) {
+			return push_error(L, errno == ECONNRESET ?
+						     ERROR_CONNECTION_CLOSED :
+						     ERROR_READ_FAILED);
+		}
+		if (read_size == 0) {
+			lua_pushnil(L);
+			lua_pushstring(L, ERROR_TIMEOUT);
+			return 2;
+		}
+	}
+}
+
+int lsi_socket_write(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	size_t datasize;
+	const char *data = luaL_checklstring(L, 2, &datasize);
+#ifndef _WIN32
+	if (sock->client != NULL) {
+		// server owned, never block the server loop
+		if (lsi_server_send(sock->server, sock->client, data,
+				    datasize) == -1) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+#endif
+#ifdef _WIN32
+	DWORD bytes_written;
+	if (WriteFile(sock->hPipe, data, datasize, &bytes_written, NULL) == 0) {
+		return push_error(L, ERROR_WRITE_FAILED);
+	}
+#else
+	if (sock->corked || sock->wq.head != NULL) {
+		// stays behind data already queued
+		if (lsi_wqueue_push_copy(&sock->wq, data, datasize) == -1) {
+			return push_error(L, ERROR_OUT_OF_MEMORY);
+		}
+		if ((!sock->corked || sock->wq.size >= DEFAULT_COALESCE_SIZE) &&
+		    flush_queue(sock, is_nonblocking(sock)) == -1) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+	} else if (write(sock->fd, data, datasize) == -1) {
+		return push_error(L, ERROR_WRITE_FAILED);
+	}
+#endif
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// writes part of a length prefixed message, server owned sockets queue it
+static int write_piece(lsi_socket *sock, const char *data, size_t size)
+{
+#ifndef _WIN32
+	if (sock->client != NULL) {
+		return lsi_server_send(sock->server, sock->client, data, size);
+	}
+	// behind data already queued
+	if (sock->wq.head != NULL && flush_queue(sock, 0) == -1) {
+		return -1;
+	}
+#endif
+	return write_fully(sock, data, size);
+}
+
+// a message cut short leaves the peer waiting for the rest, whatever is
+// written afterwards would be misread, so the connection is given up
+static void fail_stream(lua_State *L, lsi_socket *sock)
+{
+#ifndef _WIN32
+	if (sock->client != NULL) {
+		// the server sees the disconnect and releases the client
+		shutdown(sock->fd, SHUT_RDWR);
+		return;
+	}
+#endif
+	lsi_socket_close(L);
+}
+
+// ctx holds the bytes still expected from the source function at index 2
+static int write_stream_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, 3);
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	// chunks are written as they are produced, the message is never
+	// held as a whole
+	uint64_t remaining = (uint64_t)ctx;
+	for (;;) {
+#ifndef _WIN32
+		if (sock->client != NULL && sock->wq.size >= STREAM_QUEUE_LIMIT) {
+			// server owned, wait for the client to drain the queue
+			lsi_server_flush(sock->server, sock->client);
+			if (sock->wq.size >= STREAM_QUEUE_LIMIT) {
+				if (lua_isyieldable(L)) {
+					lua_pushinteger(L, sock->fd);
+					lua_pushstring(L, "write");
+					return lua_yieldk(L, 2,
+							  (lua_KContext)remaining,
+							  write_stream_k);
+				}
+				if (wait_ready_blocking(sock->fd, POLLOUT) == -1) {
+					fail_stream(L, sock);
+					return push_error(L, ERROR_POLL_FAILED);
+				}
+				continue;
+			}
+		}
+#endif
+		lua_pushvalue(L, 2);
+		if (lua_pcall(L, 0, 1, 0) != LUA_OK) {
+			fail_stream(L, sock);
+			return lua_error(L);
+		}
+		if (lua_isnil(L, -1)) {
+			lua_pop(L, 1);
+			break;
+		}
+		size_t size;
+		const char *data = luaL_checklstring(L, -1, &size);
+		if (size > remaining) {
+			// the peer would read the excess as next header
+			fail_stream(L, sock);
+			return push_error(L, ERROR_STREAM_LENGTH_MISMATCH);
+		}
+		if (write_piece(sock, data, size) == -1) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+		remaining -= size;
+		lua_pop(L, 1);
+	}
+	if (remaining > 0) {
+		fail_stream(L, sock);
+		return push_error(L, ERROR_STREAM_LENGTH_MISMATCH);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// socket:write_stream(source, [length]) - writes one length prefixed message
+// for servers in decode = "stream" mode, source is a string or a function
+// returning the next chunk and nil at the end, length is required then
+// a source not matching length closes the socket, on server owned sockets
+// more than STREAM_QUEUE_LIMIT queued bytes yield (fd, "write") to the
+// coroutine scheduler or, outside a coroutine, wait for the client
+int lsi_socket_write_stream(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	int is_function = lua_type(L, 2) == LUA_TFUNCTION;
+	size_t size = 0;
+	const char *data = NULL;
+	uint64_t length;
+	if (is_function) {
+		lua_Integer total = luaL_checkinteger(L, 3);
+		luaL_argcheck(L, total >= 0, 3, "length must be non-negative");
+		length = (uint64_t)total;
+	} else {
+		data = luaL_checklstring(L, 2, &size);
+		length = size;
+	}
+	char header[STREAM_HEADER_SIZE];
+	lsi_put_u64(header, length);
+	if (write_piece(sock, header, STREAM_HEADER_SIZE) == -1) {
+		return push_error(L, ERROR_WRITE_FAILED);
+	}
+	if (!is_function) {
+		if (write_piece(sock, data, size) == -1) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	return write_stream_k(L, LUA_OK, (lua_KContext)length);
+}
+
+// socket:send_file(path_or_fd [, offset [, length]])
+// streams file without copying it through lua, length defaults to rest of file
+int lsi_socket_send_file(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lua_Integer offset = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, offset >= 0, 3, "offset must be non-negative");
+	int file_fd;
+	int owns_fd = 0;
+	if (lua_type(L, 2) == LUA_TNUMBER) {
+		file_fd = (int)luaL_checkinteger(L, 2);
+	} else {
+		file_fd = open(luaL_checkstring(L, 2), O_RDONLY | O_CLOEXEC);
+		if (file_fd == -1) {
+			return push_error(L, ERROR_FILE_OPEN_FAILED);
+		}
+		owns_fd = 1;
+	}
+	size_t length;
+	if (lua_isnoneornil(L, 4)) {
+		struct stat st;
+		if (fstat(file_fd, &st) == -1) {
+			if (owns_fd) {
+				close(file_fd);
+			}
+			return push_error(L, ERROR_READ_FAILED);
+		}
+		length = st.st_size > offset ? (size_t)(st.st_size - offset) :
+					       0;
+	} else {
+		lua_Integer len = luaL_checkinteger(L, 4);
+		if (len < 0) {
+			if (owns_fd) {
+				close(file_fd);
+			}
+			return luaL_argerror(L, 4,
+					     "length must be non-negative");
+		}
+		length = (size_t)len;
+	}
+	if (sock->client != NULL) {
+		// server owned, rest of the file is sent as the socket drains,
+		// a caller fd may be closed meanwhile so the queue owns a copy
+		if (!owns_fd) {
+			file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+			if (file_fd == -1) {
+				return push_error(L, ERROR_FILE_OPEN_FAILED);
+			}
+			owns_fd = 1;
+		}
+		if (lsi_server_send_file(sock->server, sock->client, file_fd,
+					 (uint64_t)offset, length,
+					 owns_fd) == -1) {
+			if (owns_fd) {
+				close(file_fd);
+			}
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+		lua_pushinteger(L, (lua_Integer)length);
+		return 1;
+	}
+	if (sock->corked || sock->wq.head != NULL) {
+		// stays behind data already queued, sent as the queue is flushed
+		if (!owns_fd) {
+			file_fd = fcntl(file_fd, F_DUPFD_CLOEXEC, 0);
+			if (file_fd == -1) {
+				return push_error(L, ERROR_FILE_OPEN_FAILED);
+			}
+			owns_fd = 1;
+		}
+		if (lsi_wqueue_push_file(&sock->wq, file_fd, (uint64_t)offset,
+					 length, owns_fd) == -1) {
+			close(file_fd);
+			return push_error(L, ERROR_OUT_OF_MEMORY);
+		}
+		if ((!sock->corked || sock->wq.size >= DEFAULT_COALESCE_SIZE) &&
+		    flush_queue(sock, is_nonblocking(sock)) == -1) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+		lua_pushinteger(L, (lua_Integer)length);
+		return 1;
+	}
+	uint64_t position = (uint64_t)offset;
+	size_t remaining = length;
+	int failed = 0;
+	while (remaining > 0) {
+		long sent = lsi_send_file(sock->fd, file_fd, &position,
+					  remaining);
+		if (sent == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if ((errno == EAGAIN || errno == EWOULDBLOCK) &&
+			    wait_ready_blocking(sock->fd, POLLOUT) == 0) {
+				continue;
+			}
+			failed = 1;
+			break;
+		}
+		if (sent == 0) {
+			break; // end of file
+		}
+		remaining -= sent;
+	}
+	if (owns_fd) {
+		close(file_fd);
+	}
+	if (failed) {
+		return push_error(L, ERROR_WRITE_FAILED);
+	}
+	lua_pushinteger(L, (lua_Integer)(length - remaining));
+	return 1;
+#endif
+}
+
+#ifndef _WIN32
+static int is_nonblocking(lsi_socket *sock)
+{
+	int flags = fcntl(sock->fd, F_GETFL, 0);
+	return flags != -1 && (flags & O_NONBLOCK);
+}
+
+// writes the write queue, blocking sockets wait until it is empty
+static int flush_queue(lsi_socket *sock, int nonblocking)
+{
+	for (;;) {
+		int res = lsi_wqueue_flush(&sock->wq, sock->fd);
+		if (res == -1) {
+			return -1;
+		}
+		if (res == 0 || nonblocking) {
+			return 0;
+		}
+		if (wait_ready_blocking(sock->fd, POLLOUT) == -1) {
+			return -1;
+		}
+	}
+}
+
+// after a framing error or a peer over the reassembly limits nothing more
+// can be read, the connection is shut down and fails from now on
+static void fail_streams(lsi_socket *sock)
+{
+	lsi_buffer_consume(&sock->rbuf, lsi_buffer_size(&sock->rbuf));
+	shutdown(sock->fd, SHUT_RDWR);
+}
+
+// reads available data to apply credit grants of the peer, messages are
+// kept for read_message
+static int receive_grants(lsi_socket *sock, int timeout)
+{
+	if (fill_buffer(sock, DEFAULT_BUFFER_SIZE, timeout) == -1) {
+		return -1;
+	}
+	if (lsi_mux_process(sock->mux, &sock->rbuf) < 0) {
+		fail_streams(sock);
+		return -1;
+	}
+	return 0;
+}
+
+// queues credit grant for the peer and writes it
+static int send_grant(lsi_socket *sock)
+{
+	char frame[MUX_GRANT_SIZE];
+	lsi_mux_grant(sock->mux, frame);
+	if (lsi_wqueue_push_copy(&sock->wq, frame, MUX_GRANT_SIZE) == -1) {
+		return -1;
+	}
+	if (sock->client != NULL) {
+		return lsi_server_flush(sock->server, sock->client);
+	}
+	return flush_queue(sock, is_nonblocking(sock));
+}
+
+// writes queued stream frames, blocking sockets write everything, waiting
+// for credits if needed, while non-blocking ones stop once the socket is
+// full or credits are used up, see socket:flush()
+static int pump_streams(lsi_socket *sock)
+{
+	int nonblocking = is_nonblocking(sock);
+	for (;;) {
+		if (sock->mux != NULL &&
+		    lsi_mux_fill(sock->mux, &sock->wq, MUX_WINDOW) == -1) {
+			return -1;
+		}
+		if (flush_queue(sock, nonblocking) == -1) {
+			return -1;
+		}
+		if (sock->wq.head != NULL || sock->mux == NULL ||
+		    sock->mux->queued == 0) {
+			return 0;
+		}
+		if (sock->mux->blocked) {
+			if (nonblocking) {
+				return 0;
+			}
+			if (receive_grants(sock, -1) == -1) {
+				return -1;
+			}
+		}
+	}
+}
+#endif
+
+int lsi_socket_send_stream(lsi_socket *sock, uint32_t stream, int priority,
+			   const char *data, size_t size)
+{
+#ifdef _WIN32
+	return -1;
+#else
+	if (sock->mux == NULL) {
+		sock->mux = lsi_mux_new(sock->client != NULL);
+		if (sock->mux == NULL) {
+			return -1;
+		}
+	}
+	// blocking sockets wait for grants in pump_streams, the others would
+	// only grow the queue
+	int nonblocking = sock->client != NULL || is_nonblocking(sock);
+	if (nonblocking && !lsi_mux_can_push(sock->mux) &&
+	    (sock->client != NULL || receive_grants(sock, 0) == -1 ||
+	     !lsi_mux_can_push(sock->mux))) {
+		return MUX_NO_CREDIT;
+	}
+	if (lsi_mux_push(sock->mux, stream, priority, data, size) == -1) {
+		return -1;
+	}
+	if (sock->client != NULL) {
+		return lsi_server_flush(sock->server, sock->client);
+	}
+	return pump_streams(sock);
+#endif
+}
+
+// socket:open_stream([priority]) - opens new multiplexed stream, priority 0
+// is the most urgent, messages of more urgent streams overtake the others
+int lsi_socket_open_stream(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	lua_Integer priority = luaL_optinteger(L, 2, MUX_DEFAULT_PRIORITY);
+	luaL_argcheck(L, priority >= 0 && priority < MUX_PRIORITIES, 2,
+		      "priority out of range");
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	if (sock->mux == NULL) {
+		sock->mux = lsi_mux_new(sock->client != NULL);
+		if (sock->mux == NULL) {
+			return push_error(L, ERROR_OUT_OF_MEMORY);
+		}
 	}
+	lsi_stream_push(L, 1, lsi_mux_open(sock->mux), (int)priority);
+	return 1;
 #endif
+}
+
+// socket:get_stream(id, [priority]) - stream opened by the peer, e.g. to reply
+int lsi_socket_get_stream(lua_State *L)
+{
+	luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	lua_Integer id = luaL_checkinteger(L, 2);
+	lua_Integer priority = luaL_optinteger(L, 3, MUX_DEFAULT_PRIORITY);
+	luaL_argcheck(L, id > 0 && id <= UINT32_MAX, 2, "invalid stream id");
+	luaL_argcheck(L, priority >= 0 && priority < MUX_PRIORITIES, 3,
+		      "priority out of range");
+	lsi_stream_push(L, 1, (uint32_t)id, (int)priority);
 	return 1;
 }
 
-int lsi_socket_close(lua_State *L)
+// socket:flush() - continues writing queued data of a non-blocking socket
+// returns true once everything is written
+int lsi_socket_flush(lua_State *L)
 {
 	lsi_socket *sock =
 		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
-	if (sock == NULL) {
-		return 0;
-	}
 	if (sock->closed) {
-		return 0;
+		return push_error(L, ERROR_SOCKET_CLOSED);
 	}
 #ifdef _WIN32
-	if (sock->hPipe != INVALID_HANDLE_VALUE) {
-		CloseHandle(sock->hPipe);
-		sock->hPipe = INVALID_HANDLE_VALUE;
-	}
+	lua_pushboolean(L, 1);
+	return 1;
 #else
-	if (sock->fd != -1) {
-		close(sock->fd);
-		sock->fd = -1;
+	if (sock->client != NULL) {
+		lsi_server_flush(sock->server, sock->client);
+	} else {
+		if (sock->mux != NULL && sock->mux->blocked &&
+		    receive_grants(sock, 0) == -1) {
+			return push_error(L, ERROR_READ_FAILED);
+		}
+		if (pump_streams(sock) == -1) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
 	}
+	lua_pushboolean(L, sock->wq.head == NULL &&
+				   (sock->mux == NULL || sock->mux->queued == 0));
+	return 1;
 #endif
-	sock->closed = 1;
-	return 0;
 }
 
-int lsi_socket_write(lua_State *L)
+// socket:cork() - queues following writes, they are written together by
+// socket:uncork() or once DEFAULT_COALESCE_SIZE bytes are queued
+int lsi_socket_cork(lua_State *L)
 {
 	lsi_socket *sock =
 		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
-	if (sock == NULL) {
-		return push_error(L, ERROR_SOCKET_IS_NIL);
-	}
 	if (sock->closed) {
 		return push_error(L, ERROR_SOCKET_CLOSED);
 	}
-	size_t datasize;
-	const char *data = luaL_checklstring(L, 2, &datasize);
-#ifdef _WIN32
-	DWORD bytes_written;
-	if (WriteFile(sock->hPipe, data, datasize, &bytes_written, NULL) == 0) {
-		return push_error(L, ERROR_WRITE_FAILED);
+#ifndef _WIN32
+	if (sock->client != NULL) {
+		lsi_server_cork(sock->server, sock->client, 1);
 	}
-#else
-	if (write(sock->fd, data, datasize) == -1) {
+	sock->corked = 1;
+#endif
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+// socket:uncork() - writes queued data with as few syscalls as possible,
+// non-blocking sockets continue with socket:flush()
+int lsi_socket_uncork(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+#ifndef _WIN32
+	sock->corked = 0;
+	if (sock->client != NULL) {
+		lsi_server_cork(sock->server, sock->client, 0);
+	} else if (flush_queue(sock, is_nonblocking(sock)) == -1) {
 		return push_error(L, ERROR_WRITE_FAILED);
 	}
 #endif
@@ -123,6 +1161,87 @@ int lsi_socket_write(lua_State *L)
 	return 1;
 }
 
+// socket:credits() - returns message and byte credits granted by the peer,
+// nil while the peer does not use flow control
+int lsi_socket_credits(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+#ifndef _WIN32
+	// server owned sockets receive grants in the server loop
+	if (sock->mux != NULL && sock->client == NULL &&
+	    receive_grants(sock, 0) == -1) {
+		return push_error(L, ERROR_READ_FAILED);
+	}
+#endif
+	if (sock->mux == NULL || !sock->mux->limited) {
+		lua_pushnil(L);
+		return 1;
+	}
+	lua_pushinteger(L, sock->mux->credit_messages);
+	lua_pushinteger(L, sock->mux->credit_bytes);
+	return 2;
+}
+
+// socket:read_message([options]) - reads next complete message of any
+// multiplexed stream, returns message and stream id, options.max_size caps
+// messages (16MiB by default) and a peer going over it fails the connection
+int lsi_socket_read_message(lua_State *L)
+{
+	lsi_socket *sock = check_open_socket(L);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	int buffer_size, timeout;
+	size_t max_size;
+	read_frame_options(L, 2, &buffer_size, &timeout, &max_size);
+	if (sock->mux == NULL) {
+		sock->mux = lsi_mux_new(sock->client != NULL);
+		if (sock->mux == NULL) {
+			return push_error(L, ERROR_OUT_OF_MEMORY);
+		}
+	}
+	lsi_mux_set_max_message(sock->mux, max_size);
+	uint64_t deadline = timeout >= 0 ? lsi_now_ms() + timeout : 0;
+	for (;;) {
+		uint32_t stream;
+		lsi_buffer *message;
+		int res = lsi_mux_receive(sock->mux, &sock->rbuf, &stream,
+					  &message);
+		if (res == 1) {
+			lua_pushlstring(L, lsi_buffer_begin(message),
+					lsi_buffer_size(message));
+			lua_pushinteger(L, stream);
+#ifndef _WIN32
+			if (lsi_mux_consumed(sock->mux,
+					     lsi_buffer_size(message)) &&
+			    send_grant(sock) == -1) {
+				return push_error(L, ERROR_WRITE_FAILED);
+			}
+#endif
+			return 2;
+		}
+		if (res < 0) {
+#ifndef _WIN32
+			fail_streams(sock);
+#endif
+			return push_error(L, lsi_mux_error(res));
+		}
+		int remaining = -1;
+		if (timeout >= 0) {
+			uint64_t now = lsi_now_ms();
+			remaining = now >= deadline ? 0 : (int)(deadline - now);
+		}
+		int read_size = fill_buffer(sock, buffer_size, remaining);
+		if (read_size <= 0) {
+			return push_frame_error(L, read_size);
+		}
+	}
+}
+
 int lsi_socket_read(lua_State *L)
 {
 	lsi_socket *sock =
@@ -145,6 +1264,16 @@ int lsi_socket_read(lua_State *L)
 		timeout = luaL_optinteger(L, -1, -1);
 		lua_pop(L, 1);
 	}
+	// data left over by value/buffered reads is returned first
+	if (lsi_buffer_size(&sock->rbuf) > 0) {
+		size_t size = lsi_buffer_size(&sock->rbuf);
+		if (size > (size_t)buffer_size) {
+			size = buffer_size;
+		}
+		lua_pushlstring(L, lsi_buffer_begin(&sock->rbuf), size);
+		lsi_buffer_consume(&sock->rbuf, size);
+		return 1;
+	}
 
 #ifdef _WIN32
 	DWORD bytes_read;
@@ -195,11 +1324,11 @@ int lsi_socket_read(lua_State *L)
 
 	lua_pushlstring(L, buffer, bytes_read);
 #else
-	if (timeout >= 0) {
+	if (timeout >= 0 || sock->spin.max_us > 0) {
 		struct pollfd fds[1];
 		fds[0].fd = sock->fd;
 		fds[0].events = POLLIN;
-		int poll_res = poll(fds, 1, timeout);
+		int poll_res = lsi_spin_poll(&sock->spin, fds, 1, timeout);
 		if (poll_res == -1) {
 			return push_error(L, ERROR_POLL_FAILED);
 		}
@@ -226,6 +1355,263 @@ int lsi_socket_read(lua_State *L)
 	return 1;
 }
 
+#ifndef _WIN32
+// waits in place when the caller is not running inside a coroutine
+static int wait_ready_blocking(int fd, short events)
+{
+	struct pollfd pfd = { .fd = fd, .events = events };
+	if (poll(&pfd, 1, -1) == -1 && errno != EINTR) {
+		return -1;
+	}
+	return 0;
+}
+#endif
+
+static int read_async_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, 2);
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	int buffer_size = DEFAULT_BUFFER_SIZE;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "buffer_size");
+		buffer_size = luaL_optinteger(L, -1, DEFAULT_BUFFER_SIZE);
+		lua_pop(L, 1);
+	}
+	if (lsi_buffer_size(&sock->rbuf) > 0) {
+		size_t size = lsi_buffer_size(&sock->rbuf);
+		if (size > (size_t)buffer_size) {
+			size = buffer_size;
+		}
+		lua_pushlstring(L, lsi_buffer_begin(&sock->rbuf), size);
+		lsi_buffer_consume(&sock->rbuf, size);
+		return 1;
+	}
+	char *buffer = (char *)malloc(buffer_size);
+	if (buffer == NULL) {
+		return push_error(L, ERROR_READ_FAILED);
+	}
+	for (;;) {
+		ssize_t read_size =
+			recv(sock->fd, buffer, buffer_size, MSG_DONTWAIT);
+		if (read_size >= 0) {
+			lua_pushlstring(L, buffer, read_size);
+			free((void *)buffer);
+			return 1;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			free((void *)buffer);
+			return push_error(L, ERROR_READ_FAILED);
+		}
+		if (lua_isyieldable(L)) {
+			free((void *)buffer);
+			lua_pushinteger(L, sock->fd);
+			lua_pushstring(L, "read");
+			return lua_yieldk(L, 2, ctx, read_async_k);
+		}
+		if (wait_ready_blocking(sock->fd, POLLIN) == -1) {
+			free((void *)buffer);
+			return push_error(L, ERROR_POLL_FAILED);
+		}
+	}
+#endif
+}
+
+// socket:read_async([options]) - like read, but instead of blocking it yields
+// (fd, "read") to the coroutine scheduler and retries once resumed
+int lsi_socket_read_async(lua_State *L)
+{
+	return read_async_k(L, LUA_OK, 0);
+}
+
+// ctx holds the number of bytes already written
+static int write_async_k(lua_State *L, int status, lua_KContext ctx)
+{
+	(void)status;
+	lua_settop(L, 2);
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	size_t datasize;
+	const char *data = luaL_checklstring(L, 2, &datasize);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	if (sock->client != NULL) {
+		// server owned, queued so it never overtakes earlier writes
+		if (lsi_server_send(sock->server, sock->client, data,
+				    datasize) == -1) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+		lua_pushboolean(L, 1);
+		return 1;
+	}
+	size_t written = (size_t)ctx;
+	while (written < datasize) {
+		ssize_t res = send(sock->fd, data + written, datasize - written,
+				   MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (res >= 0) {
+			written += res;
+			continue;
+		}
+		if (errno != EAGAIN && errno != EWOULDBLOCK && errno != EINTR) {
+			return push_error(L, ERROR_WRITE_FAILED);
+		}
+		if (lua_isyieldable(L)) {
+			lua_pushinteger(L, sock->fd);
+			lua_pushstring(L, "write");
+			return lua_yieldk(L, 2, (lua_KContext)written,
+					  write_async_k);
+		}
+		if (wait_ready_blocking(sock->fd, POLLOUT) == -1) {
+			return push_error(L, ERROR_POLL_FAILED);
+		}
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+// socket:write_async(data) - writes all data, yielding (fd, "write") to the
+// coroutine scheduler whenever the socket buffer is full
+int lsi_socket_write_async(lua_State *L)
+{
+	return write_async_k(L, LUA_OK, 0);
+}
+
+#ifndef _WIN32
+static lsi_socket *check_server_client(lua_State *L, const char **topic,
+				       size_t *topic_len)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	*topic = luaL_checklstring(L, 2, topic_len);
+	return sock->closed || sock->client == NULL ? NULL : sock;
+}
+#endif
+
+// client:subscribe(topic) - adds server owned socket to topic used by
+// server:publish
+int lsi_socket_subscribe(lua_State *L)
+{
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	const char *topic;
+	size_t topic_len;
+	lsi_socket *sock = check_server_client(L, &topic, &topic_len);
+	if (sock == NULL) {
+		return push_error(L, ERROR_NOT_SERVER_CLIENT);
+	}
+	if (lsi_server_subscribe(sock->server, sock->client, topic,
+				 topic_len) == -1) {
+		return push_error(L, ERROR_OUT_OF_MEMORY);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+// socket:set_timeouts({ idle = ms, read = ms, write = ms }) - overrides
+// server timeouts for this client, 0 disables, missing fields are kept
+int lsi_socket_set_timeouts(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	luaL_checktype(L, 2, LUA_TTABLE);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	if (sock->closed || sock->client == NULL) {
+		return push_error(L, ERROR_NOT_SERVER_CLIENT);
+	}
+	lua_getfield(L, 2, "idle");
+	lua_Integer idle_ms = luaL_optinteger(L, -1, -1);
+	lua_getfield(L, 2, "read");
+	lua_Integer read_ms = luaL_optinteger(L, -1, -1);
+	lua_getfield(L, 2, "write");
+	lua_Integer write_ms = luaL_optinteger(L, -1, -1);
+	lua_pop(L, 3);
+	lsi_server_set_timeouts(sock->server, sock->client, idle_ms,
+				read_ms, write_ms);
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+// socket:set_rate_limit(bytes_per_second, [burst]) - limits how fast the
+// server reads from this client, 0 disables the limit
+int lsi_socket_set_rate_limit(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	lua_Integer rate = luaL_checkinteger(L, 2);
+	lua_Integer burst = luaL_optinteger(L, 3, 0);
+	luaL_argcheck(L, rate >= 0, 2, "rate must be non-negative");
+	luaL_argcheck(L, burst >= 0, 3, "burst must be non-negative");
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	if (sock->closed || sock->client == NULL) {
+		return push_error(L, ERROR_NOT_SERVER_CLIENT);
+	}
+	lsi_server_set_rate_limit(sock->server, sock->client, (uint32_t)rate,
+				  (uint32_t)burst);
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+int lsi_socket_unsubscribe(lua_State *L)
+{
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	const char *topic;
+	size_t topic_len;
+	lsi_socket *sock = check_server_client(L, &topic, &topic_len);
+	if (sock == NULL) {
+		return push_error(L, ERROR_NOT_SERVER_CLIENT);
+	}
+	lua_pushboolean(L, lsi_server_unsubscribe(sock->server, sock->client,
+						  topic, topic_len));
+	return 1;
+#endif
+}
+
+int lsi_socket_get_fd(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	if (sock == NULL) {
+		return push_error(L, ERROR_SOCKET_IS_NIL);
+	}
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+#ifdef _WIN32
+	lua_pushinteger(L, (lua_Integer)sock->hPipe);
+#else
+	lua_pushinteger(L, sock->fd);
+#endif
+	return 1;
+}
+
 int lsi_socket_is_nonblocking(lua_State *L)
 {
 	lsi_socket *sock =
@@ -301,13 +1687,13 @@ void push_address(lua_State *L, struct sockaddr *addr)
 {
 	switch (addr->sa_family) {
 	case AF_INET: {
-		struct sockaddr_in *s = (struct sockaddr_in *)&addr;
+		struct sockaddr_in *s = (struct sockaddr_in *)addr;
 		lua_pushstring(L, inet_ntoa(s->sin_addr));
 		lua_pushinteger(L, ntohs(s->sin_port));
 		break;
 	}
 	case AF_INET6: {
-		struct sockaddr_in6 *s = (struct sockaddr_in6 *)&addr;
+		struct sockaddr_in6 *s = (struct sockaddr_in6 *)addr;
 		char ipstr[INET6_ADDRSTRLEN];
 		inet_ntop(AF_INET6, &s->sin6_addr, ipstr, sizeof ipstr);
 		lua_pushstring(L, ipstr);
@@ -315,7 +1701,7 @@ void push_address(lua_State *L, struct sockaddr *addr)
 		break;
 	}
 	case AF_UNIX: {
-		struct sockaddr_un *s = (struct sockaddr_un *)&addr;
+		struct sockaddr_un *s = (struct sockaddr_un *)addr;
 		lua_pushstring(L, s->sun_path);
 		lua_pushinteger(L, 0);
 		break;
@@ -341,16 +1727,53 @@ int lsi_socket_get_peer_name(lua_State *L)
 #ifdef _WIN32
 	lua_pushstring(L, "pipe");
 #else
-	struct sockaddr addr;
+	// large enough for ipv6 and socket file addresses
+	struct sockaddr_storage addr;
 	socklen_t addr_len = sizeof(addr);
-	if (getpeername(sock->fd, &addr, &addr_len) == -1) {
+	if (getpeername(sock->fd, (struct sockaddr *)&addr, &addr_len) == -1) {
 		return push_error(L, ERROR_STATE_CHECK_FAILED);
 	}
-	push_address(L, &addr);
+	push_address(L, (struct sockaddr *)&addr);
 #endif
 	return 2;
 }
 
+// socket:get_stats() - returns table with busy-poll counters
+int lsi_socket_get_stats(lua_State *L)
+{
+	lsi_socket *sock =
+		(lsi_socket *)luaL_checkudata(L, 1, LSI_SOCKET_METATABLE);
+	lua_newtable(L);
+	lua_pushinteger(L, sock->spin.hits);
+	lua_setfield(L, -2, "spin_hits");
+	lua_pushinteger(L, sock->spin.misses);
+	lua_setfield(L, -2, "spin_misses");
+	lua_pushinteger(L, sock->spin.window_us);
+	lua_setfield(L, -2, "spin_window_us");
+#ifndef _WIN32
+	if (sock->closed) {
+		return 1;
+	}
+	if (sock->client != NULL) {
+		lua_pushinteger(L, sock->client->read_size);
+		lua_setfield(L, -2, "read_size");
+	}
+	// as reported by the kernel, linux doubles the requested size
+	int size;
+	socklen_t len = sizeof(size);
+	if (getsockopt(sock->fd, SOL_SOCKET, SO_RCVBUF, &size, &len) == 0) {
+		lua_pushinteger(L, size);
+		lua_setfield(L, -2, "recv_buffer");
+	}
+	len = sizeof(size);
+	if (getsockopt(sock->fd, SOL_SOCKET, SO_SNDBUF, &size, &len) == 0) {
+		lua_pushinteger(L, size);
+		lua_setfield(L, -2, "send_buffer");
+	}
+#endif
+	return 1;
+}
+
 int lsi_socket_equals(lua_State *L)
 {
 	lsi_socket *sock1 =
@@ -395,12 +1818,60 @@ int lsi_create_socket_meta(lua_State *L)
 	lua_setfield(L, -2, "write");
 	lua_pushcfunction(L, lsi_socket_read);
 	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, lsi_socket_read_async);
+	lua_setfield(L, -2, "read_async");
+	lua_pushcfunction(L, lsi_socket_write_async);
+	lua_setfield(L, -2, "write_async");
+	lua_pushcfunction(L, lsi_socket_read_into);
+	lua_setfield(L, -2, "read_into");
+	lua_pushcfunction(L, lsi_socket_send_file);
+	lua_setfield(L, -2, "send_file");
+	lua_pushcfunction(L, lsi_socket_read_line);
+	lua_setfield(L, -2, "read_line");
+	lua_pushcfunction(L, lsi_socket_read_until);
+	lua_setfield(L, -2, "read_until");
+	lua_pushcfunction(L, lsi_socket_read_exact);
+	lua_setfield(L, -2, "read_exact");
+	lua_pushcfunction(L, lsi_socket_peek);
+	lua_setfield(L, -2, "peek");
+	lua_pushcfunction(L, lsi_socket_open_stream);
+	lua_setfield(L, -2, "open_stream");
+	lua_pushcfunction(L, lsi_socket_get_stream);
+	lua_setfield(L, -2, "get_stream");
+	lua_pushcfunction(L, lsi_socket_read_message);
+	lua_setfield(L, -2, "read_message");
+	lua_pushcfunction(L, lsi_socket_flush);
+	lua_setfield(L, -2, "flush");
+	lua_pushcfunction(L, lsi_socket_credits);
+	lua_setfield(L, -2, "credits");
+	lua_pushcfunction(L, lsi_socket_write_stream);
+	lua_setfield(L, -2, "write_stream");
+	lua_pushcfunction(L, lsi_socket_cork);
+	lua_setfield(L, -2, "cork");
+	lua_pushcfunction(L, lsi_socket_uncork);
+	lua_setfield(L, -2, "uncork");
+	lua_pushcfunction(L, lsi_socket_send_value);
+	lua_setfield(L, -2, "send_value");
+	lua_pushcfunction(L, lsi_socket_read_value);
+	lua_setfield(L, -2, "read_value");
+	lua_pushcfunction(L, lsi_socket_subscribe);
+	lua_setfield(L, -2, "subscribe");
+	lua_pushcfunction(L, lsi_socket_unsubscribe);
+	lua_setfield(L, -2, "unsubscribe");
+	lua_pushcfunction(L, lsi_socket_set_timeouts);
+	lua_setfield(L, -2, "set_timeouts");
+	lua_pushcfunction(L, lsi_socket_set_rate_limit);
+	lua_setfield(L, -2, "set_rate_limit");
+	lua_pushcfunction(L, lsi_socket_get_fd);
+	lua_setfield(L, -2, "get_fd");
 	lua_pushcfunction(L, lsi_socket_is_nonblocking);
 	lua_setfield(L, -2, "is_nonblocking");
 	lua_pushcfunction(L, lsi_socket_set_nonblocking);
 	lua_setfield(L, -2, "set_nonblocking");
 	lua_pushcfunction(L, lsi_socket_get_peer_name);
 	lua_setfield(L, -2, "get_peer_name");
+	lua_pushcfunction(L, lsi_socket_get_stats);
+	lua_setfield(L, -2, "get_stats");
 	lua_pushcfunction(L, lsi_socket_tostring);
 	lua_setfield(L, -2, "__tostring");
 	lua_pushcfunction(L, lsi_socket_equals);
@@ -1,7 +1,13 @@
 #ifndef LSI_CORE_SOCKET_H__
 #define LSI_CORE_SOCKET_H__
 
+#include "lsi_buffer.h"
 #include "lsi_core.h"
+#include "lsi_mux.h"
+#include "lsi_spin.h"
+#include "lsi_tcp.h"
+#include "lsi_value.h"
+#include "lsi_wqueue.h"
 #include "lua.h"
 
 #define LSI_SOCKET_METATABLE "LSI_SOCKET"
@@ -14,9 +20,25 @@ typedef struct lsi_socket {
 #endif
     int server_owned; // if server_owned the non-blocking mode can not be changed
     int closed;
+    lsi_buffer rbuf; // data received but not consumed yet
+    lsi_value_scanner scanner; // progress of read_value through rbuf
+    lsi_wqueue wq; // data waiting for the socket to become writable
+    lsi_spin spin; // busy-poll before blocking reads
+    lsi_mux* mux; // created with the first stream, see lsi_core_stream.h
+    int corked; // writes are queued until socket:uncork()
+    // set while the socket is registered in a server
+    struct lsi_server* server;
+    struct lsi_client* client;
 } lsi_socket;
 
 int lsi_create_socket_meta(lua_State* L);
 int lsi_socket_connect(lua_State* L);
+int lsi_socket_close(lua_State* L);
+// reads nodelay, reuse_port, send_buffer and recv_buffer from options at idx
+void lsi_socket_read_tcp_options(lua_State* L, int idx, lsi_tcp_options* options);
+// queues message on multiplexed stream and writes as much as possible,
+// server owned and non-blocking sockets return MUX_NO_CREDIT instead of
+// queueing once the credits of the peer are used up, -1 on failure
+int lsi_socket_send_stream(lsi_socket* sock, uint32_t stream, int priority, const char* data, size_t size);
 
 #endif /* LSI_CORE_SOCKET_H__ */
\ No newline at end of file
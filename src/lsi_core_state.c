@@ -0,0 +1,299 @@
+#include <errno.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_core_state.h"
+#include "lsi_errors.h"
+#include "lua.h"
+#include "lerror.h"
+
+#define LSI_STATE_CACHE "LSI_STATES" // registry, name to state
+
+#ifndef _WIN32
+// (re)maps the state named by uservalue 1 of the state at idx
+static int map_state(lua_State *L, int idx, lsi_state *state, size_t capacity,
+		     int writable)
+{
+	lua_getiuservalue(L, idx, 1);
+	const char *name = lua_tostring(L, -1);
+	if (!state->closed) {
+		lsi_shm_close(&state->shm);
+	}
+	int res = lsi_shm_open(&state->shm, name, capacity, writable);
+	lua_pop(L, 1);
+	state->closed = res == -1;
+	return res;
+}
+
+static int push_open_error(lua_State *L)
+{
+	return push_error(L, errno == ENOENT || errno == EAGAIN ?
+				     ERROR_STATE_EMPTY :
+				     ERROR_STATE_OPEN_FAILED);
+}
+
+static lsi_state *new_state(lua_State *L, int name_idx)
+{
+	name_idx = lua_absindex(L, name_idx);
+	lsi_state *state =
+		(lsi_state *)lua_newuserdatauv(L, sizeof(lsi_state), 1);
+	memset(state, 0, sizeof(lsi_state));
+	state->closed = 1;
+	luaL_getmetatable(L, LSI_STATE_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, name_idx);
+	lua_setiuservalue(L, -2, 1);
+	return state;
+}
+
+static size_t capacity_option(lua_State *L, int idx, size_t size)
+{
+	size_t capacity = size * 2; // room for the state to grow
+	if (capacity < SHM_DEFAULT_CAPACITY) {
+		capacity = SHM_DEFAULT_CAPACITY;
+	}
+	if (lua_istable(L, idx)) {
+		lua_getfield(L, idx, "capacity");
+		capacity = luaL_optinteger(L, -1, capacity);
+		lua_pop(L, 1);
+	}
+	return capacity;
+}
+
+static int publish(lua_State *L, lsi_state *state, const char *data,
+		   size_t size)
+{
+	if (lsi_shm_publish(&state->shm, data, size) == -1) {
+		return push_error(L, ERROR_STATE_TOO_LARGE);
+	}
+	lua_pushinteger(L, (lua_Integer)atomic_load_explicit(
+				   &state->shm.segment->seq,
+				   memory_order_relaxed));
+	return 1;
+}
+
+static int read_snapshot(lua_State *L, lsi_state *state)
+{
+	uint64_t version;
+	size_t size = lsi_shm_read(&state->shm, &version);
+	if (version == 0) {
+		return push_error(L, ERROR_STATE_EMPTY);
+	}
+	lua_pushlstring(L, state->shm.scratch, size);
+	lua_pushinteger(L, (lua_Integer)version);
+	return 2;
+}
+
+// pushes cached state for name at idx, opening it if needed
+static lsi_state *cached_state(lua_State *L, int name_idx, size_t capacity,
+			       int writable)
+{
+	name_idx = lua_absindex(L, name_idx);
+	if (luaL_getsubtable(L, LUA_REGISTRYINDEX, LSI_STATE_CACHE)) {
+		lua_pushvalue(L, name_idx);
+		if (lua_rawget(L, -2) == LUA_TUSERDATA) {
+			lsi_state *state = (lsi_state *)lua_touserdata(L, -1);
+			lua_remove(L, -2); // cache
+			if (!state->closed && (state->shm.writable || !writable)) {
+				return state;
+			}
+			return map_state(L, -1, state, capacity, writable) == 0 ?
+				       state :
+				       NULL;
+		}
+		lua_pop(L, 1);
+	}
+	lsi_state *state = new_state(L, name_idx);
+	if (map_state(L, -1, state, capacity, writable) == -1) {
+		lua_remove(L, -2); // cache
+		return NULL;
+	}
+	lua_pushvalue(L, name_idx);
+	lua_pushvalue(L, -2);
+	lua_rawset(L, -4);
+	lua_remove(L, -2); // cache
+	return state;
+}
+#endif
+
+// core.open_state(name, [options]) - maps shared state snapshot, options:
+// writable to publish, capacity per snapshot when it is created
+int lsi_state_open(lua_State *L)
+{
+	luaL_checkstring(L, 1);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	int writable = 0;
+	if (lua_istable(L, 2)) {
+		lua_getfield(L, 2, "writable");
+		writable = lua_toboolean(L, -1);
+		lua_pop(L, 1);
+	}
+	lsi_state *state = new_state(L, 1);
+	if (map_state(L, -1, state, capacity_option(L, 2, 0), writable) ==
+	    -1) {
+		return push_open_error(L);
+	}
+	return 1;
+#endif
+}
+
+// core.publish_state(name, data, [options]) - replaces the snapshot, the
+// mapping is kept for later calls, returns the new version
+int lsi_state_publish_named(lua_State *L)
+{
+	luaL_checkstring(L, 1);
+	size_t size;
+	const char *data = luaL_checklstring(L, 2, &size);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_state *state = cached_state(L, 1, capacity_option(L, 3, size), 1);
+	if (state == NULL) {
+		return push_open_error(L);
+	}
+	return publish(L, state, data, size);
+#endif
+}
+
+// core.read_state(name) - returns newest snapshot and its version, no
+// syscalls once the state is mapped
+int lsi_state_read_named(lua_State *L)
+{
+	luaL_checkstring(L, 1);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lsi_state *state = cached_state(L, 1, 0, 0);
+	if (state == NULL) {
+		return push_open_error(L);
+	}
+	return read_snapshot(L, state);
+#endif
+}
+
+static lsi_state *check_open_state(lua_State *L)
+{
+	lsi_state *state =
+		(lsi_state *)luaL_checkudata(L, 1, LSI_STATE_METATABLE);
+	return state->closed ? NULL : state;
+}
+
+// state:publish(data) - returns the new version
+int lsi_state_publish(lua_State *L)
+{
+	lsi_state *state = check_open_state(L);
+	size_t size;
+	const char *data = luaL_checklstring(L, 2, &size);
+	if (state == NULL) {
+		return push_error(L, ERROR_STATE_OPEN_FAILED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	if (!state->shm.writable &&
+	    map_state(L, 1, state, capacity_option(L, 3, size), 1) == -1) {
+		return push_open_error(L);
+	}
+	return publish(L, state, data, size);
+#endif
+}
+
+// state:read() - returns newest snapshot and its version
+int lsi_state_read(lua_State *L)
+{
+	lsi_state *state = check_open_state(L);
+	if (state == NULL) {
+		return push_error(L, ERROR_STATE_OPEN_FAILED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	return read_snapshot(L, state);
+#endif
+}
+
+// state:version() - cheap check for a new snapshot, 0 while empty
+int lsi_state_version(lua_State *L)
+{
+	lsi_state *state = check_open_state(L);
+	if (state == NULL) {
+		return push_error(L, ERROR_STATE_OPEN_FAILED);
+	}
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lua_pushinteger(L, (lua_Integer)atomic_load_explicit(
+				   &state->shm.segment->seq,
+				   memory_order_acquire));
+	return 1;
+#endif
+}
+
+// state:unlink() - removes the name, mapped segments stay valid
+int lsi_state_unlink(lua_State *L)
+{
+	luaL_checkudata(L, 1, LSI_STATE_METATABLE);
+#ifdef _WIN32
+	return push_error(L, ERROR_NOT_SUPPORTED);
+#else
+	lua_getiuservalue(L, 1, 1);
+	if (lsi_shm_unlink(lua_tostring(L, -1)) == -1) {
+		return push_open_error(L);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+#endif
+}
+
+int lsi_state_close(lua_State *L)
+{
+	lsi_state *state =
+		(lsi_state *)luaL_checkudata(L, 1, LSI_STATE_METATABLE);
+#ifndef _WIN32
+	if (!state->closed) {
+		lsi_shm_close(&state->shm);
+	}
+#endif
+	state->closed = 1;
+	return 0;
+}
+
+int lsi_state_tostring(lua_State *L)
+{
+	luaL_checkudata(L, 1, LSI_STATE_METATABLE);
+	lua_getiuservalue(L, 1, 1);
+	lua_pushfstring(L, "state(%s)", lua_tostring(L, -1));
+	return 1;
+}
+
+int lsi_create_state_meta(lua_State *L)
+{
+	luaL_newmetatable(L, LSI_STATE_METATABLE);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, lsi_state_publish);
+	lua_setfield(L, -2, "publish");
+	lua_pushcfunction(L, lsi_state_read);
+	lua_setfield(L, -2, "read");
+	lua_pushcfunction(L, lsi_state_version);
+	lua_setfield(L, -2, "version");
+	lua_pushcfunction(L, lsi_state_unlink);
+	lua_setfield(L, -2, "unlink");
+	lua_pushcfunction(L, lsi_state_close);
+	lua_setfield(L, -2, "close");
+	lua_pushcfunction(L, lsi_state_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushstring(L, LSI_STATE_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	lua_setfield(L, -2, "__index");
+
+	lua_pushcfunction(L, lsi_state_close);
+	lua_setfield(L, -2, "__gc");
+	lua_pushcfunction(L, lsi_state_close);
+	lua_setfield(L, -2, "__close");
+
+	lua_pop(L, 1);
+	return 0;
+}
@@ -0,0 +1,22 @@
+#ifndef LSI_CORE_STATE_H__
+#define LSI_CORE_STATE_H__
+
+#include "lsi_shm.h"
+#include "lua.h"
+
+#define LSI_STATE_METATABLE "LSI_STATE"
+
+// mapped shared memory snapshot, see lsi_shm.h
+typedef struct lsi_state {
+#ifndef _WIN32
+    lsi_shm shm;
+#endif
+    int closed;
+} lsi_state;
+
+int lsi_create_state_meta(lua_State* L);
+int lsi_state_open(lua_State* L);
+int lsi_state_publish_named(lua_State* L);
+int lsi_state_read_named(lua_State* L);
+
+#endif /* LSI_CORE_STATE_H__ */
@@ -0,0 +1,135 @@
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_core_socket.h"
+#include "lsi_core_stream.h"
+#include "lsi_errors.h"
+#include "lsi_mux.h"
+#include "lua.h"
+#include "lerror.h"
+
+lsi_stream *lsi_stream_push(lua_State *L, int sock_idx, uint32_t id,
+			    int priority)
+{
+	sock_idx = lua_absindex(L, sock_idx);
+	lsi_stream *stream =
+		(lsi_stream *)lua_newuserdatauv(L, sizeof(lsi_stream), 1);
+	stream->id = id;
+	stream->priority = priority;
+	luaL_getmetatable(L, LSI_STREAM_METATABLE);
+	lua_setmetatable(L, -2);
+	lua_pushvalue(L, sock_idx);
+	lua_setiuservalue(L, -2, 1);
+	return stream;
+}
+
+int lsi_stream_read_credits(lua_State *L, int idx, uint32_t *messages,
+			    uint32_t *bytes)
+{
+	*messages = 0;
+	*bytes = 0;
+	if (!lua_istable(L, idx)) {
+		return 0;
+	}
+	int type = lua_getfield(L, idx, "credits");
+	if (type == LUA_TNUMBER) {
+		*messages = (uint32_t)lua_tointeger(L, -1);
+		*bytes = MUX_DEFAULT_CREDIT_BYTES;
+	} else if (type == LUA_TTABLE) {
+		lua_getfield(L, -1, "messages");
+		*messages = (uint32_t)luaL_optinteger(
+			L, -1, MUX_DEFAULT_CREDIT_MESSAGES);
+		lua_getfield(L, -2, "bytes");
+		*bytes = (uint32_t)luaL_optinteger(L, -1,
+						   MUX_DEFAULT_CREDIT_BYTES);
+		lua_pop(L, 2);
+	}
+	lua_pop(L, 1);
+	return *messages > 0 && *bytes > 0;
+}
+
+// stream:write(data) - queues data as one message on the stream, returns
+// nil, "no credit left" when the peer has to grant more first, retry once
+// the socket or the server writable callback reports credits
+int lsi_stream_write(lua_State *L)
+{
+	lsi_stream *stream =
+		(lsi_stream *)luaL_checkudata(L, 1, LSI_STREAM_METATABLE);
+	size_t size;
+	const char *data = luaL_checklstring(L, 2, &size);
+	lua_getiuservalue(L, 1, 1);
+	lsi_socket *sock = (lsi_socket *)lua_touserdata(L, -1);
+	lua_pop(L, 1);
+	if (sock->closed) {
+		return push_error(L, ERROR_SOCKET_CLOSED);
+	}
+	int res = lsi_socket_send_stream(sock, stream->id, stream->priority,
+					 data, size);
+	if (res == MUX_NO_CREDIT) {
+		return push_error(L, ERROR_NO_CREDIT);
+	}
+	if (res == -1) {
+		return push_error(L, ERROR_WRITE_FAILED);
+	}
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+int lsi_stream_get_id(lua_State *L)
+{
+	lsi_stream *stream =
+		(lsi_stream *)luaL_checkudata(L, 1, LSI_STREAM_METATABLE);
+	lua_pushinteger(L, stream->id);
+	return 1;
+}
+
+// stream:set_priority(priority) - applies to messages written afterwards
+int lsi_stream_set_priority(lua_State *L)
+{
+	lsi_stream *stream =
+		(lsi_stream *)luaL_checkudata(L, 1, LSI_STREAM_METATABLE);
+	lua_Integer priority = luaL_checkinteger(L, 2);
+	luaL_argcheck(L, priority >= 0 && priority < MUX_PRIORITIES, 2,
+		      "priority out of range");
+	stream->priority = (int)priority;
+	lua_pushboolean(L, 1);
+	return 1;
+}
+
+int lsi_stream_get_socket(lua_State *L)
+{
+	luaL_checkudata(L, 1, LSI_STREAM_METATABLE);
+	lua_getiuservalue(L, 1, 1);
+	return 1;
+}
+
+int lsi_stream_tostring(lua_State *L)
+{
+	lsi_stream *stream =
+		(lsi_stream *)luaL_checkudata(L, 1, LSI_STREAM_METATABLE);
+	lua_pushfstring(L, "stream(%d)", (int)stream->id);
+	return 1;
+}
+
+int lsi_create_stream_meta(lua_State *L)
+{
+	luaL_newmetatable(L, LSI_STREAM_METATABLE);
+
+	lua_newtable(L);
+	lua_pushcfunction(L, lsi_stream_write);
+	lua_setfield(L, -2, "write");
+	lua_pushcfunction(L, lsi_stream_get_id);
+	lua_setfield(L, -2, "get_id");
+	lua_pushcfunction(L, lsi_stream_set_priority);
+	lua_setfield(L, -2, "set_priority");
+	lua_pushcfunction(L, lsi_stream_get_socket);
+	lua_setfield(L, -2, "get_socket");
+	lua_pushcfunction(L, lsi_stream_tostring);
+	lua_setfield(L, -2, "__tostring");
+	lua_pushstring(L, LSI_STREAM_METATABLE);
+	lua_setfield(L, -2, "__type");
+
+	lua_setfield(L, -2, "__index");
+
+	lua_pop(L, 1);
+	return 0;
+}
@@ -0,0 +1,23 @@
+#ifndef LSI_CORE_STREAM_H__
+#define LSI_CORE_STREAM_H__
+
+#include <stdint.h>
+#include "lua.h"
+
+#define LSI_STREAM_METATABLE "LSI_STREAM"
+
+// logical stream of a multiplexed socket, the socket is kept alive as
+// uservalue, see lsi_mux.h for the framing
+typedef struct lsi_stream {
+    uint32_t id;
+    int priority;
+} lsi_stream;
+
+int lsi_create_stream_meta(lua_State* L);
+// pushes stream of socket at index sock_idx
+lsi_stream* lsi_stream_push(lua_State* L, int sock_idx, uint32_t id, int priority);
+// reads credits = n or { messages = n, bytes = n } from options table at idx
+// returns 0 when flow control is not requested
+int lsi_stream_read_credits(lua_State* L, int idx, uint32_t* messages, uint32_t* bytes);
+
+#endif /* LSI_CORE_STREAM_H__ */
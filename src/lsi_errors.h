@@ -20,5 +20,36 @@
 #define ERROR_CLIENT_LIMIT_REACHED             "client limit reached"
 #define ERROR_CALLBACK_FAILED                  "accept callback failed"
 #define ERROR_FAILED_TO_RECREATE_PIPE          "failed to create pipe"
+#define ERROR_ACCEPT_FAILED                    "accept failed"
+#define ERROR_NOT_SUPPORTED                    "not supported"
+#define ERROR_UNKNOWN_FD                       "unknown fd"
+#define ERROR_FAILED_TO_CREATE_SELECTOR_INSTANCE "failed to create selector instance"
+#define ERROR_SELECTOR_CLOSED                  "selector is closed"
+#define ERROR_INVALID_SELECTOR_OBJECT          "expected open socket or server"
+#define ERROR_OUT_OF_MEMORY                    "out of memory"
+#define ERROR_VALUE_TOO_DEEP                   "value nested too deep"
+#define ERROR_VALUE_UNSUPPORTED_TYPE           "unsupported value type"
+#define ERROR_INVALID_VALUE                    "invalid value encoding"
+#define ERROR_VALUE_TOO_LARGE                  "value too large"
+#define ERROR_CONNECTION_CLOSED                "connection closed"
+#define ERROR_NOT_SERVER_CLIENT                "socket is not connected to a server"
+#define ERROR_BUFFER_VIEW_READ_ONLY            "buffer view is read only"
+#define ERROR_FILE_OPEN_FAILED                 "failed to open file"
+#define ERROR_FRAME_TOO_LARGE                  "frame too large"
+#define ERROR_INVALID_WORKERS                  "workers require module and positive count"
+#define ERROR_INBOX_CLOSED                     "inbox is closed"
+#define ERROR_UNKNOWN_CLIENT                   "unknown client"
+#define ERROR_INVALID_FRAME                    "invalid frame"
+#define ERROR_STREAM_LENGTH_MISMATCH           "stream length mismatch"
+#define ERROR_CREDIT_EXCEEDED                  "peer exceeded its credits"
+#define ERROR_NO_CREDIT                        "no credit left"
+#define ERROR_STATE_OPEN_FAILED                "failed to open state"
+#define ERROR_STATE_TOO_LARGE                  "state exceeds capacity"
+#define ERROR_STATE_EMPTY                      "no state published"
+#define ERROR_POOL_CLOSED                      "pool is closed"
+#define ERROR_POOL_EXHAUSTED                   "all pool connections are in use"
+#define ERROR_POOL_NOT_BORROWED                "socket is not borrowed from the pool"
+#define ERROR_CAPTURE_OPEN_FAILED              "failed to open capture"
+#define ERROR_INVALID_CAPTURE                  "invalid capture file"
 
 #endif /* LSI_ERRORS_H__ */
@@ -0,0 +1,185 @@
+#include <errno.h>
+#include <string.h>
+#include "lsi_inbox.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <pthread.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
+
+// process wide id to inbox map, handles given to lua are ids so a stale or
+// forged handle can't reach freed memory
+static pthread_mutex_t registry_lock = PTHREAD_MUTEX_INITIALIZER;
+static lsi_inbox *registry = NULL;
+static uint64_t registry_next_id = 1;
+
+lsi_inbox *lsi_inbox_new(void)
+{
+	lsi_inbox *inbox = (lsi_inbox *)calloc(1, sizeof(lsi_inbox));
+	if (inbox == NULL) {
+		return NULL;
+	}
+#ifdef __linux__
+	inbox->wake_fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (inbox->wake_fd == -1) {
+		free(inbox);
+		return NULL;
+	}
+	inbox->wake_write_fd = inbox->wake_fd;
+#else
+	int fds[2];
+	if (pipe(fds) == -1) {
+		free(inbox);
+		return NULL;
+	}
+	for (int i = 0; i < 2; i++) {
+		fcntl(fds[i], F_SETFL, O_NONBLOCK);
+		fcntl(fds[i], F_SETFD, FD_CLOEXEC);
+	}
+	inbox->wake_fd = fds[0];
+	inbox->wake_write_fd = fds[1];
+#endif
+	atomic_init(&inbox->refcount, 1);
+	atomic_init(&inbox->closed, 0);
+	atomic_init(&inbox->signaled, 0);
+	atomic_init(&inbox->stub.next, NULL);
+	atomic_init(&inbox->head, &inbox->stub);
+	inbox->tail = &inbox->stub;
+	pthread_mutex_lock(&registry_lock);
+	inbox->id = registry_next_id++;
+	inbox->registry_next = registry;
+	registry = inbox;
+	pthread_mutex_unlock(&registry_lock);
+	return inbox;
+}
+
+void lsi_inbox_retain(lsi_inbox *inbox)
+{
+	atomic_fetch_add(&inbox->refcount, 1);
+}
+
+lsi_inbox *lsi_inbox_acquire(uint64_t id)
+{
+	pthread_mutex_lock(&registry_lock);
+	lsi_inbox *inbox = registry;
+	while (inbox != NULL && inbox->id != id) {
+		inbox = inbox->registry_next;
+	}
+	if (inbox != NULL) {
+		// the last release unlinks under the lock, so refcount is > 0
+		atomic_fetch_add(&inbox->refcount, 1);
+	}
+	pthread_mutex_unlock(&registry_lock);
+	return inbox;
+}
+
+void lsi_inbox_release(lsi_inbox *inbox)
+{
+	pthread_mutex_lock(&registry_lock);
+	int last = atomic_fetch_sub(&inbox->refcount, 1) == 1;
+	if (last) {
+		lsi_inbox **link = &registry;
+		while (*link != inbox) {
+			link = &(*link)->registry_next;
+		}
+		*link = inbox->registry_next;
+	}
+	pthread_mutex_unlock(&registry_lock);
+	if (!last) {
+		return;
+	}
+	lsi_post *post;
+	while ((post = lsi_inbox_pop(inbox)) != NULL) {
+		free(post);
+	}
+	close(inbox->wake_fd);
+	if (inbox->wake_write_fd != inbox->wake_fd) {
+		close(inbox->wake_write_fd);
+	}
+	free(inbox);
+}
+
+static void push(lsi_inbox *inbox, lsi_post *post)
+{
+	atomic_store_explicit(&post->next, NULL, memory_order_relaxed);
+	lsi_post *prev = atomic_exchange_explicit(&inbox->head, post,
+						  memory_order_acq_rel);
+	// queue is briefly unlinked here, pop reports it as empty
+	atomic_store_explicit(&prev->next, post, memory_order_release);
+}
+
+static void wake(lsi_inbox *inbox)
+{
+	uint64_t one = 1;
+	while (write(inbox->wake_write_fd, &one,
+		     inbox->wake_write_fd == inbox->wake_fd ? sizeof(one) : 1) ==
+		       -1 &&
+	       errno == EINTR) {
+	}
+}
+
+int lsi_inbox_post(lsi_inbox *inbox, int clientid, const char *data,
+		   size_t size)
+{
+	if (atomic_load(&inbox->closed)) {
+		return -1;
+	}
+	lsi_post *post = (lsi_post *)malloc(sizeof(lsi_post) + size);
+	if (post == NULL) {
+		return -1;
+	}
+	post->clientid = clientid;
+	post->size = size;
+	memcpy(post->data, data, size);
+	push(inbox, post);
+	// one wakeup per drain
+	if (!atomic_exchange(&inbox->signaled, 1)) {
+		wake(inbox);
+	}
+	return 0;
+}
+
+void lsi_inbox_begin_drain(lsi_inbox *inbox)
+{
+	atomic_store(&inbox->signaled, 0);
+	uint64_t drain[8];
+	while (read(inbox->wake_fd, drain, sizeof(drain)) > 0) {
+	}
+}
+
+lsi_post *lsi_inbox_pop(lsi_inbox *inbox)
+{
+	lsi_post *tail = inbox->tail;
+	lsi_post *next =
+		atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (tail == &inbox->stub) {
+		if (next == NULL) {
+			return NULL;
+		}
+		inbox->tail = next;
+		tail = next;
+		next = atomic_load_explicit(&next->next, memory_order_acquire);
+	}
+	if (next != NULL) {
+		inbox->tail = next;
+		return tail;
+	}
+	if (tail != atomic_load_explicit(&inbox->head, memory_order_acquire)) {
+		// producer is between exchange and link, retry on next wakeup
+		atomic_store(&inbox->signaled, 1);
+		wake(inbox);
+		return NULL;
+	}
+	// tail is the last post, put stub behind it so it can be taken
+	push(inbox, &inbox->stub);
+	next = atomic_load_explicit(&tail->next, memory_order_acquire);
+	if (next != NULL) {
+		inbox->tail = next;
+		return tail;
+	}
+	return NULL;
+}
+#endif
@@ -0,0 +1,51 @@
+#ifndef LSI_INBOX_H__
+#define LSI_INBOX_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <stdatomic.h>
+
+// message posted to a client of the server owning the inbox
+typedef struct lsi_post {
+    _Atomic(struct lsi_post*) next;
+    int clientid;
+    size_t size;
+    char data[];
+} lsi_post;
+
+// lock-free multi producer single consumer queue, producers may be any
+// thread, the consumer is the server loop woken through wake_fd
+typedef struct lsi_inbox {
+    atomic_int refcount;
+    uint64_t id; // registry key, never reused
+    struct lsi_inbox* registry_next;
+    atomic_int closed; // set once the server is closed
+    atomic_int signaled; // wake_fd was written since the last drain
+    _Atomic(lsi_post*) head; // last pushed
+    lsi_post* tail; // next to pop, consumer only
+    lsi_post stub;
+    int wake_fd; // eventfd on linux, pipe read end elsewhere
+    int wake_write_fd;
+} lsi_inbox;
+
+// new inbox is registered under a fresh id until its last release
+lsi_inbox* lsi_inbox_new(void);
+void lsi_inbox_retain(lsi_inbox* inbox);
+// looks up a registered inbox and takes a reference, NULL if the id is
+// unknown or the inbox was already freed
+lsi_inbox* lsi_inbox_acquire(uint64_t id);
+// frees the inbox and undelivered posts with the last reference
+void lsi_inbox_release(lsi_inbox* inbox);
+// queues copy of data for the client and wakes the server, safe to call from
+// any thread holding a reference, returns -1 if the server is closed or on
+// allocation failure
+int lsi_inbox_post(lsi_inbox* inbox, int clientid, const char* data, size_t size);
+// consumer side, resets wake_fd then returns posts one by one (free with
+// free()) until NULL
+void lsi_inbox_begin_drain(lsi_inbox* inbox);
+lsi_post* lsi_inbox_pop(lsi_inbox* inbox);
+#endif
+
+#endif /* LSI_INBOX_H__ */
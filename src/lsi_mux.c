@@ -0,0 +1,320 @@
+#include <string.h>
+#include "lsi_common.h"
+#include "lsi_errors.h"
+#include "lsi_mux.h"
+
+lsi_mux *lsi_mux_new(int server_side)
+{
+	lsi_mux *mux = (lsi_mux *)calloc(1, sizeof(lsi_mux));
+	if (mux == NULL) {
+		return NULL;
+	}
+	mux->next_stream = server_side ? 2 : 1;
+	mux->max_message = MUX_MAX_MESSAGE;
+	return mux;
+}
+
+static void free_partial(lsi_mux_partial *partial)
+{
+	lsi_buffer_free(&partial->data);
+	free(partial);
+}
+
+void lsi_mux_free(lsi_mux *mux)
+{
+	for (int i = 0; i < MUX_PRIORITIES; i++) {
+		while (mux->head[i] != NULL) {
+			lsi_mux_message *next = mux->head[i]->next;
+			lsi_payload_release(mux->head[i]->payload);
+			free(mux->head[i]);
+			mux->head[i] = next;
+		}
+	}
+	while (mux->partial != NULL) {
+		lsi_mux_partial *next = mux->partial->next;
+		free_partial(mux->partial);
+		mux->partial = next;
+	}
+	while (mux->ready != NULL) {
+		lsi_mux_partial *next = mux->ready->next;
+		free_partial(mux->ready);
+		mux->ready = next;
+	}
+	if (mux->completed != NULL) {
+		free_partial(mux->completed);
+	}
+	free(mux);
+}
+
+uint32_t lsi_mux_open(lsi_mux *mux)
+{
+	uint32_t stream = mux->next_stream;
+	mux->next_stream += 2;
+	return stream;
+}
+
+int lsi_mux_push(lsi_mux *mux, uint32_t stream, int priority,
+		 const char *data, size_t size)
+{
+	if (priority < 0) {
+		priority = 0;
+	} else if (priority >= MUX_PRIORITIES) {
+		priority = MUX_PRIORITIES - 1;
+	}
+	lsi_mux_message *message =
+		(lsi_mux_message *)malloc(sizeof(lsi_mux_message));
+	if (message == NULL) {
+		return -1;
+	}
+	message->payload = lsi_payload_new(data, size);
+	if (message->payload == NULL) {
+		free(message);
+		return -1;
+	}
+	message->stream = stream;
+	message->offset = 0;
+	message->next = NULL;
+	if (mux->tail[priority] != NULL) {
+		mux->tail[priority]->next = message;
+	} else {
+		mux->head[priority] = message;
+	}
+	mux->tail[priority] = message;
+	mux->pending += size;
+	mux->queued++;
+	return 0;
+}
+
+int lsi_mux_can_push(lsi_mux *mux)
+{
+	return !mux->limited ||
+	       ((int64_t)mux->queued < mux->credit_messages &&
+		(int64_t)mux->pending < mux->credit_bytes);
+}
+
+long lsi_mux_fill(lsi_mux *mux, lsi_wqueue *queue, size_t window)
+{
+	long added = 0;
+	int priority = 0;
+	while (queue->size < window && priority < MUX_PRIORITIES) {
+		lsi_mux_message *message = mux->head[priority];
+		if (message == NULL) {
+			priority++;
+			continue;
+		}
+		if (mux->limited && message->offset == 0) {
+			// whole message is charged up front, the receiver
+			// buffers it until complete anyway
+			if (mux->credit_messages <= 0 || mux->credit_bytes <= 0) {
+				mux->blocked = 1;
+				break;
+			}
+			mux->credit_messages--;
+			mux->credit_bytes -= message->payload->size;
+		}
+		mux->blocked = 0;
+		size_t left = message->payload->size - message->offset;
+		size_t chunk = left > MUX_CHUNK_SIZE ? MUX_CHUNK_SIZE : left;
+		int last = chunk == left;
+		lsi_payload *frame = lsi_payload_new(NULL, MUX_HEADER_SIZE + chunk);
+		if (frame == NULL) {
+			return -1;
+		}
+		lsi_put_u32(frame->data, message->stream);
+		lsi_put_u32(frame->data + 4,
+			    (uint32_t)chunk | (last ? MUX_FLAG_END : 0));
+		memcpy(frame->data + MUX_HEADER_SIZE,
+		       message->payload->data + message->offset, chunk);
+		int res = lsi_wqueue_push(queue, frame);
+		lsi_payload_release(frame);
+		if (res == -1) {
+			return -1;
+		}
+		message->offset += chunk;
+		mux->pending -= chunk;
+		added += MUX_HEADER_SIZE + chunk;
+		if (last) {
+			mux->head[priority] = message->next;
+			if (mux->head[priority] == NULL) {
+				mux->tail[priority] = NULL;
+			}
+			lsi_payload_release(message->payload);
+			free(message);
+			mux->queued--;
+		}
+	}
+	return added;
+}
+
+void lsi_mux_set_max_message(lsi_mux *mux, size_t max)
+{
+	mux->max_message = max > 0 ? max : MUX_MAX_MESSAGE;
+}
+
+void lsi_mux_set_window(lsi_mux *mux, uint32_t messages, uint32_t bytes)
+{
+	mux->window_messages = messages;
+	mux->window_bytes = bytes;
+	mux->grant_messages = messages;
+	mux->grant_bytes = bytes;
+}
+
+int lsi_mux_consumed(lsi_mux *mux, size_t size)
+{
+	if (mux->window_messages == 0) {
+		return 0;
+	}
+	mux->grant_messages++;
+	mux->grant_bytes += size > UINT32_MAX - mux->grant_bytes ?
+				    UINT32_MAX - mux->grant_bytes :
+				    (uint32_t)size;
+	return mux->grant_messages * 2 >= mux->window_messages ||
+	       mux->grant_bytes * 2ull >= mux->window_bytes;
+}
+
+void lsi_mux_grant(lsi_mux *mux, char *frame)
+{
+	lsi_put_u32(frame, MUX_CONTROL_STREAM);
+	lsi_put_u32(frame + 4, 8 | MUX_FLAG_END);
+	lsi_put_u32(frame + 8, mux->grant_messages);
+	lsi_put_u32(frame + 12, mux->grant_bytes);
+	mux->allowed_messages += mux->grant_messages;
+	mux->allowed_bytes += mux->grant_bytes;
+	mux->grant_messages = 0;
+	mux->grant_bytes = 0;
+}
+
+// consumes one frame, completed messages are moved to the ready list
+// returns 1 when a frame was consumed, 0 when more data is needed, -1 on
+// malformed input or MUX_TOO_LARGE
+static int consume_frame(lsi_mux *mux, lsi_buffer *in)
+{
+	if (lsi_buffer_size(in) < MUX_HEADER_SIZE) {
+		return 0;
+	}
+	const char *frame = lsi_buffer_begin(in);
+	uint32_t id = lsi_get_u32(frame);
+	uint32_t length = lsi_get_u32(frame + 4);
+	int last = (length & MUX_FLAG_END) != 0;
+	length &= ~MUX_FLAG_END;
+	if (length > MUX_MAX_FRAME) {
+		return -1;
+	}
+	if (lsi_buffer_size(in) < MUX_HEADER_SIZE + length) {
+		return 0;
+	}
+	if (id == MUX_CONTROL_STREAM) {
+		if (length != 8 || !last) {
+			return -1;
+		}
+		mux->credit_messages += lsi_get_u32(frame + 8);
+		mux->credit_bytes += lsi_get_u32(frame + 12);
+		mux->limited = 1;
+		mux->granted = 1;
+		lsi_buffer_consume(in, MUX_GRANT_SIZE);
+		return 1;
+	}
+	lsi_mux_partial **link = &mux->partial;
+	while (*link != NULL && (*link)->stream != id) {
+		link = &(*link)->next;
+	}
+	lsi_mux_partial *partial = *link;
+	size_t have = partial != NULL ? lsi_buffer_size(&partial->data) : 0;
+	if (length > mux->max_message - have ||
+	    mux->buffered + length >
+		    (uint64_t)MUX_MAX_BUFFERED * mux->max_message) {
+		return MUX_TOO_LARGE;
+	}
+	if (partial == NULL) {
+		if (mux->partials >= MUX_MAX_PARTIALS) {
+			return MUX_TOO_LARGE;
+		}
+		// same rule as lsi_mux_fill, a message needs a message credit
+		// and any byte credit left when it starts
+		if (mux->window_messages > 0) {
+			if (mux->allowed_messages <= 0 ||
+			    mux->allowed_bytes <= 0) {
+				return MUX_NO_CREDIT;
+			}
+			mux->allowed_messages--;
+		}
+		partial = (lsi_mux_partial *)calloc(1,
+						    sizeof(lsi_mux_partial));
+		if (partial == NULL) {
+			return -1;
+		}
+		partial->stream = id;
+		partial->next = mux->partial;
+		mux->partial = partial;
+		link = &mux->partial;
+		mux->partials++;
+	}
+	if (lsi_buffer_append(&partial->data, frame + MUX_HEADER_SIZE,
+			      length) == -1) {
+		return -1;
+	}
+	mux->buffered += length;
+	mux->allowed_bytes -= length;
+	lsi_buffer_consume(in, MUX_HEADER_SIZE + length);
+	if (last) {
+		mux->partials--;
+		*link = partial->next;
+		partial->next = NULL;
+		if (mux->ready_tail != NULL) {
+			mux->ready_tail->next = partial;
+		} else {
+			mux->ready = partial;
+		}
+		mux->ready_tail = partial;
+	}
+	return 1;
+}
+
+int lsi_mux_receive(lsi_mux *mux, lsi_buffer *in, uint32_t *stream,
+		    lsi_buffer **message)
+{
+	if (mux->completed != NULL) {
+		free_partial(mux->completed);
+		mux->completed = NULL;
+	}
+	for (;;) {
+		if (mux->ready != NULL) {
+			lsi_mux_partial *partial = mux->ready;
+			mux->ready = partial->next;
+			if (mux->ready == NULL) {
+				mux->ready_tail = NULL;
+			}
+			mux->completed = partial;
+			mux->buffered -= lsi_buffer_size(&partial->data);
+			*stream = partial->stream;
+			*message = &partial->data;
+			return 1;
+		}
+		int res = consume_frame(mux, in);
+		if (res != 1) {
+			return res;
+		}
+	}
+}
+
+int lsi_mux_process(lsi_mux *mux, lsi_buffer *in)
+{
+	for (;;) {
+		int res = consume_frame(mux, in);
+		if (res != 1) {
+			return res;
+		}
+	}
+}
+
+const char *lsi_mux_error(int res)
+{
+	switch (res) {
+	case MUX_TOO_LARGE:
+		return ERROR_FRAME_TOO_LARGE;
+	case MUX_NO_CREDIT:
+		return ERROR_CREDIT_EXCEEDED;
+	default:
+		return ERROR_INVALID_FRAME;
+	}
+}
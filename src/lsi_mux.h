@@ -0,0 +1,109 @@
+#ifndef LSI_MUX_H__
+#define LSI_MUX_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "lsi_buffer.h"
+#include "lsi_wqueue.h"
+
+// frame: u32 stream id, u32 payload length (big endian) followed by payload,
+// MUX_FLAG_END in length marks the last chunk of a message
+#define MUX_HEADER_SIZE  8
+#define MUX_FLAG_END     0x80000000u
+#define MUX_CHUNK_SIZE   16384
+#define MUX_MAX_FRAME    (16 * MUX_CHUNK_SIZE) // accepted from peers
+#define MUX_PRIORITIES   8 // 0 is the most urgent
+#define MUX_DEFAULT_PRIORITY 4
+// bytes handed to the write queue ahead, anything beyond waits in the mux
+// where more urgent messages can overtake it
+#define MUX_WINDOW       (4 * MUX_CHUNK_SIZE)
+// stream 0 carries credit grants: u32 messages, u32 bytes
+#define MUX_CONTROL_STREAM 0
+#define MUX_GRANT_SIZE   (MUX_HEADER_SIZE + 8)
+#define MUX_DEFAULT_CREDIT_MESSAGES 64
+#define MUX_DEFAULT_CREDIT_BYTES    (1024 * 1024)
+// reassembly limits, a peer exceeding them gets MUX_TOO_LARGE
+#define MUX_MAX_MESSAGE  (16 * 1024 * 1024) // default, see lsi_mux_set_max_message
+#define MUX_MAX_PARTIALS 64 // streams with a message in progress
+#define MUX_MAX_BUFFERED 4 // received bytes held at once, in max messages
+#define MUX_TOO_LARGE    -2
+#define MUX_NO_CREDIT    -3 // peer started more than it was granted
+
+typedef struct lsi_mux_message {
+    uint32_t stream;
+    lsi_payload* payload;
+    size_t offset; // bytes already framed
+    struct lsi_mux_message* next;
+} lsi_mux_message;
+
+// message being reassembled
+typedef struct lsi_mux_partial {
+    uint32_t stream;
+    lsi_buffer data;
+    struct lsi_mux_partial* next;
+} lsi_mux_partial;
+
+typedef struct lsi_mux {
+    lsi_mux_message* head[MUX_PRIORITIES];
+    lsi_mux_message* tail[MUX_PRIORITIES];
+    size_t pending; // bytes waiting to be framed
+    size_t queued; // messages waiting to be framed
+    uint32_t next_stream;
+    lsi_mux_partial* partial;
+    lsi_mux_partial* ready; // completed, not returned yet
+    lsi_mux_partial* ready_tail;
+    lsi_mux_partial* completed; // returned by the last lsi_mux_receive
+    size_t max_message;
+    size_t partials; // entries in the partial list
+    size_t buffered; // bytes in partial and ready messages
+    // sending side, limited once the peer granted credits
+    int limited;
+    int blocked; // last fill stopped for lack of credits
+    int granted; // grant received since the flag was cleared
+    int64_t credit_messages;
+    int64_t credit_bytes; // may go negative, see lsi_mux_fill
+    // receiving side, credits granted to the peer, 0 disables flow control
+    uint32_t window_messages;
+    uint32_t window_bytes;
+    uint32_t grant_messages; // consumed, not granted back yet
+    uint32_t grant_bytes;
+    int64_t allowed_messages; // granted, not used by the peer yet
+    int64_t allowed_bytes;
+} lsi_mux;
+
+// odd stream ids for connecting side, even for the server
+lsi_mux* lsi_mux_new(int server_side);
+void lsi_mux_free(lsi_mux* mux);
+uint32_t lsi_mux_open(lsi_mux* mux);
+int lsi_mux_push(lsi_mux* mux, uint32_t stream, int priority, const char* data, size_t size);
+// 0 once queued messages use up the credits of the peer, pushing more only
+// grows the queue until the peer grants again
+int lsi_mux_can_push(lsi_mux* mux);
+// frames chunks, most urgent first, into queue until it holds window bytes
+// messages of equal priority are sent one after another, with credits a
+// message starts once a message credit and any byte credit are left
+// returns number of bytes added or -1 on allocation failure
+long lsi_mux_fill(lsi_mux* mux, lsi_wqueue* queue, size_t window);
+// consumes frames from in until a message is complete, returns 1 with
+// stream and message set (valid until the next call), 0 when more data is
+// needed, -1 on malformed input, MUX_TOO_LARGE once the peer exceeds the
+// reassembly limits or MUX_NO_CREDIT once it starts a message without
+// credit, the connection can't be used after any error
+int lsi_mux_receive(lsi_mux* mux, lsi_buffer* in, uint32_t* stream, lsi_buffer** message);
+// consumes all complete frames from in, applying grants and keeping
+// messages for lsi_mux_receive, returns 0 or an error as above
+int lsi_mux_process(lsi_mux* mux, lsi_buffer* in);
+// error message for a negative result of lsi_mux_receive or lsi_mux_process
+const char* lsi_mux_error(int res);
+// caps the size of a received message, 0 restores MUX_MAX_MESSAGE
+void lsi_mux_set_max_message(lsi_mux* mux, size_t max);
+// enables flow control as receiver, the whole window is granted first and
+// the peer must keep within it from the start
+void lsi_mux_set_window(lsi_mux* mux, uint32_t messages, uint32_t bytes);
+// records consumed message, returns 1 once half of a window is consumed
+// and should be granted back
+int lsi_mux_consumed(lsi_mux* mux, size_t size);
+// writes grant frame of MUX_GRANT_SIZE bytes and resets the grant counters
+void lsi_mux_grant(lsi_mux* mux, char* frame);
+
+#endif /* LSI_MUX_H__ */
@@ -0,0 +1,79 @@
+#include <string.h>
+#include "lsi_pool.h"
+
+// index of the smallest class holding size bytes, -1 when too large
+static int size_class(size_t size)
+{
+	size_t block = (size_t)1 << POOL_MIN_SHIFT;
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		if (size <= block) {
+			return i;
+		}
+		block <<= 1;
+	}
+	return -1;
+}
+
+void lsi_pool_init(lsi_pool *pool, size_t max_cached)
+{
+	memset(pool, 0, sizeof(lsi_pool));
+	pool->max_cached = max_cached;
+}
+
+void *lsi_pool_alloc(lsi_pool *pool, size_t *size)
+{
+	int index = size_class(*size);
+	if (index == -1) {
+		void *block = malloc(*size);
+		if (block != NULL) {
+			pool->in_use += *size;
+			pool->misses++;
+		}
+		return block;
+	}
+	size_t block_size = (size_t)1 << (POOL_MIN_SHIFT + index);
+	lsi_pool_block *block = pool->free[index];
+	if (block != NULL) {
+		pool->free[index] = block->next;
+		pool->cached -= block_size;
+		pool->hits++;
+	} else {
+		block = (lsi_pool_block *)malloc(block_size);
+		if (block == NULL) {
+			return NULL;
+		}
+		pool->misses++;
+	}
+	pool->in_use += block_size;
+	*size = block_size;
+	return block;
+}
+
+void lsi_pool_release(lsi_pool *pool, void *block, size_t size)
+{
+	if (block == NULL) {
+		return;
+	}
+	pool->in_use -= size;
+	int index = size_class(size);
+	if (index == -1 || pool->cached + size > pool->max_cached) {
+		free(block);
+		return;
+	}
+	lsi_pool_block *node = (lsi_pool_block *)block;
+	node->next = pool->free[index];
+	pool->free[index] = node;
+	pool->cached += size;
+}
+
+void lsi_pool_free(lsi_pool *pool)
+{
+	for (int i = 0; i < POOL_CLASSES; i++) {
+		while (pool->free[i] != NULL) {
+			lsi_pool_block *next = pool->free[i]->next;
+			free(pool->free[i]);
+			pool->free[i] = next;
+		}
+	}
+	pool->cached = 0;
+}
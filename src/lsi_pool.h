@@ -0,0 +1,35 @@
+#ifndef LSI_POOL_H__
+#define LSI_POOL_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// power of two size classes from 64 bytes to 256 KiB, larger requests are
+// allocated and freed directly
+#define POOL_MIN_SHIFT     6
+#define POOL_CLASSES       13
+#define POOL_DEFAULT_CACHE (4 * 1024 * 1024) // free bytes kept for reuse
+
+typedef struct lsi_pool_block {
+    struct lsi_pool_block* next;
+} lsi_pool_block;
+
+// buffers borrowed while data is in flight and handed back once drained
+typedef struct lsi_pool {
+    lsi_pool_block* free[POOL_CLASSES];
+    size_t in_use; // bytes borrowed
+    size_t cached; // bytes on the free lists
+    size_t max_cached;
+    uint64_t hits; // served from a free list
+    uint64_t misses; // had to allocate
+} lsi_pool;
+
+void lsi_pool_init(lsi_pool* pool, size_t max_cached);
+// borrows at least *size bytes, *size is set to the block size which has to
+// be passed back to lsi_pool_release
+void* lsi_pool_alloc(lsi_pool* pool, size_t* size);
+void lsi_pool_release(lsi_pool* pool, void* block, size_t size);
+// frees cached blocks, borrowed ones have to be released first
+void lsi_pool_free(lsi_pool* pool);
+
+#endif /* LSI_POOL_H__ */
@@ -0,0 +1,191 @@
+#ifndef _WIN32
+#include <errno.h>
+#include <fcntl.h>
+#include <sched.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "lsi_shm.h"
+
+// user names map to one flat shm name
+static int shm_path(const char *name, char *path, size_t size)
+{
+	if (strchr(name, '/') != NULL ||
+	    snprintf(path, size, "%s%s", SHM_NAME_PREFIX, name) >= (int)size) {
+		errno = EINVAL;
+		return -1;
+	}
+	return 0;
+}
+
+static int map_segment(lsi_shm *shm, int fd, size_t size)
+{
+	int prot = PROT_READ | (shm->writable ? PROT_WRITE : 0);
+	void *addr = mmap(NULL, size, prot, MAP_SHARED, fd, 0);
+	if (addr == MAP_FAILED) {
+		return -1;
+	}
+	shm->segment = (lsi_shm_segment *)addr;
+	shm->mapped_size = size;
+	return 0;
+}
+
+int lsi_shm_open(lsi_shm *shm, const char *name, size_t capacity,
+		 int writable)
+{
+	char path[256];
+	if (shm_path(name, path, sizeof(path)) == -1) {
+		return -1;
+	}
+	memset(shm, 0, sizeof(lsi_shm));
+	shm->writable = writable;
+	int created = 0;
+	int fd = -1;
+	if (writable) {
+		fd = shm_open(path, O_RDWR | O_CREAT | O_EXCL, 0600);
+		created = fd != -1;
+	}
+	if (fd == -1) {
+		fd = shm_open(path, writable ? O_RDWR : O_RDONLY, 0);
+	}
+	if (fd == -1) {
+		return -1;
+	}
+	size_t size;
+	if (created) {
+		size = sizeof(lsi_shm_segment) + 2 * capacity;
+		if (ftruncate(fd, size) == -1) {
+			int err = errno;
+			close(fd);
+			shm_unlink(path);
+			errno = err;
+			return -1;
+		}
+	} else {
+		struct stat st;
+		if (fstat(fd, &st) == -1) {
+			close(fd);
+			return -1;
+		}
+		size = st.st_size;
+		if (size < sizeof(lsi_shm_segment)) {
+			// creator has not sized it yet
+			close(fd);
+			errno = EAGAIN;
+			return -1;
+		}
+	}
+	int res = map_segment(shm, fd, size);
+	close(fd); // the mapping stays valid
+	if (res == -1) {
+		return -1;
+	}
+	lsi_shm_segment *segment = shm->segment;
+	if (created) {
+		segment->capacity = (uint32_t)capacity;
+		atomic_store_explicit(&segment->magic, SHM_MAGIC,
+				      memory_order_release);
+	} else if (atomic_load_explicit(&segment->magic,
+					memory_order_acquire) != SHM_MAGIC ||
+		   sizeof(lsi_shm_segment) + 2 * (size_t)segment->capacity >
+			   size) {
+		lsi_shm_close(shm);
+		errno = EAGAIN;
+		return -1;
+	}
+	shm->scratch = (char *)malloc(segment->capacity > 0 ?
+					      segment->capacity :
+					      1);
+	if (shm->scratch == NULL) {
+		lsi_shm_close(shm);
+		errno = ENOMEM;
+		return -1;
+	}
+	return 0;
+}
+
+void lsi_shm_close(lsi_shm *shm)
+{
+	if (shm->segment != NULL) {
+		munmap(shm->segment, shm->mapped_size);
+		shm->segment = NULL;
+	}
+	free(shm->scratch);
+	shm->scratch = NULL;
+}
+
+int lsi_shm_unlink(const char *name)
+{
+	char path[256];
+	if (shm_path(name, path, sizeof(path)) == -1) {
+		return -1;
+	}
+	return shm_unlink(path);
+}
+
+int lsi_shm_publish(lsi_shm *shm, const char *data, size_t size)
+{
+	lsi_shm_segment *segment = shm->segment;
+	if (size > segment->capacity) {
+		errno = EMSGSIZE;
+		return -1;
+	}
+	// publishers are rare and short, spin instead of a process shared mutex
+	// the lock holds the owner pid so that a publisher which died while
+	// publishing can't block the others, its unfinished slot is not
+	// visible to readers as seq was not bumped
+	int self = (int)getpid();
+	int expected = 0;
+	while (!atomic_compare_exchange_weak_explicit(&segment->writer,
+						      &expected, self,
+						      memory_order_acquire,
+						      memory_order_relaxed)) {
+		if (expected != 0 && kill((pid_t)expected, 0) == -1 &&
+		    errno == ESRCH) {
+			// stale, taken over unless another publisher was faster
+			continue;
+		}
+		expected = 0;
+		sched_yield();
+	}
+	uint64_t seq = atomic_load_explicit(&segment->seq,
+					    memory_order_relaxed);
+	int slot = (int)((seq + 1) & 1);
+	memcpy(segment->data + (size_t)slot * segment->capacity, data, size);
+	segment->size[slot] = size;
+	atomic_store_explicit(&segment->seq, seq + 1, memory_order_release);
+	atomic_store_explicit(&segment->writer, 0, memory_order_release);
+	return 0;
+}
+
+size_t lsi_shm_read(lsi_shm *shm, uint64_t *version)
+{
+	lsi_shm_segment *segment = shm->segment;
+	for (;;) {
+		uint64_t seq = atomic_load_explicit(&segment->seq,
+						    memory_order_acquire);
+		if (seq == 0) {
+			*version = 0;
+			return 0;
+		}
+		int slot = (int)(seq & 1);
+		size_t size = segment->size[slot];
+		if (size <= segment->capacity) {
+			memcpy(shm->scratch,
+			       segment->data + (size_t)slot * segment->capacity,
+			       size);
+		}
+		atomic_thread_fence(memory_order_acquire);
+		// slot is refilled only after seq moved past it
+		if (atomic_load_explicit(&segment->seq,
+					 memory_order_relaxed) == seq &&
+		    size <= segment->capacity) {
+			*version = seq;
+			return size;
+		}
+	}
+}
+#endif
@@ -0,0 +1,46 @@
+#ifndef LSI_SHM_H__
+#define LSI_SHM_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <stdatomic.h>
+
+#define SHM_MAGIC            0x4c534953u // "LSIS", set once initialized
+#define SHM_NAME_PREFIX      "/lsi-state."
+#define SHM_DEFAULT_CAPACITY 4096
+
+// snapshot segment shared by all processes mapping the same name
+// two slots, the odd/even seq selects the one readers copy while the
+// publisher fills the other one and then bumps seq, a reader retries when
+// seq moved during its copy, so readers never block and never syscall
+typedef struct lsi_shm_segment {
+    _Atomic uint32_t magic;
+    uint32_t capacity; // bytes per slot
+    _Atomic uint64_t seq; // number of publishes, 0 means empty
+    atomic_int writer; // pid of the publishing process, 0 when free
+    uint64_t size[2];
+    char data[]; // 2 * capacity
+} lsi_shm_segment;
+
+typedef struct lsi_shm {
+    lsi_shm_segment* segment;
+    size_t mapped_size;
+    int writable;
+    char* scratch; // reader copy, capacity bytes
+} lsi_shm;
+
+// maps named segment, creates it with capacity bytes per slot if writable
+// and missing, returns -1 with errno set (EAGAIN while it is initialized)
+int lsi_shm_open(lsi_shm* shm, const char* name, size_t capacity, int writable);
+void lsi_shm_close(lsi_shm* shm);
+int lsi_shm_unlink(const char* name);
+// returns -1 with errno EMSGSIZE when data exceeds the capacity
+int lsi_shm_publish(lsi_shm* shm, const char* data, size_t size);
+// copies newest snapshot to shm->scratch, returns its size and sets
+// version, version 0 means nothing was published yet
+size_t lsi_shm_read(lsi_shm* shm, uint64_t* version);
+#endif
+
+#endif /* LSI_SHM_H__ */
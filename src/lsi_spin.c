@@ -0,0 +1,47 @@
+#include "lsi_common.h"
+#include "lsi_spin.h"
+
+void lsi_spin_init(lsi_spin *spin, uint32_t max_us)
+{
+	spin->max_us = max_us;
+	spin->window_us = max_us;
+	spin->hits = 0;
+	spin->misses = 0;
+}
+
+#ifndef _WIN32
+int lsi_spin_poll(lsi_spin *spin, struct pollfd *fds, size_t nfds,
+		  int timeout)
+{
+	if (spin->max_us == 0 || timeout == 0) {
+		return poll(fds, nfds, timeout);
+	}
+	uint64_t start = lsi_now_us();
+	uint64_t until = start + spin->window_us;
+	int ret;
+	do {
+		ret = poll(fds, nfds, 0);
+	} while (ret == 0 && lsi_now_us() < until);
+	if (ret != 0) {
+		if (ret > 0) {
+			spin->hits++;
+			spin->window_us = spin->window_us * 2 < spin->max_us ?
+						  spin->window_us * 2 :
+						  spin->max_us;
+		}
+		return ret;
+	}
+	spin->misses++;
+	uint32_t min_us = spin->max_us / SPIN_MIN_DIVISOR;
+	if (min_us == 0) {
+		min_us = 1;
+	}
+	spin->window_us = spin->window_us / 2 > min_us ? spin->window_us / 2 :
+							 min_us;
+	if (timeout > 0) {
+		int spent = (int)((lsi_now_us() - start) / 1000);
+		timeout = spent >= timeout ? 0 : timeout - spent;
+	}
+	return poll(fds, nfds, timeout);
+}
+#endif
@@ -0,0 +1,29 @@
+#ifndef LSI_SPIN_H__
+#define LSI_SPIN_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#ifndef _WIN32
+#include <poll.h>
+#endif
+
+// the spin window shrinks down to max_us / SPIN_MIN_DIVISOR after misses
+#define SPIN_MIN_DIVISOR 16
+
+// adaptive busy-poll, window grows while spinning finds events in time and
+// shrinks while it ends up blocking anyway
+typedef struct lsi_spin {
+    uint32_t max_us; // 0 disables spinning
+    uint32_t window_us;
+    uint64_t hits; // events found while spinning
+    uint64_t misses; // window elapsed, fell back to blocking wait
+} lsi_spin;
+
+void lsi_spin_init(lsi_spin* spin, uint32_t max_us);
+#ifndef _WIN32
+// poll() preceded by non-blocking polls for up to the current window
+int lsi_spin_poll(lsi_spin* spin, struct pollfd* fds, size_t nfds, int timeout);
+#endif
+
+#endif /* LSI_SPIN_H__ */
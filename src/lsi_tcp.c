@@ -0,0 +1,158 @@
+#include <errno.h>
+#include <string.h>
+#include "lsi_tcp.h"
+
+#ifndef _WIN32
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#endif
+
+int lsi_is_tcp_endpoint(const char *endpoint)
+{
+	return endpoint != NULL &&
+	       strncmp(endpoint, TCP_PREFIX, TCP_PREFIX_LEN) == 0;
+}
+
+void lsi_tcp_options_init(lsi_tcp_options *options)
+{
+	options->nodelay = 1;
+	options->reuse_port = 0;
+	options->send_buffer = 0;
+	options->recv_buffer = 0;
+}
+
+#ifndef _WIN32
+// splits tcp://host:port, empty host or * means any address
+static int split_endpoint(const char *endpoint, char *host, size_t host_size,
+			  char *port, size_t port_size)
+{
+	const char *begin = endpoint + TCP_PREFIX_LEN;
+	const char *end;
+	const char *colon;
+	if (*begin == '[') {
+		begin++;
+		end = strchr(begin, ']');
+		if (end == NULL || end[1] != ':') {
+			return -1;
+		}
+		colon = end + 1;
+	} else {
+		colon = strrchr(begin, ':');
+		if (colon == NULL) {
+			return -1;
+		}
+		end = colon;
+	}
+	size_t host_len = end - begin;
+	size_t port_len = strlen(colon + 1);
+	if (host_len >= host_size || port_len == 0 || port_len >= port_size) {
+		return -1;
+	}
+	memcpy(host, begin, host_len);
+	host[host_len] = '\0';
+	memcpy(port, colon + 1, port_len + 1);
+	return 0;
+}
+
+static struct addrinfo *resolve(const char *endpoint, int passive)
+{
+	char host[256];
+	char port[16];
+	if (split_endpoint(endpoint, host, sizeof(host), port, sizeof(port)) ==
+	    -1) {
+		errno = EINVAL;
+		return NULL;
+	}
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_UNSPEC;
+	hints.ai_socktype = SOCK_STREAM;
+	hints.ai_flags = passive ? AI_PASSIVE : 0;
+	int any = host[0] == '\0' || strcmp(host, "*") == 0;
+	struct addrinfo *result = NULL;
+	if (getaddrinfo(any ? NULL : host, port, &hints, &result) != 0) {
+		errno = EHOSTUNREACH;
+		return NULL;
+	}
+	return result;
+}
+
+void lsi_tcp_configure(int fd, const lsi_tcp_options *options)
+{
+	int on = 1;
+	if (options->nodelay) {
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &on, sizeof(on));
+	}
+	if (options->send_buffer > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &options->send_buffer,
+			   sizeof(int));
+	}
+	if (options->recv_buffer > 0) {
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &options->recv_buffer,
+			   sizeof(int));
+	}
+}
+
+int lsi_tcp_listen(const char *endpoint, const lsi_tcp_options *options)
+{
+	struct addrinfo *result = resolve(endpoint, 1);
+	if (result == NULL) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		int on = 1;
+		setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on));
+#ifdef SO_REUSEPORT
+		if (options->reuse_port) {
+			setsockopt(fd, SOL_SOCKET, SO_REUSEPORT, &on,
+				   sizeof(on));
+		}
+#endif
+		// accepted sockets inherit the buffer sizes
+		lsi_tcp_configure(fd, options);
+		if (bind(fd, ai->ai_addr, ai->ai_addrlen) == 0 &&
+		    listen(fd, SOMAXCONN) == 0) {
+			break;
+		}
+		int err = errno;
+		close(fd);
+		errno = err;
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	return fd;
+}
+
+int lsi_tcp_connect(const char *endpoint, const lsi_tcp_options *options)
+{
+	struct addrinfo *result = resolve(endpoint, 0);
+	if (result == NULL) {
+		return -1;
+	}
+	int fd = -1;
+	for (struct addrinfo *ai = result; ai != NULL; ai = ai->ai_next) {
+		fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+		if (fd == -1) {
+			continue;
+		}
+		lsi_tcp_configure(fd, options);
+		if (connect(fd, ai->ai_addr, ai->ai_addrlen) == 0) {
+			break;
+		}
+		int err = errno;
+		close(fd);
+		errno = err;
+		fd = -1;
+	}
+	freeaddrinfo(result);
+	return fd;
+}
+#endif
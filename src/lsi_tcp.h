@@ -0,0 +1,28 @@
+#ifndef LSI_TCP_H__
+#define LSI_TCP_H__
+
+#include <stdlib.h>
+
+#define TCP_PREFIX     "tcp://"
+#define TCP_PREFIX_LEN 6
+
+typedef struct lsi_tcp_options {
+    int nodelay; // disable nagle, on by default
+    int reuse_port; // several listeners on one port, kernel balances accepts
+    int send_buffer; // SO_SNDBUF, 0 keeps the system default
+    int recv_buffer; // SO_RCVBUF
+} lsi_tcp_options;
+
+// whether endpoint is tcp://host:port
+int lsi_is_tcp_endpoint(const char* endpoint);
+void lsi_tcp_options_init(lsi_tcp_options* options);
+#ifndef _WIN32
+// both return socket fd or -1 with errno set (EINVAL for malformed
+// endpoints), host may be a name, an ipv4 address or [ipv6]
+int lsi_tcp_listen(const char* endpoint, const lsi_tcp_options* options);
+int lsi_tcp_connect(const char* endpoint, const lsi_tcp_options* options);
+// applies nodelay and buffer sizes, used for accepted sockets too
+void lsi_tcp_configure(int fd, const lsi_tcp_options* options);
+#endif
+
+#endif /* LSI_TCP_H__ */
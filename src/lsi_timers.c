@@ -0,0 +1,104 @@
+#include <string.h>
+#include "lsi_timers.h"
+
+void lsi_timers_init(lsi_timers *timers, uint64_t now)
+{
+	memset(timers, 0, sizeof(lsi_timers));
+	timers->current = now / TIMER_TICK_MS;
+}
+
+static void unlink_timer(lsi_timers *timers, lsi_timer *timer)
+{
+	size_t slot = (timer->expires + TIMER_TICK_MS - 1) / TIMER_TICK_MS %
+		      TIMER_SLOTS;
+	if (timer->prev != NULL) {
+		timer->prev->next = timer->next;
+	} else {
+		timers->slots[slot] = timer->next;
+	}
+	if (timer->next != NULL) {
+		timer->next->prev = timer->prev;
+	}
+	if (timers->slots[slot] == NULL) {
+		timers->occupied[slot / 64] &= ~((uint64_t)1 << (slot % 64));
+	}
+	timer->prev = NULL;
+	timer->next = NULL;
+	timer->expires = 0;
+	timers->count--;
+}
+
+void lsi_timer_schedule(lsi_timers *timers, lsi_timer *timer,
+			uint64_t expires)
+{
+	if (timer->expires != 0) {
+		unlink_timer(timers, timer);
+	}
+	// rounded up so the timer is due once its tick is reached
+	uint64_t tick = (expires + TIMER_TICK_MS - 1) / TIMER_TICK_MS;
+	if (tick <= timers->current) {
+		// already due, keep it in the next processed slot
+		tick = timers->current + 1;
+		expires = tick * TIMER_TICK_MS;
+	}
+	size_t slot = tick % TIMER_SLOTS;
+	timer->expires = expires;
+	timer->prev = NULL;
+	timer->next = timers->slots[slot];
+	if (timer->next != NULL) {
+		timer->next->prev = timer;
+	}
+	timers->slots[slot] = timer;
+	timers->occupied[slot / 64] |= (uint64_t)1 << (slot % 64);
+	timers->count++;
+}
+
+void lsi_timer_cancel(lsi_timers *timers, lsi_timer *timer)
+{
+	if (timer->expires != 0) {
+		unlink_timer(timers, timer);
+	}
+}
+
+int lsi_timers_timeout(lsi_timers *timers, uint64_t now)
+{
+	if (timers->count == 0) {
+		return -1;
+	}
+	for (size_t distance = 1; distance <= TIMER_SLOTS; distance++) {
+		size_t slot = (timers->current + distance) % TIMER_SLOTS;
+		uint64_t bits = timers->occupied[slot / 64] >> (slot % 64);
+		if (bits == 0) {
+			// skip rest of the bitmap word
+			distance += 63 - slot % 64;
+			continue;
+		}
+		if ((bits & 1) == 0) {
+			continue;
+		}
+		uint64_t due = (timers->current + distance) * TIMER_TICK_MS;
+		return due > now ? (int)(due - now) : 0;
+	}
+	return -1;
+}
+
+lsi_timer *lsi_timers_expire(lsi_timers *timers, uint64_t now)
+{
+	uint64_t now_tick = now / TIMER_TICK_MS;
+	if (now_tick - timers->current > TIMER_SLOTS) {
+		// every slot is visited once
+		timers->current = now_tick - TIMER_SLOTS;
+	}
+	while (timers->current < now_tick) {
+		size_t slot = (timers->current + 1) % TIMER_SLOTS;
+		for (lsi_timer *timer = timers->slots[slot]; timer != NULL;
+		     timer = timer->next) {
+			if (timer->expires <= now) {
+				unlink_timer(timers, timer);
+				return timer;
+			}
+		}
+		timers->current++;
+	}
+	return NULL;
+}
@@ -0,0 +1,35 @@
+#ifndef LSI_TIMERS_H__
+#define LSI_TIMERS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+// hashed timing wheel, timers further than one revolution stay in their slot
+// until the wheel comes around again
+#define TIMER_SLOTS   512
+#define TIMER_TICK_MS 10
+
+// embedded in the owner, see lsi_client
+typedef struct lsi_timer {
+    uint64_t expires; // absolute time in ms, 0 when not scheduled
+    struct lsi_timer* prev;
+    struct lsi_timer* next;
+} lsi_timer;
+
+typedef struct lsi_timers {
+    lsi_timer* slots[TIMER_SLOTS];
+    uint64_t occupied[TIMER_SLOTS / 64]; // bitmap of non empty slots
+    uint64_t current; // last processed tick
+    size_t count;
+} lsi_timers;
+
+void lsi_timers_init(lsi_timers* timers, uint64_t now);
+// (re)schedules timer to expire at given time
+void lsi_timer_schedule(lsi_timers* timers, lsi_timer* timer, uint64_t expires);
+void lsi_timer_cancel(lsi_timers* timers, lsi_timer* timer);
+// ms until the next slot with timers is due, -1 if there are no timers
+int lsi_timers_timeout(lsi_timers* timers, uint64_t now);
+// unlinks and returns one expired timer, NULL when none is left
+lsi_timer* lsi_timers_expire(lsi_timers* timers, uint64_t now);
+
+#endif /* LSI_TIMERS_H__ */
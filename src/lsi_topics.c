@@ -0,0 +1,114 @@
+#include <string.h>
+#include "lsi_topics.h"
+
+// FNV-1a
+static uint32_t hash_name(const char *name, size_t name_len)
+{
+	uint32_t hash = 2166136261u;
+	for (size_t i = 0; i < name_len; i++) {
+		hash ^= (unsigned char)name[i];
+		hash *= 16777619u;
+	}
+	return hash;
+}
+
+lsi_topic *lsi_topics_find(lsi_topics *topics, const char *name,
+			   size_t name_len)
+{
+	uint32_t hash = hash_name(name, name_len);
+	for (lsi_topic *topic = topics->buckets[hash % TOPIC_BUCKETS];
+	     topic != NULL; topic = topic->next) {
+		if (topic->hash == hash && topic->name_len == name_len &&
+		    memcmp(topic->name, name, name_len) == 0) {
+			return topic;
+		}
+	}
+	return NULL;
+}
+
+lsi_topic *lsi_topics_get(lsi_topics *topics, const char *name,
+			  size_t name_len)
+{
+	lsi_topic *topic = lsi_topics_find(topics, name, name_len);
+	if (topic != NULL) {
+		return topic;
+	}
+	topic = (lsi_topic *)calloc(1, sizeof(lsi_topic));
+	if (topic == NULL) {
+		return NULL;
+	}
+	topic->name = (char *)malloc(name_len + 1);
+	if (topic->name == NULL) {
+		free(topic);
+		return NULL;
+	}
+	memcpy(topic->name, name, name_len);
+	topic->name[name_len] = '\0';
+	topic->name_len = name_len;
+	topic->hash = hash_name(name, name_len);
+	lsi_topic **bucket = &topics->buckets[topic->hash % TOPIC_BUCKETS];
+	topic->next = *bucket;
+	*bucket = topic;
+	return topic;
+}
+
+int lsi_topic_add(lsi_topic *topic, struct lsi_client *client)
+{
+	for (size_t i = 0; i < topic->count; i++) {
+		if (topic->members[i] == client) {
+			return 0;
+		}
+	}
+	if (topic->count == topic->capacity) {
+		size_t capacity = topic->capacity == 0 ? 8 : topic->capacity * 2;
+		struct lsi_client **members = (struct lsi_client **)realloc(
+			topic->members, capacity * sizeof(struct lsi_client *));
+		if (members == NULL) {
+			return -1;
+		}
+		topic->members = members;
+		topic->capacity = capacity;
+	}
+	topic->members[topic->count++] = client;
+	return 0;
+}
+
+static void free_topic(lsi_topic *topic)
+{
+	free(topic->members);
+	free(topic->name);
+	free(topic);
+}
+
+void lsi_topic_remove(lsi_topics *topics, lsi_topic *topic,
+		      struct lsi_client *client)
+{
+	for (size_t i = 0; i < topic->count; i++) {
+		if (topic->members[i] == client) {
+			topic->members[i] = topic->members[--topic->count];
+			break;
+		}
+	}
+	if (topic->count > 0) {
+		return;
+	}
+	lsi_topic **link = &topics->buckets[topic->hash % TOPIC_BUCKETS];
+	while (*link != topic) {
+		link = &(*link)->next;
+	}
+	*link = topic->next;
+	free_topic(topic);
+}
+
+void lsi_topics_free(lsi_topics *topics)
+{
+	for (int i = 0; i < TOPIC_BUCKETS; i++) {
+		lsi_topic *topic = topics->buckets[i];
+		while (topic != NULL) {
+			lsi_topic *next = topic->next;
+			free_topic(topic);
+			topic = next;
+		}
+		topics->buckets[i] = NULL;
+	}
+}
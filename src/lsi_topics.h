@@ -0,0 +1,34 @@
+#ifndef LSI_TOPICS_H__
+#define LSI_TOPICS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define TOPIC_BUCKETS 64
+
+struct lsi_client;
+
+// named set of subscribed clients
+typedef struct lsi_topic {
+    char* name;
+    size_t name_len;
+    uint32_t hash;
+    struct lsi_client** members;
+    size_t count;
+    size_t capacity;
+    struct lsi_topic* next;
+} lsi_topic;
+
+typedef struct lsi_topics {
+    lsi_topic* buckets[TOPIC_BUCKETS];
+} lsi_topics;
+
+lsi_topic* lsi_topics_find(lsi_topics* topics, const char* name, size_t name_len);
+// finds topic or creates a new one
+lsi_topic* lsi_topics_get(lsi_topics* topics, const char* name, size_t name_len);
+int lsi_topic_add(lsi_topic* topic, struct lsi_client* client);
+// removes client from topic, frees the topic once it has no members
+void lsi_topic_remove(lsi_topics* topics, lsi_topic* topic, struct lsi_client* client);
+void lsi_topics_free(lsi_topics* topics);
+
+#endif /* LSI_TOPICS_H__ */
@@ -0,0 +1,399 @@
+#include <stdint.h>
+#include <string.h>
+#include "lsi_errors.h"
+#include "lsi_value.h"
+#include "lua.h"
+
+static int put_u8(lsi_buffer *buffer, uint8_t tag)
+{
+	return lsi_buffer_append(buffer, &tag, 1);
+}
+
+// writes tag followed by size bytes of value in big endian order
+static int put_tagged(lsi_buffer *buffer, uint8_t tag, uint64_t value,
+		      int size)
+{
+	if (lsi_buffer_reserve(buffer, 1 + size) == -1) {
+		return -1;
+	}
+	unsigned char *p = (unsigned char *)lsi_buffer_end(buffer);
+	p[0] = tag;
+	for (int i = 0; i < size; i++) {
+		p[1 + i] = (unsigned char)(value >> (8 * (size - 1 - i)));
+	}
+	buffer->len += 1 + size;
+	return 0;
+}
+
+static int put_integer(lsi_buffer *buffer, lua_Integer value)
+{
+	if (value >= 0) {
+		if (value < 128) {
+			return put_u8(buffer, (uint8_t)value);
+		}
+		if (value <= UINT8_MAX) {
+			return put_tagged(buffer, 0xcc, value, 1);
+		}
+		if (value <= UINT16_MAX) {
+			return put_tagged(buffer, 0xcd, value, 2);
+		}
+		if (value <= UINT32_MAX) {
+			return put_tagged(buffer, 0xce, value, 4);
+		}
+		return put_tagged(buffer, 0xcf, value, 8);
+	}
+	if (value >= -32) {
+		return put_u8(buffer, (uint8_t)value);
+	}
+	if (value >= INT8_MIN) {
+		return put_tagged(buffer, 0xd0, (uint8_t)value, 1);
+	}
+	if (value >= INT16_MIN) {
+		return put_tagged(buffer, 0xd1, (uint16_t)value, 2);
+	}
+	if (value >= INT32_MIN) {
+		return put_tagged(buffer, 0xd2, (uint32_t)value, 4);
+	}
+	return put_tagged(buffer, 0xd3, (uint64_t)value, 8);
+}
+
+static int put_number(lsi_buffer *buffer, lua_Number value)
+{
+	double d = (double)value;
+	uint64_t bits;
+	memcpy(&bits, &d, sizeof(bits));
+	return put_tagged(buffer, 0xcb, bits, 8);
+}
+
+static int put_header(lsi_buffer *buffer, size_t size, uint8_t fix,
+		      size_t fix_limit, uint8_t tag8, uint8_t tag16,
+		      uint8_t tag32)
+{
+	if (size < fix_limit) {
+		return put_u8(buffer, (uint8_t)(fix | size));
+	}
+	if (tag8 != 0 && size <= UINT8_MAX) {
+		return put_tagged(buffer, tag8, size, 1);
+	}
+	if (size <= UINT16_MAX) {
+		return put_tagged(buffer, tag16, size, 2);
+	}
+	return put_tagged(buffer, tag32, size, 4);
+}
+
+// returns array length if table is a sequence, -1 otherwise
+static lua_Integer sequence_length(lua_State *L, int idx, size_t *count)
+{
+	lua_Integer len = (lua_Integer)lua_rawlen(L, idx);
+	size_t n = 0;
+	int sequence = 1;
+	lua_pushnil(L);
+	while (lua_next(L, idx) != 0) {
+		n++;
+		if (sequence && (!lua_isinteger(L, -2) ||
+				 lua_tointeger(L, -2) < 1 ||
+				 lua_tointeger(L, -2) > len)) {
+			sequence = 0;
+		}
+		lua_pop(L, 1);
+	}
+	*count = n;
+	return sequence && (size_t)len == n ? len : -1;
+}
+
+static const char *encode(lua_State *L, int idx, lsi_buffer *buffer, int depth)
+{
+	int res = 0;
+	switch (lua_type(L, idx)) {
+	case LUA_TNIL:
+		res = put_u8(buffer, 0xc0);
+		break;
+	case LUA_TBOOLEAN:
+		res = put_u8(buffer, lua_toboolean(L, idx) ? 0xc3 : 0xc2);
+		break;
+	case LUA_TNUMBER:
+		res = lua_isinteger(L, idx) ?
+			      put_integer(buffer, lua_tointeger(L, idx)) :
+			      put_number(buffer, lua_tonumber(L, idx));
+		break;
+	case LUA_TSTRING: {
+		size_t len;
+		const char *str = lua_tolstring(L, idx, &len);
+		res = put_header(buffer, len, 0xa0, 32, 0xd9, 0xda, 0xdb);
+		if (res == 0) {
+			res = lsi_buffer_append(buffer, str, len);
+		}
+		break;
+	}
+	case LUA_TTABLE: {
+		if (depth >= VALUE_MAX_DEPTH) {
+			return ERROR_VALUE_TOO_DEEP;
+		}
+		if (!lua_checkstack(L, 3)) {
+			return ERROR_VALUE_TOO_DEEP;
+		}
+		size_t count;
+		lua_Integer len = sequence_length(L, idx, &count);
+		if (len >= 0) {
+			res = put_header(buffer, len, 0x90, 16, 0, 0xdc, 0xdd);
+			for (lua_Integer i = 1; res == 0 && i <= len; i++) {
+				lua_rawgeti(L, idx, i);
+				const char *err = encode(L, lua_gettop(L),
+							 buffer, depth + 1);
+				lua_pop(L, 1);
+				if (err != NULL) {
+					return err;
+				}
+			}
+			break;
+		}
+		res = put_header(buffer, count, 0x80, 16, 0, 0xde, 0xdf);
+		lua_pushnil(L);
+		while (res == 0 && lua_next(L, idx) != 0) {
+			int top = lua_gettop(L);
+			const char *err = encode(L, top - 1, buffer, depth + 1);
+			if (err == NULL) {
+				err = encode(L, top, buffer, depth + 1);
+			}
+			lua_pop(L, 1);
+			if (err != NULL) {
+				lua_pop(L, 1); // discard key
+				return err;
+			}
+		}
+		break;
+	}
+	default:
+		return ERROR_VALUE_UNSUPPORTED_TYPE;
+	}
+	return res == 0 ? NULL : ERROR_OUT_OF_MEMORY;
+}
+
+const char *lsi_value_encode(lua_State *L, int idx, lsi_buffer *buffer)
+{
+	size_t len = buffer->len;
+	const char *err = encode(L, lua_absindex(L, idx), buffer, 0);
+	if (err != NULL) {
+		buffer->len = len; // drop partially encoded value
+	}
+	return err;
+}
+
+static uint64_t get_be(const unsigned char *p, int size)
+{
+	uint64_t value = 0;
+	for (int i = 0; i < size; i++) {
+		value = (value << 8) | p[i];
+	}
+	return value;
+}
+
+// describes encoding of value starting with tag
+// header: bytes after tag holding the length/payload, size: fixed payload
+// items: number of nested values (maps count key and value)
+typedef struct value_layout {
+	int header;
+	uint64_t size;
+	uint64_t items;
+} value_layout;
+
+// returns 0 on success, 1 if more data is needed and -1 for invalid tag
+static int layout(const unsigned char *p, size_t len, value_layout *l)
+{
+	uint8_t tag = p[0];
+	l->header = 0;
+	l->size = 0;
+	l->items = 0;
+	if (tag <= 0x7f || tag >= 0xe0 || tag == 0xc0 || tag == 0xc2 ||
+	    tag == 0xc3) {
+		return 0;
+	}
+	if ((tag & 0xe0) == 0xa0) {
+		l->size = tag & 0x1f;
+		return 0;
+	}
+	if ((tag & 0xf0) == 0x90) {
+		l->items = tag & 0x0f;
+		return 0;
+	}
+	if ((tag & 0xf0) == 0x80) {
+		l->items = (uint64_t)(tag & 0x0f) * 2;
+		return 0;
+	}
+	int lensize = 0;
+	switch (tag) {
+	case 0xcc:
+	case 0xd0:
+		l->size = 1;
+		return 0;
+	case 0xcd:
+	case 0xd1:
+		l->size = 2;
+		return 0;
+	case 0xca:
+	case 0xce:
+	case 0xd2:
+		l->size = 4;
+		return 0;
+	case 0xcb:
+	case 0xcf:
+	case 0xd3:
+		l->size = 8;
+		return 0;
+	case 0xc4:
+	case 0xd9:
+		lensize = 1;
+		break;
+	case 0xc5:
+	case 0xda:
+	case 0xdc:
+	case 0xde:
+		lensize = 2;
+		break;
+	case 0xc6:
+	case 0xdb:
+	case 0xdd:
+	case 0xdf:
+		lensize = 4;
+		break;
+	default:
+		return -1;
+	}
+	if (len < 1 + (size_t)lensize) {
+		return 1;
+	}
+	uint64_t n = get_be(p + 1, lensize);
+	l->header = lensize;
+	if (tag == 0xdc || tag == 0xdd) {
+		l->items = n;
+	} else if (tag == 0xde || tag == 0xdf) {
+		l->items = n * 2;
+	} else {
+		l->size = n;
+	}
+	return 0;
+}
+
+int lsi_value_scan(const char *data, size_t len, size_t *size)
+{
+	lsi_value_scanner scanner = { 0, 0 };
+	return lsi_value_scan_next(&scanner, data, len, 0, size);
+}
+
+int lsi_value_scan_next(lsi_value_scanner *scanner, const char *data,
+			size_t len, size_t max_size, size_t *size)
+{
+	const unsigned char *p = (const unsigned char *)data;
+	if (scanner->pos == 0 && scanner->pending == 0) {
+		scanner->pending = 1;
+	}
+	while (scanner->pending > 0) {
+		// every pending value takes at least one more byte
+		if (max_size > 0 &&
+		    scanner->pending > max_size - scanner->pos) {
+			return VALUE_TOO_LARGE;
+		}
+		if (scanner->pos >= len) {
+			return 0;
+		}
+		value_layout l;
+		int res = layout(p + scanner->pos, len - scanner->pos, &l);
+		if (res != 0) {
+			return res == 1 ? 0 : -1;
+		}
+		uint64_t total = 1 + l.header + l.size;
+		if (max_size > 0 && total > max_size - scanner->pos) {
+			return VALUE_TOO_LARGE;
+		}
+		if (total > len - scanner->pos) {
+			return 0;
+		}
+		scanner->pos += total;
+		scanner->pending = scanner->pending - 1 + l.items;
+	}
+	*size = scanner->pos;
+	scanner->pos = 0;
+	return 1;
+}
+
+static size_t decode(lua_State *L, const unsigned char *p, int depth)
+{
+	value_layout l;
+	layout(p, SIZE_MAX, &l);
+	const unsigned char *payload = p + 1 + l.header;
+	size_t used = 1 + l.header + l.size;
+	uint8_t tag = p[0];
+
+	if (tag <= 0x7f) {
+		lua_pushinteger(L, tag);
+	} else if (tag >= 0xe0) {
+		lua_pushinteger(L, (int8_t)tag);
+	} else if (tag == 0xc0) {
+		lua_pushnil(L);
+	} else if (tag == 0xc2 || tag == 0xc3) {
+		lua_pushboolean(L, tag == 0xc3);
+	} else if ((tag & 0xe0) == 0xa0 || tag == 0xd9 || tag == 0xda ||
+		   tag == 0xdb || tag == 0xc4 || tag == 0xc5 || tag == 0xc6) {
+		lua_pushlstring(L, (const char *)payload, l.size);
+	} else if (tag >= 0xcc && tag <= 0xcf) {
+		uint64_t value = get_be(payload, l.size);
+		if (value > INT64_MAX) {
+			lua_pushnumber(L, (lua_Number)value);
+		} else {
+			lua_pushinteger(L, (lua_Integer)value);
+		}
+	} else if (tag >= 0xd0 && tag <= 0xd3) {
+		uint64_t value = get_be(payload, l.size);
+		int shift = 64 - 8 * (int)l.size;
+		// sign extend
+		lua_pushinteger(L, (lua_Integer)((int64_t)(value << shift) >>
+						 shift));
+	} else if (tag == 0xca) {
+		uint32_t bits = (uint32_t)get_be(payload, 4);
+		float f;
+		memcpy(&f, &bits, sizeof(f));
+		lua_pushnumber(L, f);
+	} else if (tag == 0xcb) {
+		uint64_t bits = get_be(payload, 8);
+		double d;
+		memcpy(&d, &bits, sizeof(d));
+		lua_pushnumber(L, d);
+	} else {
+		int is_map = (tag & 0xf0) == 0x80 || tag == 0xde ||
+			     tag == 0xdf;
+		uint64_t count = is_map ? l.items / 2 : l.items;
+		if (depth >= VALUE_MAX_DEPTH || !lua_checkstack(L, 3)) {
+			// too deep to be materialized, skip its content
+			size_t skipped;
+			lsi_value_scan((const char *)p, SIZE_MAX, &skipped);
+			lua_pushnil(L);
+			return skipped;
+		}
+		lua_createtable(L, is_map ? 0 : (int)count,
+				is_map ? (int)count : 0);
+		for (uint64_t i = 0; i < count; i++) {
+			if (is_map) {
+				used += decode(L, p + used, depth + 1);
+				used += decode(L, p + used, depth + 1);
+				if (lua_isnil(L, -2) ||
+				    (lua_type(L, -2) == LUA_TNUMBER &&
+				     lua_tonumber(L, -2) !=
+					     lua_tonumber(L, -2))) {
+					lua_pop(L, 2); // nil and NaN keys
+				} else {
+					lua_rawset(L, -3);
+				}
+			} else {
+				used += decode(L, p + used, depth + 1);
+				lua_rawseti(L, -2, (lua_Integer)i + 1);
+			}
+		}
+	}
+	return used;
+}
+
+void lsi_value_decode(lua_State *L, const char *data, size_t len)
+{
+	(void)len; // completeness is guaranteed by lsi_value_scan
+	decode(L, (const unsigned char *)data, 0);
+}
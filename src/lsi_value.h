@@ -0,0 +1,32 @@
+#ifndef LSI_VALUE_H__
+#define LSI_VALUE_H__
+
+#include "lsi_buffer.h"
+#include "lua.h"
+
+// MessagePack compatible encoding of lua values
+// (nil, booleans, numbers, strings and tables)
+
+#define VALUE_MAX_DEPTH 64
+#define VALUE_TOO_LARGE -2
+
+// progress of a value arriving in pieces, zeroed before the first piece
+typedef struct lsi_value_scanner {
+    size_t pos; // bytes of complete items scanned so far
+    uint64_t pending; // values still to be read
+} lsi_value_scanner;
+
+// appends value at idx to buffer, returns NULL on success or error message
+const char* lsi_value_encode(lua_State* L, int idx, lsi_buffer* buffer);
+// checks whether data starts with a complete value
+// returns 1 and its size, 0 if more data is needed or -1 if data is invalid
+int lsi_value_scan(const char* data, size_t len, size_t* size);
+// lsi_value_scan continuing where the previous call stopped, data has to
+// start with the same value, returns VALUE_TOO_LARGE as soon as the value is
+// known to exceed max_size (0 means unlimited), the scanner is reset once
+// a value is complete and has to be zeroed after a failure
+int lsi_value_scan_next(lsi_value_scanner* scanner, const char* data, size_t len, size_t max_size, size_t* size);
+// pushes value from data which has to be complete (see lsi_value_scan)
+void lsi_value_decode(lua_State* L, const char* data, size_t len);
+
+#endif /* LSI_VALUE_H__ */
@@ -0,0 +1,279 @@
+#include <errno.h>
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_buffer.h"
+#include "lsi_value.h"
+#include "lsi_workers.h"
+#include "lua.h"
+#include "lualib.h"
+
+#ifndef _WIN32
+#include <fcntl.h>
+#include <unistd.h>
+
+static lsi_job *job_new(const char *data, size_t size)
+{
+	lsi_job *job = (lsi_job *)malloc(sizeof(lsi_job) + size);
+	if (job == NULL) {
+		return NULL;
+	}
+	memset(job, 0, sizeof(lsi_job));
+	job->size = size;
+	memcpy(job->data, data, size);
+	return job;
+}
+
+static void queue_push(lsi_job_queue *queue, lsi_job *job)
+{
+	job->next = NULL;
+	if (queue->tail != NULL) {
+		queue->tail->next = job;
+	} else {
+		queue->head = job;
+	}
+	queue->tail = job;
+}
+
+static void queue_free(lsi_job_queue *queue)
+{
+	while (queue->head != NULL) {
+		lsi_job *next = queue->head->next;
+		free(queue->head);
+		queue->head = next;
+	}
+	queue->tail = NULL;
+}
+
+static void post_reply(lsi_workers *pool, lsi_job *reply)
+{
+	pthread_mutex_lock(&pool->lock);
+	int was_empty = pool->replies.head == NULL;
+	queue_push(&pool->replies, reply);
+	pthread_mutex_unlock(&pool->lock);
+	if (was_empty) {
+		// one byte per batch, the server drains all replies at once
+		char byte = 1;
+		while (write(pool->wake[1], &byte, 1) == -1 && errno == EINTR) {
+		}
+	}
+}
+
+// runs handler kept at stack index 1 and builds reply, NULL for no reply
+static lsi_job *run_job(lsi_workers *pool, lua_State *L, lsi_job *job)
+{
+	lua_pushvalue(L, 1);
+	if (pool->values) {
+		lsi_value_decode(L, job->data, job->size);
+	} else {
+		lua_pushlstring(L, job->data, job->size);
+	}
+	lua_pushinteger(L, job->clientid);
+	lsi_job *reply = NULL;
+	if (lua_pcall(L, 2, 1, 0) != LUA_OK) {
+		size_t len;
+		const char *msg = lua_tolstring(L, -1, &len);
+		reply = job_new(msg != NULL ? msg : "worker failed",
+				msg != NULL ? len : strlen("worker failed"));
+		if (reply != NULL) {
+			reply->failed = 1;
+		}
+	} else if (pool->values && !lua_isnil(L, -1)) {
+		lsi_buffer buffer = { 0 };
+		const char *err = lsi_value_encode(L, -1, &buffer);
+		if (err != NULL) {
+			reply = job_new(err, strlen(err));
+			if (reply != NULL) {
+				reply->failed = 1;
+			}
+		} else {
+			reply = job_new(lsi_buffer_begin(&buffer),
+					lsi_buffer_size(&buffer));
+		}
+		lsi_buffer_free(&buffer);
+	} else if (lua_type(L, -1) == LUA_TSTRING) {
+		size_t len;
+		const char *data = lua_tolstring(L, -1, &len);
+		reply = job_new(data, len);
+	}
+	lua_settop(L, 1);
+	if (reply != NULL) {
+		reply->client = job->client;
+		reply->serial = job->serial;
+		reply->clientid = job->clientid;
+	}
+	return reply;
+}
+
+static void *worker_main(void *arg)
+{
+	lsi_worker *worker = (lsi_worker *)arg;
+	lua_State *L = worker->L;
+	for (;;) {
+		pthread_mutex_lock(&worker->lock);
+		while (worker->jobs.head == NULL && !worker->stop) {
+			pthread_cond_wait(&worker->ready, &worker->lock);
+		}
+		lsi_job *job = worker->jobs.head;
+		if (job == NULL) {
+			pthread_mutex_unlock(&worker->lock);
+			break;
+		}
+		worker->jobs.head = job->next;
+		if (worker->jobs.head == NULL) {
+			worker->jobs.tail = NULL;
+		}
+		pthread_mutex_unlock(&worker->lock);
+
+		lsi_job *reply = run_job(worker->pool, L, job);
+		free(job);
+		if (reply != NULL) {
+			post_reply(worker->pool, reply);
+		}
+	}
+	return NULL;
+}
+
+// creates lua state with the handler at stack index 1
+static lua_State *load_handler(const char *module, const char *path,
+			       const char *cpath, char **err)
+{
+	lua_State *L = luaL_newstate();
+	if (L == NULL) {
+		*err = strdup("out of memory");
+		return NULL;
+	}
+	luaL_openlibs(L);
+	// resolve modules the same way as the creating state
+	lua_getglobal(L, "package");
+	if (path != NULL) {
+		lua_pushstring(L, path);
+		lua_setfield(L, -2, "path");
+	}
+	if (cpath != NULL) {
+		lua_pushstring(L, cpath);
+		lua_setfield(L, -2, "cpath");
+	}
+	lua_pop(L, 1);
+
+	lua_getglobal(L, "require");
+	lua_pushstring(L, module);
+	if (lua_pcall(L, 1, 1, 0) != LUA_OK) {
+		const char *msg = lua_tostring(L, -1);
+		*err = strdup(msg != NULL ? msg : "failed to load module");
+		lua_close(L);
+		return NULL;
+	}
+	if (lua_istable(L, -1)) {
+		lua_getfield(L, -1, "handle");
+		lua_remove(L, -2);
+	}
+	if (!lua_isfunction(L, -1)) {
+		*err = strdup("worker module must return handler function");
+		lua_close(L);
+		return NULL;
+	}
+	return L;
+}
+
+lsi_workers *lsi_workers_start(const char *module, size_t count, int values,
+			       const char *path, const char *cpath, char **err)
+{
+	*err = NULL;
+	lsi_workers *pool = (lsi_workers *)calloc(1, sizeof(lsi_workers));
+	if (pool == NULL) {
+		return NULL;
+	}
+	pool->values = values;
+	pool->workers = (lsi_worker *)calloc(count, sizeof(lsi_worker));
+	if (pool->workers == NULL || pipe(pool->wake) == -1) {
+		free(pool->workers);
+		free(pool);
+		return NULL;
+	}
+	fcntl(pool->wake[0], F_SETFL, O_NONBLOCK);
+	fcntl(pool->wake[0], F_SETFD, FD_CLOEXEC);
+	fcntl(pool->wake[1], F_SETFD, FD_CLOEXEC);
+	pthread_mutex_init(&pool->lock, NULL);
+	// states are loaded up front so module errors are reported by listen
+	for (size_t i = 0; i < count; i++) {
+		lsi_worker *worker = &pool->workers[i];
+		worker->pool = pool;
+		worker->L = load_handler(module, path, cpath, err);
+		if (worker->L == NULL) {
+			lsi_workers_stop(pool);
+			return NULL;
+		}
+		pthread_mutex_init(&worker->lock, NULL);
+		pthread_cond_init(&worker->ready, NULL);
+		if (pthread_create(&worker->thread, NULL, worker_main,
+				   worker) != 0) {
+			pthread_cond_destroy(&worker->ready);
+			pthread_mutex_destroy(&worker->lock);
+			lua_close(worker->L);
+			worker->L = NULL;
+			lsi_workers_stop(pool);
+			return NULL;
+		}
+		pool->count++;
+	}
+	return pool;
+}
+
+int lsi_workers_submit(lsi_workers *pool, size_t worker_index,
+		       struct lsi_client *client, uint64_t serial,
+		       int clientid, const char *data, size_t size)
+{
+	lsi_job *job = job_new(data, size);
+	if (job == NULL) {
+		return -1;
+	}
+	job->client = client;
+	job->serial = serial;
+	job->clientid = clientid;
+	lsi_worker *worker = &pool->workers[worker_index];
+	pthread_mutex_lock(&worker->lock);
+	queue_push(&worker->jobs, job);
+	pthread_cond_signal(&worker->ready);
+	pthread_mutex_unlock(&worker->lock);
+	return 0;
+}
+
+lsi_job *lsi_workers_replies(lsi_workers *pool)
+{
+	char drain[64];
+	while (read(pool->wake[0], drain, sizeof(drain)) > 0) {
+	}
+	pthread_mutex_lock(&pool->lock);
+	lsi_job *replies = pool->replies.head;
+	pool->replies.head = NULL;
+	pool->replies.tail = NULL;
+	pthread_mutex_unlock(&pool->lock);
+	return replies;
+}
+
+void lsi_workers_stop(lsi_workers *pool)
+{
+	// count only covers workers with a running thread
+	for (size_t i = 0; i < pool->count; i++) {
+		lsi_worker *worker = &pool->workers[i];
+		pthread_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		pthread_cond_signal(&worker->ready);
+		pthread_mutex_unlock(&worker->lock);
+	}
+	for (size_t i = 0; i < pool->count; i++) {
+		lsi_worker *worker = &pool->workers[i];
+		pthread_join(worker->thread, NULL);
+		queue_free(&worker->jobs);
+		pthread_cond_destroy(&worker->ready);
+		pthread_mutex_destroy(&worker->lock);
+		lua_close(worker->L);
+	}
+	queue_free(&pool->replies);
+	pthread_mutex_destroy(&pool->lock);
+	close(pool->wake[0]);
+	close(pool->wake[1]);
+	free(pool->workers);
+	free(pool);
+}
+#endif
@@ -0,0 +1,64 @@
+#ifndef LSI_WORKERS_H__
+#define LSI_WORKERS_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+#include "lua.h"
+
+#ifndef _WIN32
+#include <pthread.h>
+
+struct lsi_client;
+
+// message for a worker or reply for the server, client is only dereferenced
+// by the server thread and checked against serial before use
+typedef struct lsi_job {
+    struct lsi_client* client;
+    uint64_t serial;
+    int clientid;
+    int failed; // data holds error message
+    struct lsi_job* next;
+    size_t size;
+    char data[];
+} lsi_job;
+
+typedef struct lsi_job_queue {
+    lsi_job* head;
+    lsi_job* tail;
+} lsi_job_queue;
+
+typedef struct lsi_worker {
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    lsi_job_queue jobs;
+    int stop;
+    lua_State* L; // owned by the worker thread
+    struct lsi_workers* pool;
+} lsi_worker;
+
+typedef struct lsi_workers {
+    lsi_worker* workers;
+    size_t count;
+    int values; // messages and replies are lsi_value encoded
+    pthread_mutex_t lock; // guards replies
+    lsi_job_queue replies;
+    int wake[2]; // pipe, read end becomes readable when replies are queued
+} lsi_workers;
+
+// loads module in count fresh lua states, the module returns handler
+// function(message, clientid) whose return value is sent back to the client
+// on failure returns NULL and sets err to a message to be freed by caller
+lsi_workers* lsi_workers_start(const char* module, size_t count, int values, const char* path, const char* cpath,
+                               char** err);
+// queues copy of data for the worker, returns -1 on failure
+int lsi_workers_submit(lsi_workers* pool, size_t worker, struct lsi_client* client, uint64_t serial, int clientid,
+                       const char* data, size_t size);
+// takes all queued replies, free each with free()
+lsi_job* lsi_workers_replies(lsi_workers* pool);
+// runs already queued jobs, joins threads and frees the pool, pending
+// replies are dropped
+void lsi_workers_stop(lsi_workers* pool);
+#endif
+
+#endif /* LSI_WORKERS_H__ */
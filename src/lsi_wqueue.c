@@ -0,0 +1,248 @@
+#include <errno.h>
+#include <string.h>
+#include "lsi_pool.h"
+#include "lsi_wqueue.h"
+
+#ifndef _WIN32
+#include <sys/socket.h>
+#include <sys/uio.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/sendfile.h>
+#endif
+#endif
+
+#ifndef MSG_NOSIGNAL
+#define MSG_NOSIGNAL 0
+#endif
+
+lsi_payload *lsi_payload_new(const char *data, size_t size)
+{
+	return lsi_payload_new_pooled(NULL, data, size);
+}
+
+lsi_payload *lsi_payload_new_pooled(lsi_pool *pool, const char *data,
+				    size_t size)
+{
+	size_t capacity = sizeof(lsi_payload) + size;
+	lsi_payload *payload =
+		pool != NULL ? (lsi_payload *)lsi_pool_alloc(pool, &capacity) :
+			       (lsi_payload *)malloc(capacity);
+	if (payload == NULL) {
+		return NULL;
+	}
+	payload->refcount = 1;
+	payload->size = size;
+	payload->pool = pool;
+	payload->capacity = capacity;
+	if (data != NULL) {
+		memcpy(payload->data, data, size);
+	}
+	return payload;
+}
+
+void lsi_payload_retain(lsi_payload *payload)
+{
+	payload->refcount++;
+}
+
+void lsi_payload_release(lsi_payload *payload)
+{
+	if (--payload->refcount > 0) {
+		return;
+	}
+	if (payload->pool != NULL) {
+		lsi_pool_release(payload->pool, payload, payload->capacity);
+	} else {
+		free(payload);
+	}
+}
+
+int lsi_wqueue_push(lsi_wqueue *queue, lsi_payload *payload)
+{
+	lsi_wqueue_entry *entry =
+		(lsi_wqueue_entry *)malloc(sizeof(lsi_wqueue_entry));
+	if (entry == NULL) {
+		return -1;
+	}
+	memset(entry, 0, sizeof(lsi_wqueue_entry));
+	lsi_payload_retain(payload);
+	entry->payload = payload;
+	if (queue->tail != NULL) {
+		queue->tail->next = entry;
+	} else {
+		queue->head = entry;
+	}
+	queue->tail = entry;
+	queue->size += payload->size;
+	return 0;
+}
+
+int lsi_wqueue_push_copy(lsi_wqueue *queue, const char *data, size_t size)
+{
+	lsi_payload *payload = lsi_payload_new_pooled(queue->pool, data, size);
+	if (payload == NULL) {
+		return -1;
+	}
+	int res = lsi_wqueue_push(queue, payload);
+	lsi_payload_release(payload);
+	return res;
+}
+
+static void pop_entry(lsi_wqueue *queue)
+{
+	lsi_wqueue_entry *entry = queue->head;
+	queue->head = entry->next;
+	if (queue->head == NULL) {
+		queue->tail = NULL;
+	}
+	if (entry->payload != NULL) {
+		lsi_payload_release(entry->payload);
+	}
+#ifndef _WIN32
+	else if (entry->owns_fd) {
+		close(entry->file_fd);
+	}
+#endif
+	free(entry);
+}
+
+#ifndef _WIN32
+int lsi_wqueue_push_file(lsi_wqueue *queue, int file_fd, uint64_t offset,
+			 size_t length, int owns_fd)
+{
+	lsi_wqueue_entry *entry =
+		(lsi_wqueue_entry *)malloc(sizeof(lsi_wqueue_entry));
+	if (entry == NULL) {
+		return -1;
+	}
+	memset(entry, 0, sizeof(lsi_wqueue_entry));
+	entry->file_fd = file_fd;
+	entry->owns_fd = owns_fd;
+	entry->file_offset = offset;
+	entry->file_remaining = length;
+	if (queue->tail != NULL) {
+		queue->tail->next = entry;
+	} else {
+		queue->head = entry;
+	}
+	queue->tail = entry;
+	queue->size += length;
+	return 0;
+}
+
+long lsi_send_file(int sock_fd, int file_fd, uint64_t *offset, size_t count)
+{
+#ifdef __linux__
+	off_t off = (off_t)*offset;
+	ssize_t sent = sendfile(sock_fd, file_fd, &off, count);
+	if (sent > 0) {
+		*offset = (uint64_t)off;
+	}
+	return sent;
+#else
+	char chunk[FILE_CHUNK_SIZE];
+	if (count > sizeof(chunk)) {
+		count = sizeof(chunk);
+	}
+	ssize_t got = pread(file_fd, chunk, count, (off_t)*offset);
+	if (got <= 0) {
+		return got;
+	}
+	ssize_t sent = send(sock_fd, chunk, got, MSG_NOSIGNAL);
+	if (sent > 0) {
+		*offset += sent;
+	}
+	return sent;
+#endif
+}
+
+// sends file range at the head of the queue
+// returns 0 when done, 1 when the socket is full and -1 on failure
+static int flush_file(lsi_wqueue *queue, int fd)
+{
+	lsi_wqueue_entry *entry = queue->head;
+	while (entry->file_remaining > 0) {
+		long sent = lsi_send_file(fd, entry->file_fd,
+					  &entry->file_offset,
+					  entry->file_remaining);
+		if (sent == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return errno == EAGAIN || errno == EWOULDBLOCK ? 1 : -1;
+		}
+		if (sent == 0) {
+			// file is shorter than requested
+			queue->size -= entry->file_remaining;
+			entry->file_remaining = 0;
+			break;
+		}
+		entry->file_remaining -= sent;
+		queue->size -= sent;
+	}
+	pop_entry(queue);
+	return 0;
+}
+
+int lsi_wqueue_flush(lsi_wqueue *queue, int fd)
+{
+	while (queue->head != NULL) {
+		if (queue->head->payload == NULL) {
+			int res = flush_file(queue, fd);
+			if (res != 0) {
+				return res;
+			}
+			continue;
+		}
+		struct iovec iov[WQUEUE_MAX_IOV];
+		int iovcnt = 0;
+		// gather payloads up to the next file range
+		for (lsi_wqueue_entry *entry = queue->head;
+		     entry != NULL && entry->payload != NULL &&
+		     iovcnt < WQUEUE_MAX_IOV;
+		     entry = entry->next) {
+			iov[iovcnt].iov_base =
+				entry->payload->data + entry->offset;
+			iov[iovcnt].iov_len =
+				entry->payload->size - entry->offset;
+			iovcnt++;
+		}
+		struct msghdr msg;
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_iov = iov;
+		msg.msg_iovlen = iovcnt;
+		ssize_t written =
+			sendmsg(fd, &msg, MSG_DONTWAIT | MSG_NOSIGNAL);
+		if (written == -1) {
+			if (errno == EINTR) {
+				continue;
+			}
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				return 1;
+			}
+			return -1;
+		}
+		queue->size -= written;
+		while (written > 0) {
+			lsi_wqueue_entry *entry = queue->head;
+			size_t left = entry->payload->size - entry->offset;
+			if ((size_t)written < left) {
+				entry->offset += written;
+				break;
+			}
+			written -= left;
+			pop_entry(queue);
+		}
+	}
+	return 0;
+}
+#endif
+
+void lsi_wqueue_clear(lsi_wqueue *queue)
+{
+	while (queue->head != NULL) {
+		pop_entry(queue);
+	}
+	queue->size = 0;
+}
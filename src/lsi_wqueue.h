@@ -0,0 +1,62 @@
+#ifndef LSI_WQUEUE_H__
+#define LSI_WQUEUE_H__
+
+#include <stdint.h>
+#include <stdlib.h>
+
+#define WQUEUE_MAX_IOV    64
+#define FILE_CHUNK_SIZE   65536 // used when sendfile is not available
+
+struct lsi_pool;
+
+// immutable refcounted data shared by all queues it was pushed to
+typedef struct lsi_payload {
+    size_t refcount;
+    size_t size;
+    struct lsi_pool* pool; // returned there once released, NULL if malloced
+    size_t capacity; // pooled block size
+    char data[];
+} lsi_payload;
+
+typedef struct lsi_wqueue_entry {
+    lsi_payload* payload; // NULL for file ranges
+    size_t offset; // bytes of payload already written
+    // file range sent with sendfile
+    int file_fd;
+    int owns_fd;
+    uint64_t file_offset;
+    size_t file_remaining;
+    struct lsi_wqueue_entry* next;
+} lsi_wqueue_entry;
+
+// outbound data waiting for the fd to become writable
+typedef struct lsi_wqueue {
+    lsi_wqueue_entry* head;
+    lsi_wqueue_entry* tail;
+    size_t size; // pending bytes
+    struct lsi_pool* pool; // copies are borrowed from it when set
+} lsi_wqueue;
+
+lsi_payload* lsi_payload_new(const char* data, size_t size);
+// payload borrowed from pool, plain lsi_payload_new when pool is NULL
+lsi_payload* lsi_payload_new_pooled(struct lsi_pool* pool, const char* data, size_t size);
+void lsi_payload_retain(lsi_payload* payload);
+void lsi_payload_release(lsi_payload* payload);
+
+// appends payload (retained) to the queue
+int lsi_wqueue_push(lsi_wqueue* queue, lsi_payload* payload);
+// copies data into a new payload and appends it
+int lsi_wqueue_push_copy(lsi_wqueue* queue, const char* data, size_t size);
+#ifndef _WIN32
+// appends file range, file_fd is closed once sent if owns_fd is set
+int lsi_wqueue_push_file(lsi_wqueue* queue, int file_fd, uint64_t offset, size_t length, int owns_fd);
+// moves up to count bytes from file to socket in kernel space where possible
+// returns bytes sent and advances offset, -1 on failure (see errno)
+long lsi_send_file(int sock_fd, int file_fd, uint64_t* offset, size_t count);
+// writes as much as possible without blocking
+// returns 0 when drained, 1 when data is still pending or -1 on failure
+int lsi_wqueue_flush(lsi_wqueue* queue, int fd);
+#endif
+void lsi_wqueue_clear(lsi_wqueue* queue);
+
+#endif /* LSI_WQUEUE_H__ */
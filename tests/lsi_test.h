@@ -0,0 +1,89 @@
+#ifndef LSI_TEST_H__
+#define LSI_TEST_H__
+
+#include <stdio.h>
+
+// each test is a program, failed checks are reported and make main fail
+static int lsi_test_failures = 0;
+
+#define CHECK(cond)                                                      \
+    do {                                                                 \
+        if (!(cond)) {                                                   \
+            fprintf(stderr, "%s:%d: check failed: %s\n", __FILE__,       \
+                    __LINE__, #cond);                                    \
+            lsi_test_failures++;                                         \
+        }                                                                \
+    } while (0)
+
+#define TEST_RESULT() (lsi_test_failures == 0 ? 0 : 1)
+
+#ifndef _WIN32
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+#include "lsi_buffer.h"
+#include "lsi_tcp.h"
+#include "lsi_wqueue.h"
+
+// connected tcp sockets over 127.0.0.1, fds[0] is the connecting side
+static inline int lsi_test_tcp_pair(int fds[2])
+{
+    lsi_tcp_options options;
+    lsi_tcp_options_init(&options);
+    int listener = lsi_tcp_listen("tcp://127.0.0.1:0", &options);
+    if (listener == -1) {
+        return -1;
+    }
+    struct sockaddr_in addr;
+    socklen_t addr_len = sizeof(addr);
+    if (getsockname(listener, (struct sockaddr*)&addr, &addr_len) == -1) {
+        close(listener);
+        return -1;
+    }
+    char endpoint[64];
+    snprintf(endpoint, sizeof(endpoint), "tcp://127.0.0.1:%d", ntohs(addr.sin_port));
+    fds[0] = lsi_tcp_connect(endpoint, &options);
+    fds[1] = fds[0] == -1 ? -1 : accept(listener, NULL, NULL);
+    close(listener);
+    return fds[0] == -1 || fds[1] == -1 ? -1 : 0;
+}
+
+// flushes queue to wfd while reading rfd into buffer until the queue is
+// drained and buffer holds at least expected bytes, both fds are switched
+// to non-blocking so that a single thread can do both sides
+static inline int lsi_test_transfer(lsi_wqueue* queue, int wfd, int rfd, lsi_buffer* buffer, size_t expected)
+{
+    fcntl(wfd, F_SETFL, fcntl(wfd, F_GETFL, 0) | O_NONBLOCK);
+    fcntl(rfd, F_SETFL, fcntl(rfd, F_GETFL, 0) | O_NONBLOCK);
+    for (int idle = 0; idle < 500;) {
+        int res = lsi_wqueue_flush(queue, wfd);
+        if (res == -1) {
+            return -1;
+        }
+        if (res == 0 && lsi_buffer_size(buffer) >= expected) {
+            return 0;
+        }
+        if (lsi_buffer_reserve(buffer, 65536) == -1) {
+            return -1;
+        }
+        ssize_t count = read(rfd, lsi_buffer_end(buffer), 65536);
+        if (count > 0) {
+            buffer->len += count;
+            idle = 0;
+        } else if (count == 0 || (errno != EAGAIN && errno != EWOULDBLOCK)) {
+            return -1;
+        } else {
+            struct pollfd pfd = { .fd = rfd, .events = POLLIN };
+            poll(&pfd, 1, 10);
+            idle++;
+        }
+    }
+    return -1;
+}
+#endif
+
+#endif /* LSI_TEST_H__ */
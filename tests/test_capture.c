@@ -0,0 +1,80 @@
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "lsi_capture.h"
+#include "lsi_test.h"
+
+static void temp_path(char *path, size_t size)
+{
+	const char *dir = getenv("TMPDIR");
+	snprintf(path, size, "%s/lsi_capture_%d.cap", dir ? dir : "/tmp",
+		 (int)getpid());
+}
+
+// records come back as written, payloads only when requested
+static void test_round_trip(const char *path, int payloads)
+{
+	lsi_capture capture;
+	CHECK(lsi_capture_create(&capture, path, payloads) == 0);
+	CHECK(lsi_capture_write(&capture, CAPTURE_OPEN, 7, NULL, 0) == 0);
+	CHECK(lsi_capture_write(&capture, CAPTURE_DATA, 7, "hello", 5) == 0);
+	CHECK(lsi_capture_write(&capture, CAPTURE_DATA, 9, "", 0) == 0);
+	CHECK(lsi_capture_write(&capture, CAPTURE_CLOSE, 7, NULL, 0) == 0);
+	lsi_capture_close(&capture);
+
+	CHECK(lsi_capture_open(&capture, path) == 0);
+	CHECK(capture.flags == (payloads ? CAPTURE_PAYLOADS : 0));
+	lsi_capture_record record;
+	uint64_t time_us = 0;
+	CHECK(lsi_capture_next(&capture, &record) == 1);
+	CHECK(record.type == CAPTURE_OPEN && record.connection == 7);
+	time_us = record.time_us;
+	CHECK(lsi_capture_next(&capture, &record) == 1);
+	CHECK(record.type == CAPTURE_DATA && record.connection == 7);
+	CHECK(record.size == 5 && record.time_us >= time_us);
+	if (payloads) {
+		CHECK(record.data != NULL &&
+		      memcmp(record.data, "hello", 5) == 0);
+	} else {
+		CHECK(record.data == NULL);
+	}
+	CHECK(lsi_capture_next(&capture, &record) == 1);
+	CHECK(record.type == CAPTURE_DATA && record.connection == 9 &&
+	      record.size == 0);
+	CHECK(lsi_capture_next(&capture, &record) == 1);
+	CHECK(record.type == CAPTURE_CLOSE);
+	CHECK(lsi_capture_next(&capture, &record) == 0);
+	lsi_capture_close(&capture);
+}
+
+// a record cut short is reported, anything else is no capture at all
+static void test_invalid(const char *path)
+{
+	lsi_capture capture;
+	CHECK(lsi_capture_create(&capture, path, 1) == 0);
+	CHECK(lsi_capture_write(&capture, CAPTURE_DATA, 1, "abcdef", 6) == 0);
+	lsi_capture_close(&capture);
+	CHECK(truncate(path, CAPTURE_HEADER_SIZE + CAPTURE_RECORD_SIZE + 3) ==
+	      0);
+	CHECK(lsi_capture_open(&capture, path) == 0);
+	lsi_capture_record record;
+	CHECK(lsi_capture_next(&capture, &record) == -1);
+	lsi_capture_close(&capture);
+
+	FILE *file = fopen(path, "wb");
+	CHECK(file != NULL);
+	fputs("not a capture file", file);
+	fclose(file);
+	CHECK(lsi_capture_open(&capture, path) == -1);
+}
+
+int main(void)
+{
+	char path[256];
+	temp_path(path, sizeof(path));
+	test_round_trip(path, 1);
+	test_round_trip(path, 0);
+	test_invalid(path);
+	unlink(path);
+	return TEST_RESULT();
+}
@@ -0,0 +1,82 @@
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include "lsi_inbox.h"
+#include "lsi_test.h"
+
+#define PRODUCERS 4
+#define POSTS     1000
+
+static void *produce(void *arg)
+{
+	lsi_inbox *inbox = (lsi_inbox *)arg;
+	for (int i = 0; i < POSTS; i++) {
+		char data[16];
+		int size = snprintf(data, sizeof(data), "%d", i);
+		while (lsi_inbox_post(inbox, i % 3, data, size) == -1) {
+		}
+	}
+	lsi_inbox_release(inbox);
+	return NULL;
+}
+
+// posts of several threads all arrive, in order per producer
+static void test_producers(void)
+{
+	lsi_inbox *inbox = lsi_inbox_new();
+	CHECK(inbox != NULL);
+	pthread_t threads[PRODUCERS];
+	for (int i = 0; i < PRODUCERS; i++) {
+		lsi_inbox_retain(inbox);
+		pthread_create(&threads[i], NULL, produce, inbox);
+	}
+	int received = 0;
+	int sum = 0;
+	while (received < PRODUCERS * POSTS) {
+		struct pollfd pfd = { .fd = inbox->wake_fd, .events = POLLIN };
+		poll(&pfd, 1, 100);
+		lsi_inbox_begin_drain(inbox);
+		lsi_post *post;
+		while ((post = lsi_inbox_pop(inbox)) != NULL) {
+			char data[16];
+			memcpy(data, post->data, post->size);
+			data[post->size] = '\0';
+			CHECK(post->clientid == atoi(data) % 3);
+			sum += atoi(data);
+			received++;
+			free(post);
+		}
+	}
+	for (int i = 0; i < PRODUCERS; i++) {
+		pthread_join(threads[i], NULL);
+	}
+	CHECK(sum == PRODUCERS * (POSTS * (POSTS - 1) / 2));
+	lsi_inbox_begin_drain(inbox);
+	CHECK(lsi_inbox_pop(inbox) == NULL);
+	lsi_inbox_release(inbox);
+}
+
+// handles are looked up in the registry and never outlive the inbox
+static void test_registry(void)
+{
+	lsi_inbox *inbox = lsi_inbox_new();
+	lsi_inbox *other = lsi_inbox_new();
+	CHECK(inbox != NULL && other != NULL && inbox->id != other->id);
+	CHECK(lsi_inbox_acquire(inbox->id) == inbox);
+	CHECK(atomic_load(&inbox->refcount) == 2);
+	uint64_t id = inbox->id;
+	lsi_inbox_release(inbox);
+	lsi_inbox_release(inbox);
+	CHECK(lsi_inbox_acquire(id) == NULL);
+	CHECK(lsi_inbox_acquire(0) == NULL);
+	CHECK(lsi_inbox_acquire(other->id) == other);
+	lsi_inbox_release(other);
+	lsi_inbox_release(other);
+}
+
+int main(void)
+{
+	test_producers();
+	test_registry();
+	return TEST_RESULT();
+}
@@ -0,0 +1,193 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lsi_common.h"
+#include "lsi_mux.h"
+#include "lsi_test.h"
+
+#define BULK_SIZE (200 * 1024)
+
+// frames everything the mux can send and moves it to the peer's buffer
+static void send_all(lsi_mux *mux, int fds[2], lsi_buffer *in)
+{
+	lsi_wqueue queue;
+	memset(&queue, 0, sizeof(queue));
+	for (;;) {
+		long added = lsi_mux_fill(mux, &queue, MUX_WINDOW);
+		CHECK(added >= 0);
+		if (added <= 0) {
+			break;
+		}
+		size_t expected = lsi_buffer_size(in) + queue.size;
+		CHECK(lsi_test_transfer(&queue, fds[0], fds[1], in, expected) ==
+		      0);
+	}
+}
+
+// a message pushed while a bulk transfer is under way overtakes it and
+// both arrive intact
+static void test_priorities(int fds[2])
+{
+	lsi_mux *tx = lsi_mux_new(0);
+	lsi_mux *rx = lsi_mux_new(1);
+	char *bulk = (char *)malloc(BULK_SIZE);
+	for (size_t i = 0; i < BULK_SIZE; i++) {
+		bulk[i] = (char)(i % 251);
+	}
+	uint32_t bulk_stream = lsi_mux_open(tx);
+	uint32_t urgent_stream = lsi_mux_open(tx);
+	CHECK(bulk_stream == 1 && urgent_stream == 3);
+	CHECK(lsi_mux_push(tx, bulk_stream, MUX_PRIORITIES - 1, bulk,
+			   BULK_SIZE) == 0);
+
+	// first window of the bulk message is on the wire already
+	lsi_wqueue queue;
+	memset(&queue, 0, sizeof(queue));
+	lsi_buffer in;
+	memset(&in, 0, sizeof(in));
+	CHECK(lsi_mux_fill(tx, &queue, MUX_WINDOW) > 0);
+	CHECK(lsi_test_transfer(&queue, fds[0], fds[1], &in, queue.size) == 0);
+	CHECK(lsi_mux_push(tx, urgent_stream, 0, "urgent", 6) == 0);
+	send_all(tx, fds, &in);
+	CHECK(tx->queued == 0 && tx->pending == 0);
+
+	uint32_t stream;
+	lsi_buffer *message;
+	CHECK(lsi_mux_receive(rx, &in, &stream, &message) == 1);
+	CHECK(stream == urgent_stream);
+	CHECK(lsi_buffer_size(message) == 6 &&
+	      memcmp(lsi_buffer_begin(message), "urgent", 6) == 0);
+	CHECK(lsi_mux_receive(rx, &in, &stream, &message) == 1);
+	CHECK(stream == bulk_stream);
+	CHECK(lsi_buffer_size(message) == BULK_SIZE &&
+	      memcmp(lsi_buffer_begin(message), bulk, BULK_SIZE) == 0);
+	CHECK(lsi_mux_receive(rx, &in, &stream, &message) == 0);
+	CHECK(rx->buffered == 0 && rx->partials == 0);
+
+	lsi_buffer_free(&in);
+	free(bulk);
+	lsi_mux_free(tx);
+	lsi_mux_free(rx);
+}
+
+// the sender stops at the granted credits and resumes once consumed
+// messages are granted back
+static void test_credits(int fds[2])
+{
+	lsi_mux *tx = lsi_mux_new(0);
+	lsi_mux *rx = lsi_mux_new(1);
+	lsi_buffer to_rx;
+	memset(&to_rx, 0, sizeof(to_rx));
+	lsi_buffer to_tx;
+	memset(&to_tx, 0, sizeof(to_tx));
+	lsi_wqueue queue;
+	memset(&queue, 0, sizeof(queue));
+
+	lsi_mux_set_window(rx, 2, 1024);
+	char grant[MUX_GRANT_SIZE];
+	lsi_mux_grant(rx, grant);
+	CHECK(lsi_wqueue_push_copy(&queue, grant, MUX_GRANT_SIZE) == 0);
+	CHECK(lsi_test_transfer(&queue, fds[1], fds[0], &to_tx,
+				MUX_GRANT_SIZE) == 0);
+	CHECK(lsi_mux_process(tx, &to_tx) == 0);
+	CHECK(tx->limited && tx->credit_messages == 2 &&
+	      tx->credit_bytes == 1024);
+
+	uint32_t stream = lsi_mux_open(tx);
+	for (int i = 0; i < 3; i++) {
+		CHECK(lsi_mux_can_push(tx) == (i < 2));
+		CHECK(lsi_mux_push(tx, stream, MUX_DEFAULT_PRIORITY, "abc",
+				   3) == 0);
+	}
+	send_all(tx, fds, &to_rx);
+	CHECK(tx->blocked && tx->queued == 1);
+
+	uint32_t id;
+	lsi_buffer *message;
+	int consumed = 0;
+	int grant_due = 0;
+	while (lsi_mux_receive(rx, &to_rx, &id, &message) == 1) {
+		consumed++;
+		grant_due = lsi_mux_consumed(rx, lsi_buffer_size(message));
+	}
+	CHECK(consumed == 2 && grant_due);
+
+	lsi_mux_grant(rx, grant);
+	CHECK(lsi_wqueue_push_copy(&queue, grant, MUX_GRANT_SIZE) == 0);
+	CHECK(lsi_test_transfer(&queue, fds[1], fds[0], &to_tx,
+				MUX_GRANT_SIZE) == 0);
+	CHECK(lsi_mux_process(tx, &to_tx) == 0);
+	send_all(tx, fds, &to_rx);
+	CHECK(tx->queued == 0);
+	CHECK(lsi_mux_receive(rx, &to_rx, &id, &message) == 1);
+	CHECK(id == stream && lsi_buffer_size(message) == 3);
+
+	lsi_buffer_free(&to_rx);
+	lsi_buffer_free(&to_tx);
+	lsi_mux_free(tx);
+	lsi_mux_free(rx);
+}
+
+static void append_frame(lsi_buffer *in, uint32_t stream, const char *data,
+			 uint32_t size, int last)
+{
+	char header[MUX_HEADER_SIZE];
+	lsi_put_u32(header, stream);
+	lsi_put_u32(header + 4, size | (last ? MUX_FLAG_END : 0));
+	lsi_buffer_append(in, header, MUX_HEADER_SIZE);
+	lsi_buffer_append(in, data, size);
+}
+
+// peers ignoring the limits are reported instead of buffered
+static void test_limits(void)
+{
+	lsi_mux *rx = lsi_mux_new(1);
+	lsi_buffer in;
+	memset(&in, 0, sizeof(in));
+	lsi_mux_set_max_message(rx, 8);
+	append_frame(&in, 1, "12345", 5, 0);
+	append_frame(&in, 1, "6789", 4, 1);
+	CHECK(lsi_mux_process(rx, &in) == MUX_TOO_LARGE);
+	lsi_mux_free(rx);
+	lsi_buffer_free(&in);
+
+	rx = lsi_mux_new(1);
+	for (uint32_t i = 0; i <= MUX_MAX_PARTIALS; i++) {
+		append_frame(&in, 2 * i + 1, "x", 1, 0);
+	}
+	CHECK(lsi_mux_process(rx, &in) == MUX_TOO_LARGE);
+	CHECK(rx->partials == MUX_MAX_PARTIALS);
+	lsi_mux_free(rx);
+	lsi_buffer_free(&in);
+
+	rx = lsi_mux_new(1);
+	char grant[MUX_GRANT_SIZE];
+	lsi_mux_set_window(rx, 1, 1024);
+	lsi_mux_grant(rx, grant);
+	append_frame(&in, 1, "a", 1, 1);
+	append_frame(&in, 1, "b", 1, 1);
+	CHECK(lsi_mux_process(rx, &in) == MUX_NO_CREDIT);
+	lsi_mux_free(rx);
+	lsi_buffer_free(&in);
+
+	// a bad grant frame is malformed input
+	rx = lsi_mux_new(1);
+	append_frame(&in, MUX_CONTROL_STREAM, "1234", 4, 1);
+	CHECK(lsi_mux_process(rx, &in) == -1);
+	lsi_mux_free(rx);
+	lsi_buffer_free(&in);
+}
+
+int main(void)
+{
+	int fds[2];
+	CHECK(lsi_test_tcp_pair(fds) == 0);
+	if (lsi_test_failures > 0) {
+		return TEST_RESULT();
+	}
+	test_priorities(fds);
+	test_credits(fds);
+	test_limits();
+	close(fds[0]);
+	close(fds[1]);
+	return TEST_RESULT();
+}
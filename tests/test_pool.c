@@ -0,0 +1,100 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lsi_pool.h"
+#include "lsi_test.h"
+
+// blocks are rounded to their size class and reused once released
+static void test_size_classes(void)
+{
+	lsi_pool pool;
+	lsi_pool_init(&pool, POOL_DEFAULT_CACHE);
+	size_t size = 100;
+	void *block = lsi_pool_alloc(&pool, &size);
+	CHECK(block != NULL && size == 128);
+	CHECK(pool.in_use == 128 && pool.misses == 1);
+	lsi_pool_release(&pool, block, size);
+	CHECK(pool.in_use == 0 && pool.cached == 128);
+
+	size_t again = 65;
+	void *reused = lsi_pool_alloc(&pool, &again);
+	CHECK(reused == block && again == 128 && pool.hits == 1);
+	lsi_pool_release(&pool, reused, again);
+
+	// beyond the largest class blocks are not cached
+	size_t large = (size_t)1 << (POOL_MIN_SHIFT + POOL_CLASSES);
+	void *direct = lsi_pool_alloc(&pool, &large);
+	CHECK(direct != NULL && pool.in_use == large);
+	lsi_pool_release(&pool, direct, large);
+	CHECK(pool.in_use == 0 && pool.cached == 128);
+	lsi_pool_free(&pool);
+	CHECK(pool.cached == 0);
+}
+
+// the cache never grows past max_cached
+static void test_cache_limit(void)
+{
+	lsi_pool pool;
+	lsi_pool_init(&pool, 256);
+	void *blocks[4];
+	for (int i = 0; i < 4; i++) {
+		size_t size = 128;
+		blocks[i] = lsi_pool_alloc(&pool, &size);
+	}
+	for (int i = 0; i < 4; i++) {
+		lsi_pool_release(&pool, blocks[i], 128);
+	}
+	CHECK(pool.in_use == 0 && pool.cached == 256);
+	lsi_pool_free(&pool);
+}
+
+// pooled copies and buffers are handed back once the data went out
+static void test_round_trip(int fds[2])
+{
+	lsi_pool pool;
+	lsi_pool_init(&pool, POOL_DEFAULT_CACHE);
+	lsi_wqueue queue;
+	memset(&queue, 0, sizeof(queue));
+	queue.pool = &pool;
+	lsi_buffer in;
+	memset(&in, 0, sizeof(in));
+	in.pool = &pool;
+
+	char message[1000];
+	size_t total = 0;
+	for (int round = 0; round < 2; round++) {
+		for (int i = 0; i < 50; i++) {
+			memset(message, 'a' + i % 26, sizeof(message));
+			CHECK(lsi_wqueue_push_copy(&queue, message,
+						   sizeof(message)) == 0);
+			total += sizeof(message);
+		}
+		CHECK(pool.in_use > 0);
+		CHECK(lsi_test_transfer(&queue, fds[0], fds[1], &in, total) ==
+		      0);
+	}
+	CHECK(lsi_buffer_size(&in) == total);
+	// payloads of the second round came from the cache
+	CHECK(pool.hits >= 50);
+	for (size_t i = 0; i < total; i += sizeof(message)) {
+		CHECK(lsi_buffer_begin(&in)[i] ==
+		      (char)('a' + (i / 1000) % 50 % 26));
+	}
+	lsi_buffer_free(&in);
+	CHECK(pool.in_use == 0);
+	lsi_pool_free(&pool);
+}
+
+int main(void)
+{
+	test_size_classes();
+	test_cache_limit();
+	int fds[2];
+	CHECK(lsi_test_tcp_pair(fds) == 0);
+	if (lsi_test_failures > 0) {
+		return TEST_RESULT();
+	}
+	test_round_trip(fds);
+	close(fds[0]);
+	close(fds[1]);
+	return TEST_RESULT();
+}
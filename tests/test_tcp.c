@@ -0,0 +1,114 @@
+#include <stdlib.h>
+#include <string.h>
+#include "lsi_common.h"
+#include "lsi_test.h"
+
+#define BULK_SIZE (300 * 1024)
+
+static void fill_pattern(char *data, size_t size, unsigned seed)
+{
+	for (size_t i = 0; i < size; i++) {
+		data[i] = (char)((i * 31 + seed) & 0xff);
+	}
+}
+
+// payloads queued on one side arrive in order on the other
+static void test_queue_round_trip(int fds[2])
+{
+	char *bulk = (char *)malloc(BULK_SIZE);
+	fill_pattern(bulk, BULK_SIZE, 7);
+	lsi_wqueue queue;
+	memset(&queue, 0, sizeof(queue));
+	CHECK(lsi_wqueue_push_copy(&queue, "hello ", 6) == 0);
+	CHECK(lsi_wqueue_push_copy(&queue, bulk, BULK_SIZE) == 0);
+	CHECK(queue.size == 6 + BULK_SIZE);
+
+	lsi_buffer in;
+	memset(&in, 0, sizeof(in));
+	CHECK(lsi_test_transfer(&queue, fds[0], fds[1], &in, 6 + BULK_SIZE) ==
+	      0);
+	CHECK(queue.size == 0);
+	CHECK(lsi_buffer_size(&in) == 6 + BULK_SIZE);
+	CHECK(memcmp(lsi_buffer_begin(&in), "hello ", 6) == 0);
+	CHECK(memcmp(lsi_buffer_begin(&in) + 6, bulk, BULK_SIZE) == 0);
+	lsi_buffer_free(&in);
+	free(bulk);
+}
+
+// file ranges go out with sendfile, in order with the payloads around them
+static void test_file_round_trip(int fds[2])
+{
+	char *content = (char *)malloc(BULK_SIZE);
+	fill_pattern(content, BULK_SIZE, 11);
+	FILE *file = tmpfile();
+	CHECK(file != NULL);
+	CHECK(fwrite(content, 1, BULK_SIZE, file) == BULK_SIZE);
+	fflush(file);
+
+	lsi_wqueue queue;
+	memset(&queue, 0, sizeof(queue));
+	size_t offset = 1000;
+	size_t length = BULK_SIZE - 2000;
+	CHECK(lsi_wqueue_push_copy(&queue, "<", 1) == 0);
+	CHECK(lsi_wqueue_push_file(&queue, fileno(file), offset, length, 0) ==
+	      0);
+	CHECK(lsi_wqueue_push_copy(&queue, ">", 1) == 0);
+
+	lsi_buffer in;
+	memset(&in, 0, sizeof(in));
+	CHECK(lsi_test_transfer(&queue, fds[0], fds[1], &in, length + 2) ==
+	      0);
+	CHECK(lsi_buffer_size(&in) == length + 2);
+	const char *data = lsi_buffer_begin(&in);
+	CHECK(data[0] == '<' && data[length + 1] == '>');
+	CHECK(memcmp(data + 1, content + offset, length) == 0);
+	lsi_buffer_free(&in);
+	fclose(file);
+	free(content);
+}
+
+// messages with u64 length prefixes as written for decode = "stream"
+static void test_length_prefix_framing(int fds[2])
+{
+	const char *messages[] = { "", "a", "length prefixed message" };
+	lsi_wqueue queue;
+	memset(&queue, 0, sizeof(queue));
+	size_t total = 0;
+	for (int i = 0; i < 3; i++) {
+		char header[8];
+		size_t size = strlen(messages[i]);
+		lsi_put_u64(header, size);
+		CHECK(lsi_wqueue_push_copy(&queue, header, 8) == 0);
+		CHECK(lsi_wqueue_push_copy(&queue, messages[i], size) == 0);
+		total += 8 + size;
+	}
+	lsi_buffer in;
+	memset(&in, 0, sizeof(in));
+	CHECK(lsi_test_transfer(&queue, fds[0], fds[1], &in, total) == 0);
+	for (int i = 0; i < 3; i++) {
+		CHECK(lsi_buffer_size(&in) >= 8);
+		uint64_t size = lsi_get_u64(lsi_buffer_begin(&in));
+		CHECK(size == strlen(messages[i]));
+		CHECK(lsi_buffer_size(&in) >= 8 + size);
+		CHECK(memcmp(lsi_buffer_begin(&in) + 8, messages[i], size) ==
+		      0);
+		lsi_buffer_consume(&in, 8 + size);
+	}
+	CHECK(lsi_buffer_size(&in) == 0);
+	lsi_buffer_free(&in);
+}
+
+int main(void)
+{
+	int fds[2];
+	CHECK(lsi_test_tcp_pair(fds) == 0);
+	if (lsi_test_failures > 0) {
+		return TEST_RESULT();
+	}
+	test_queue_round_trip(fds);
+	test_file_round_trip(fds);
+	test_length_prefix_framing(fds);
+	close(fds[0]);
+	close(fds[1]);
+	return TEST_RESULT();
+}
@@ -0,0 +1,95 @@
+#include <string.h>
+#include "lauxlib.h"
+#include "lsi_value.h"
+#include "lsi_test.h"
+#include "lua.h"
+#include "lualib.h"
+
+// encodes the value returned by chunk, decodes it again and returns the
+// encoded size, the decoded value is left on the stack
+static size_t round_trip(lua_State *L, const char *chunk, lsi_buffer *encoded)
+{
+	CHECK(luaL_dostring(L, chunk) == LUA_OK);
+	CHECK(lsi_value_encode(L, -1, encoded) == NULL);
+	lua_pop(L, 1);
+	size_t size = 0;
+	CHECK(lsi_value_scan(lsi_buffer_begin(encoded),
+			     lsi_buffer_size(encoded), &size) == 1);
+	CHECK(size == lsi_buffer_size(encoded));
+	lsi_value_decode(L, lsi_buffer_begin(encoded), size);
+	return size;
+}
+
+static void test_round_trip(lua_State *L)
+{
+	lsi_buffer encoded;
+	memset(&encoded, 0, sizeof(encoded));
+	round_trip(L,
+		   "return { 1, 'two', 3.5, true, false, -7,"
+		   " nested = { x = 2^40, s = string.rep('a', 300) } }",
+		   &encoded);
+	lua_setglobal(L, "v");
+	CHECK(luaL_dostring(L,
+			    "return v[1] == 1 and v[2] == 'two' and v[3] == 3.5"
+			    " and v[4] == true and v[5] == false and v[6] == -7"
+			    " and v.nested.x == 2^40"
+			    " and v.nested.s == string.rep('a', 300)") ==
+	      LUA_OK);
+	CHECK(lua_toboolean(L, -1));
+	lua_pop(L, 1);
+	lsi_buffer_free(&encoded);
+
+	round_trip(L, "return nil", &encoded);
+	CHECK(lua_isnil(L, -1));
+	lua_pop(L, 1);
+	lsi_buffer_free(&encoded);
+}
+
+// values arriving a byte at a time are only complete with the last byte
+static void test_pieces(lua_State *L)
+{
+	lsi_buffer encoded;
+	memset(&encoded, 0, sizeof(encoded));
+	size_t total = round_trip(
+		L, "local t = {} for i = 1, 100 do t[i] = { i, tostring(i) } end"
+		   " return t",
+		&encoded);
+	lua_pop(L, 1);
+	lsi_value_scanner scanner;
+	memset(&scanner, 0, sizeof(scanner));
+	size_t size = 0;
+	for (size_t len = 1; len < total; len++) {
+		CHECK(lsi_value_scan_next(&scanner, lsi_buffer_begin(&encoded),
+					  len, 0, &size) == 0);
+	}
+	CHECK(lsi_value_scan_next(&scanner, lsi_buffer_begin(&encoded), total,
+				  0, &size) == 1);
+	CHECK(size == total);
+	CHECK(scanner.pos == 0 && scanner.pending == 0);
+
+	// the limit is hit before the whole value arrived
+	memset(&scanner, 0, sizeof(scanner));
+	CHECK(lsi_value_scan_next(&scanner, lsi_buffer_begin(&encoded),
+				  total / 2, total / 4, &size) ==
+	      VALUE_TOO_LARGE);
+	lsi_buffer_free(&encoded);
+}
+
+// garbage is rejected by the scanner instead of being decoded
+static void test_invalid(void)
+{
+	const char invalid[] = { (char)0xc1 };
+	size_t size;
+	CHECK(lsi_value_scan(invalid, sizeof(invalid), &size) == -1);
+}
+
+int main(void)
+{
+	lua_State *L = luaL_newstate();
+	luaL_openlibs(L);
+	test_round_trip(L);
+	test_pieces(L);
+	test_invalid();
+	lua_close(L);
+	return TEST_RESULT();
+}